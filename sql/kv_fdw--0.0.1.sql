@@ -20,4 +20,83 @@ LANGUAGE C STRICT;
 
 CREATE EVENT TRIGGER kv_ddl_event_end
 ON ddl_command_end
-EXECUTE PROCEDURE kv_ddl_event_end_trigger();
\ No newline at end of file
+EXECUTE PROCEDURE kv_ddl_event_end_trigger();
+CREATE FUNCTION kv_stat_get_tables(OUT relid oid,
+                                   OUT gets bigint,
+                                   OUT multigets bigint,
+                                   OUT multiget_keys bigint,
+                                   OUT seeks bigint,
+                                   OUT rows_scanned bigint,
+                                   OUT puts bigint,
+                                   OUT deletes bigint,
+                                   OUT bytes_read bigint,
+                                   OUT bytes_written bigint,
+                                   OUT get_latency bigint[],
+                                   OUT multiget_latency bigint[],
+                                   OUT seek_latency bigint[],
+                                   OUT put_latency bigint[],
+                                   OUT delete_latency bigint[])
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW kv_stat_tables AS
+  SELECT s.relid,
+         n.nspname AS schemaname,
+         c.relname,
+         s.gets,
+         s.multigets,
+         s.multiget_keys,
+         s.seeks,
+         s.rows_scanned,
+         s.puts,
+         s.deletes,
+         s.bytes_read,
+         s.bytes_written,
+         s.get_latency,
+         s.multiget_latency,
+         s.seek_latency,
+         s.put_latency,
+         s.delete_latency
+  FROM kv_stat_get_tables() s
+    JOIN pg_class c ON c.oid = s.relid
+    LEFT JOIN pg_namespace n ON n.oid = c.relnamespace;
+
+CREATE FUNCTION kv_stat_reset()
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION kv_rocksdb_properties(regclass,
+                                      OUT name text,
+                                      OUT value text)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION kv_rocksdb_stats(regclass,
+                                 OUT name text,
+                                 OUT count bigint,
+                                 OUT sum bigint,
+                                 OUT p50 float8,
+                                 OUT p95 float8,
+                                 OUT p99 float8,
+                                 OUT max float8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION kv_memory_usage(OUT memtables bigint,
+                                OUT unflushed_memtables bigint,
+                                OUT table_readers bigint,
+                                OUT block_cache bigint,
+                                OUT block_cache_pinned bigint,
+                                OUT total bigint)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION kv_truncate(regclass)
+RETURNS bigint
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
@@ -1,79 +1,1576 @@
 
+#include "rocksdb/cache.h"
+#include "rocksdb/compaction_filter.h"
+#include "rocksdb/convenience.h"
 #include "rocksdb/db.h"
+#include "rocksdb/env.h"
+#include "rocksdb/experimental.h"
+#include "rocksdb/filter_policy.h"
+#include "rocksdb/iostats_context.h"
 #include "rocksdb/options.h"
+#include "rocksdb/perf_context.h"
+#include "rocksdb/perf_level.h"
+#include "rocksdb/rate_limiter.h"
+#include "rocksdb/statistics.h"
+#include "rocksdb/table.h"
+#include "rocksdb/utilities/memory_util.h"
+#include "rocksdb/utilities/write_batch_with_index.h"
+#include "rocksdb/write_buffer_manager.h"
+#include "rocksdb/table_properties.h"
+#include "rocksdb/utilities/table_properties_collectors.h"
+#include "rocksdb/write_batch.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
 using namespace rocksdb;
 using namespace std;
 
 #include "kv.h"
 
+/*
+ * The rows of a table are stored in the default column family, and the exact
+ * row count in a separate metadata column family, so that no row key can
+ * collide with it. The count is written in the same WriteBatch as the row it
+ * accounts for, and cached in the handle, as only one process at a time can
+ * open a database for writing.
+ *
+ * The tables of a server using the database layout share one database
+ * instead. Each of them stores its rows in a column family named after it,
+ * and its row count under its own key of the metadata column family.
+ */
+static const char* META_FAMILY = "kv_meta";
+static const char* ROW_COUNT_KEY = "row_count";
+
+/*
+ * The values of a table that expires rows end with the time they were
+ * written, in seconds since the epoch. Whether they do is decided when the
+ * table is first opened empty with a ttl, and recorded under this key of
+ * the metadata, as the values can't be told apart otherwise.
+ */
+static const char* TIMESTAMPS_KEY = "timestamps";
+
+/*
+ * The version of the encoding of the keys, recorded under this key of the
+ * metadata when a table is created. Tables written before it was recorded
+ * stored their keys in the in-tuple representation, which doesn't sort like
+ * the values, and can't be read.
+ */
+static const char* FORMAT_KEY = "format";
+static const char* FORMAT_VERSION = "2";
+
+/* entries the deletes of the deletion_trigger option are counted in */
+static const size_t DELETION_WINDOW = 128 * 1024;
+static const size_t TIMESTAMP_SIZE = sizeof(int64_t);
+
+static int64_t CurrentTime() {
+    return chrono::duration_cast<chrono::seconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static int64_t WriteTime(const Slice& value) {
+    int64_t written = 0;
+    if (value.size() >= TIMESTAMP_SIZE) {
+        memcpy(&written, value.data() + value.size() - TIMESTAMP_SIZE,
+               TIMESTAMP_SIZE);
+    }
+    return written;
+}
+
+/*
+ * Drops the rows written at or before the cutoff during compactions, and
+ * counts them, so that they can be uncounted from the table.
+ */
+class ExpiryFilter : public CompactionFilter {
+  public:
+    ExpiryFilter(int64_t cutoff, atomic<int64_t>* dropped)
+        : cutoff_(cutoff), dropped_(dropped) {}
+
+    bool Filter(int level, const Slice& key, const Slice& value,
+                string* newValue, bool* valueChanged) const override {
+        if (WriteTime(value) > cutoff_) return false;
+        dropped_->fetch_add(1, memory_order_relaxed);
+        return true;
+    }
+
+    const char* Name() const override { return "kv_fdw.ExpiryFilter"; }
+
+  private:
+    int64_t cutoff_;
+    atomic<int64_t>* dropped_;
+};
+
+/*
+ * Creates the expiry filters of the column families of a database that
+ * expire rows, and keeps the number of rows they dropped from each column
+ * family. Compactions run in background threads, hence the mutex.
+ */
+class ExpiryFilterFactory : public CompactionFilterFactory {
+  public:
+    void SetTTL(uint32_t family, int64_t ttl) {
+        lock_guard<mutex> lock(mutex_);
+        if (ttl > 0) {
+            ttls_[family] = ttl;
+            unique_ptr<atomic<int64_t>>& dropped = dropped_[family];
+            if (!dropped) dropped.reset(new atomic<int64_t>(0));
+        } else {
+            ttls_.erase(family);
+        }
+    }
+
+    bool Expires() {
+        lock_guard<mutex> lock(mutex_);
+        return !ttls_.empty();
+    }
+
+    /* Returns the rows dropped from the column family since the last call. */
+    int64_t TakeDropped(uint32_t family) {
+        lock_guard<mutex> lock(mutex_);
+        auto found = dropped_.find(family);
+        if (found == dropped_.end()) return 0;
+        return found->second->exchange(0);
+    }
+
+    unique_ptr<CompactionFilter> CreateCompactionFilter(
+        const CompactionFilter::Context& context) override {
+        lock_guard<mutex> lock(mutex_);
+        auto found = ttls_.find(context.column_family_id);
+        if (found == ttls_.end()) return nullptr;
+        return unique_ptr<CompactionFilter>(
+            new ExpiryFilter(CurrentTime() - found->second,
+                             dropped_[context.column_family_id].get()));
+    }
+
+    const char* Name() const override { return "kv_fdw.ExpiryFilterFactory"; }
+
+  private:
+    mutex mutex_;
+    map<uint32_t, int64_t> ttls_;
+    map<uint32_t, unique_ptr<atomic<int64_t>>> dropped_;
+};
+
+struct KVHandle;
+
+/*
+ * A database opened for writing, by one table or shared by the tables of a
+ * server. A backend opens it once, with all its column families, and closes
+ * it when the last of its tables is closed.
+ *
+ * While statements modify its tables, their writes are collected in one
+ * indexed batch, so that the rows and row counts they write are seen by the
+ * later writes of the statements, and are written with a single WAL write
+ * once the last of them ends. Each writer sets a save point, so that the
+ * writes of a writer that fails can be rolled back on their own.
+ */
+struct KVInstance {
+    string path;
+    DB* db;
+    ColumnFamilyHandle* meta;
+    map<string, ColumnFamilyHandle*> families;
+    int refCount;
+    unordered_set<KVHandle*> handles;
+    unique_ptr<WriteBatchWithIndex> pending;    /* NULL without writers */
+    int writers;
+    shared_ptr<ExpiryFilterFactory> expiry;
+};
+
+static map<string, KVInstance*> instances;
+
+struct KVHandle {
+    DB* db;
+    ColumnFamilyHandle* data;
+    ColumnFamilyHandle* meta;   /* NULL if a read-only database has none */
+    KVInstance* instance;       /* NULL if opened read-only */
+    string rowCountKey;
+    int64_t rowCount;
+    bool timestamped;           /* the values end with their write time */
+    int64_t ttl;                /* 0 if rows don't expire */
+
+    /* rows deleted by the current statements, and their key range */
+    uint64_t deletes;
+    string firstDeleted;
+    string lastDeleted;
+    KVOpStats* stats;           /* NULL if operations aren't counted */
+    shared_ptr<Statistics> statistics;  /* NULL if opened read-only */
+};
+
+/* An iterator over the rows, with the counters of the table it reads. */
+struct KVIterator {
+    Iterator* it;
+    KVOpStats* stats;
+    bool timestamped;
+    int64_t cutoff;             /* rows written until then have expired */
+};
+
+static DB* GetDB(void* db) {
+    return static_cast<KVHandle*>(db)->db;
+}
+
+static string MetaKey(const char* name, const char* family) {
+    return family? string(name) + "." + family: string(name);
+}
+
+/* Returns the write time up to which the rows of the table have expired. */
+static int64_t ExpiryCutoff(KVHandle* handle) {
+    return handle->ttl > 0? CurrentTime() - handle->ttl: LLONG_MIN;
+}
+
+/*
+ * Checks if the value has expired, and drops its write time. Returns true
+ * for values that are still visible.
+ */
+static bool Unstamp(bool timestamped, int64_t cutoff, Slice* value) {
+    if (!timestamped) return true;
+    if (WriteTime(*value) <= cutoff) return false;
+    value->remove_suffix(min(value->size(), TIMESTAMP_SIZE));
+    return true;
+}
+
+static string EncodeRowCount(int64_t count) {
+    return string(reinterpret_cast<const char*>(&count), sizeof(count));
+}
+
+/*
+ * Reads the row count from the metadata column family. Returns false if the
+ * count has never been written, i.e. the table was created without it.
+ */
+static bool ReadRowCount(KVHandle* handle, int64_t* count) {
+    string value;
+    WriteBatchWithIndex* pending =
+        handle->instance? handle->instance->pending.get(): nullptr;
+    Status s = pending?
+        pending->GetFromBatchAndDB(handle->db, ReadOptions(), handle->meta,
+                                   handle->rowCountKey, &value):
+        handle->db->Get(ReadOptions(), handle->meta, handle->rowCountKey,
+                        &value);
+    if (!s.ok() || value.size() != sizeof(*count)) return false;
+    memcpy(count, value.data(), sizeof(*count));
+    return true;
+}
+
+/* Reports a wait on RocksDB as a wait event for its duration. */
+class WaitEvent {
+  public:
+    WaitEvent() { ReportWaitStart(); }
+    ~WaitEvent() { ReportWaitEnd(); }
+};
+
+static int64_t ScanRowCount(KVHandle* handle) {
+    int64_t count = 0;
+    WaitEvent wait;
+    unique_ptr<Iterator> it(handle->db->NewIterator(ReadOptions(), handle->data));
+    for (it->SeekToFirst(); it->Valid(); it->Next()) count++;
+    return count;
+}
+
+static void CountOp(KVOpStats* stats, uint64 KVOpStats::*counter,
+                    uint64 amount) {
+    if (stats) __atomic_fetch_add(&(stats->*counter), amount, __ATOMIC_RELAXED);
+}
+
+/* Records the duration of an engine call in the latency histogram. */
+class OpTimer {
+  public:
+    OpTimer(KVOpStats* stats, KVOperation op) : stats_(stats), op_(op) {
+        if (stats_) start_ = chrono::steady_clock::now();
+    }
+
+    ~OpTimer() {
+        if (!stats_) return;
+        uint64_t micros = chrono::duration_cast<chrono::microseconds>(
+            chrono::steady_clock::now() - start_).count();
+        int bucket = micros == 0? 0: 64 - __builtin_clzll(micros);
+        bucket = min(bucket, KV_LATENCY_BUCKETS - 1);
+        __atomic_fetch_add(&stats_->latency[op_][bucket], 1, __ATOMIC_RELAXED);
+    }
+
+  private:
+    KVOpStats* stats_;
+    KVOperation op_;
+    chrono::steady_clock::time_point start_;
+};
+
+/*
+ * Checks if the key is stored and hasn't expired, using the memtables and
+ * filters first. Keys written by running statements are looked up in their
+ * batch first. An expired row is left for the compactions to drop and
+ * uncount, like the rows that aren't overwritten or deleted.
+ */
+static bool KeyExists(KVHandle* handle, const Slice& key) {
+    string value;
+    WaitEvent wait;
+    WriteBatchWithIndex* pending = handle->instance->pending.get();
+    bool found = pending?
+        pending->GetFromBatchAndDB(handle->db, ReadOptions(), handle->data,
+                                   key, &value).ok():
+        handle->db->KeyMayExist(ReadOptions(), handle->data, key, &value) &&
+        handle->db->Get(ReadOptions(), handle->data, key, &value).ok();
+    Slice stored(value);
+    return found && Unstamp(handle->timestamped, ExpiryCutoff(handle), &stored);
+}
+
+/* Writes the batch, reporting the wait, which includes any write stall. */
+static Status ApplyBatch(DB* db, WriteBatch* batch) {
+    WaitEvent wait;
+    return db->Write(WriteOptions(), batch);
+}
+
+/*
+ * Block cache and memtable budget shared by all the tables this backend
+ * opens, instead of a cache and unbounded memtables per table. They are
+ * created by the first open, and resized when their settings change.
+ */
+static size_t blockCacheSize = 64 << 20;
+static size_t memtableBudget = 64 << 20;
+static uint64_t compactDeletesMin = 10000;
+static uint64_t writeBatchSize = 64 << 20;
+static shared_ptr<Cache> blockCache;
+static shared_ptr<WriteBufferManager> writeBufferManager;
+
+static void UseSharedMemory(Options* options,
+                            BlockBasedTableOptions* blockOptions) {
+    if (!blockCache) {
+        blockCache = NewLRUCache(blockCacheSize);
+    }
+    if (!writeBufferManager) {
+        writeBufferManager = make_shared<WriteBufferManager>(memtableBudget);
+    }
+
+    blockOptions->block_cache = blockCache;
+    options->write_buffer_manager = writeBufferManager;
+}
+
+/*
+ * Engine settings of the backend. The background thread pools of the default
+ * environment and the rate limiter are shared by all its tables, rather than
+ * sized per table, and are only set up when a table is opened, as threads
+ * must not be started before the backend is forked.
+ */
+static KVEngineOptions engine = {2, 2, 1, -1, 0, 0};
+static shared_ptr<RateLimiter> rateLimiter;
+
+static void ApplyEngineOptions(Options* options, bool background) {
+    if (background) {
+        Env* env = Env::Default();
+        env->SetBackgroundThreads(engine.backgroundThreads, Env::LOW);
+        env->SetBackgroundThreads(1, Env::HIGH);
+        options->env = env;
+        options->max_background_jobs = engine.maxBackgroundJobs;
+        options->max_subcompactions = engine.maxSubcompactions;
+        options->bytes_per_sync = engine.bytesPerSync;
+
+        if (engine.rateLimit > 0) {
+            if (!rateLimiter) {
+                rateLimiter.reset(NewGenericRateLimiter(engine.rateLimit));
+            }
+            options->rate_limiter = rateLimiter;
+        }
+    }
+    options->max_open_files = engine.maxOpenFiles;
+}
+
+static CompressionType GetCompressionType(KVCompression compression) {
+    switch (compression) {
+        case KV_COMPRESSION_NONE:
+            return kNoCompression;
+        case KV_COMPRESSION_SNAPPY:
+            return kSnappyCompression;
+        case KV_COMPRESSION_ZLIB:
+            return kZlibCompression;
+        case KV_COMPRESSION_LZ4:
+            return kLZ4Compression;
+        case KV_COMPRESSION_ZSTD:
+            return kZSTD;
+        default:
+            return kSnappyCompression;
+    }
+}
+
+static CompactionStyle GetCompactionStyle(KVCompactionStyle style) {
+    switch (style) {
+        case KV_COMPACTION_UNIVERSAL:
+            return kCompactionStyleUniversal;
+        default:
+            return kCompactionStyleLevel;
+    }
+}
+
+/* Applies the tuning of the table on top of the default options. */
+static void ApplyTableOptions(Options* options,
+                              BlockBasedTableOptions* blockOptions,
+                              const KVTableOptions* tableOptions) {
+    if (tableOptions->compressionLevels == 1) {
+        options->compression = GetCompressionType(tableOptions->compression[0]);
+    } else if (tableOptions->compressionLevels > 1) {
+        for (int i = 0; i < tableOptions->compressionLevels; i++) {
+            options->compression_per_level.push_back(
+                GetCompressionType(tableOptions->compression[i]));
+        }
+    }
+    if (tableOptions->blockSize > 0) {
+        blockOptions->block_size = tableOptions->blockSize;
+    }
+    if (tableOptions->bloomBitsPerKey > 0) {
+        blockOptions->filter_policy.reset(
+            NewBloomFilterPolicy(tableOptions->bloomBitsPerKey, false));
+    }
+    if (tableOptions->writeBufferSize > 0) {
+        options->write_buffer_size = tableOptions->writeBufferSize;
+    }
+    if (tableOptions->maxWriteBufferNumber > 0) {
+        options->max_write_buffer_number = tableOptions->maxWriteBufferNumber;
+    }
+    if (tableOptions->compactionStyle != KV_COMPACTION_DEFAULT) {
+        options->compaction_style =
+            GetCompactionStyle(tableOptions->compactionStyle);
+    }
+    if (tableOptions->targetFileSize > 0) {
+        options->target_file_size_base = tableOptions->targetFileSize;
+    }
+    blockOptions->cache_index_and_filter_blocks =
+        tableOptions->cacheIndexAndFilterBlocks;
+
+    /* files with many deletes in a window of entries are compacted */
+    if (tableOptions->deletionTrigger > 0) {
+        size_t window = tableOptions->deletionWindow > 0?
+            tableOptions->deletionWindow: DELETION_WINDOW;
+        options->table_properties_collector_factories.emplace_back(
+            NewCompactOnDeletionCollectorFactory(
+                max(window, (size_t) tableOptions->deletionTrigger),
+                tableOptions->deletionTrigger));
+    }
+
+    /* the files of the upper levels fill the first paths */
+    for (int i = 0; i < tableOptions->levelPathCount; i++) {
+        options->db_paths.emplace_back(tableOptions->levelPaths[i].path,
+                                       tableOptions->levelPaths[i].targetSize);
+    }
+}
+
+/*
+ * RocksDB statistics of the tables opened by this backend. They are kept
+ * across opens of a table, so that the tickers and histograms cover all the
+ * work the backend has done on it, not just the current query.
+ */
+static map<string, shared_ptr<Statistics>> tableStatistics;
+
+/* Integer properties reported for a table, next to rocksdb.stats. */
+static const char* INT_PROPERTIES[] = {
+    "rocksdb.estimate-num-keys",
+    "rocksdb.estimate-live-data-size",
+    "rocksdb.total-sst-files-size",
+    "rocksdb.live-sst-files-size",
+    "rocksdb.estimate-pending-compaction-bytes",
+    "rocksdb.compaction-pending",
+    "rocksdb.num-running-compactions",
+    "rocksdb.num-running-flushes",
+    "rocksdb.mem-table-flush-pending",
+    "rocksdb.num-immutable-mem-table",
+    "rocksdb.cur-size-active-mem-table",
+    "rocksdb.cur-size-all-mem-tables",
+    "rocksdb.size-all-mem-tables",
+    "rocksdb.estimate-table-readers-mem",
+    "rocksdb.block-cache-capacity",
+    "rocksdb.block-cache-usage",
+    "rocksdb.block-cache-pinned-usage",
+    "rocksdb.actual-delayed-write-rate",
+    "rocksdb.is-write-stopped",
+    "rocksdb.num-live-versions",
+    "rocksdb.background-errors",
+};
+
+static char* CopyString(const string& str) {
+    return pnstrdup(str.data(), str.size());
+}
+
+/*
+ * Number of scans and modifications collecting engine counters. The perf
+ * level is per thread, and so per backend, and stays enabled while any of them
+ * is running.
+ */
+static int perfUsers = 0;
+static bool perfTiming = false;
+
+/* Builds the options of a database opened for writing. */
+static void PrepareOptions(const char* path, KVTableOptions* tableOptions,
+                           Options* options) {
+    ApplyEngineOptions(options, true);
+    options->create_if_missing = true;
+    options->create_missing_column_families = true;
+
+    BlockBasedTableOptions blockOptions;
+    UseSharedMemory(options, &blockOptions);
+    ApplyTableOptions(options, &blockOptions, tableOptions);
+    options->table_factory.reset(NewBlockBasedTableFactory(blockOptions));
+
+    shared_ptr<Statistics>& statistics = tableStatistics[string(path)];
+    if (!statistics) statistics = CreateDBStatistics();
+    options->statistics = statistics;
+}
+
+/*
+ * Returns the shared database at the path, opening it if this backend hasn't
+ * yet. RocksDB requires all column families to be opened together, so they
+ * all get the options of the table that opens the database, which are those
+ * of its server.
+ */
+static Status OpenInstance(const string& path, const Options& options,
+                           KVInstance** result) {
+    auto found = instances.find(path);
+    if (found != instances.end()) {
+        *result = found->second;
+        return Status::OK();
+    }
+
+    vector<string> names;
+    if (!DB::ListColumnFamilies(DBOptions(options), path, &names).ok()) {
+        names.push_back(kDefaultColumnFamilyName);
+    }
+    if (find(names.begin(), names.end(), META_FAMILY) == names.end()) {
+        names.push_back(META_FAMILY);
+    }
+
+    KVInstance* instance = new KVInstance();
+    instance->path = path;
+    instance->refCount = 0;
+    instance->writers = 0;
+    instance->expiry = make_shared<ExpiryFilterFactory>();
+
+    ColumnFamilyOptions familyOptions(options);
+    familyOptions.compaction_filter_factory = instance->expiry;
+    vector<ColumnFamilyDescriptor> families;
+    for (const string& name : names) {
+        families.emplace_back(name, familyOptions);
+    }
+    vector<ColumnFamilyHandle*> handles;
+    Status s;
+    {
+        WaitEvent wait;
+        s = DB::Open(DBOptions(options), path, families, &handles,
+                     &instance->db);
+    }
+    if (!s.ok()) {
+        /* such as the lock being held by another backend */
+        delete instance;
+        return s;
+    }
+    for (ColumnFamilyHandle* family : handles) {
+        if (family->GetName() == META_FAMILY) {
+            instance->meta = family;
+        } else {
+            instance->families[family->GetName()] = family;
+        }
+    }
+
+    instances[path] = instance;
+    *result = instance;
+    return s;
+}
+
+/*
+ * Releases a reference to the shared database, closing it after the last.
+ * The compactions still running are waited for first, and the rows they
+ * expired uncounted from the tables.
+ */
+static void CloseInstance(KVInstance* instance) {
+    if (--instance->refCount > 0) return;
+
+    if (instance->expiry->Expires()) {
+        CancelAllBackgroundWork(instance->db, true);
+    }
+    for (const auto& family : instance->families) {
+        int64_t dropped =
+            instance->expiry->TakeDropped(family.second->GetID());
+        string key = MetaKey(ROW_COUNT_KEY,
+                             family.first == kDefaultColumnFamilyName?
+                             nullptr: family.first.c_str());
+        string value;
+        int64_t count = 0;
+        if (dropped > 0 &&
+            instance->db->Get(ReadOptions(), instance->meta, key,
+                              &value).ok() &&
+            value.size() == sizeof(count)) {
+            memcpy(&count, value.data(), sizeof(count));
+            instance->db->Put(WriteOptions(), instance->meta, key,
+                              EncodeRowCount(max<int64_t>(count - dropped,
+                                                          0)));
+        }
+    }
+
+    for (const auto& family : instance->families) {
+        delete family.second;
+    }
+    delete instance->meta;
+    delete instance->db;
+    instances.erase(instance->path);
+    delete instance;
+}
+
+/*
+ * Opens the column family of the table, creating it on the first open, or
+ * the default column family if the table has its own database.
+ */
+static Status OpenFamily(KVHandle* handle, const string& path,
+                         const char* family, const Options& options) {
+    KVInstance* instance = nullptr;
+    Status s = OpenInstance(path, options, &instance);
+    if (!s.ok()) return s;
+
+    instance->refCount++;
+    string name = family? family: kDefaultColumnFamilyName;
+    if (!instance->families.count(name)) {
+        ColumnFamilyOptions familyOptions(options);
+        familyOptions.compaction_filter_factory = instance->expiry;
+        ColumnFamilyHandle* data = nullptr;
+        s = instance->db->CreateColumnFamily(familyOptions, name, &data);
+        if (!s.ok()) {
+            CloseInstance(instance);
+            return s;
+        }
+        instance->families[name] = data;
+    }
+    ColumnFamilyHandle* data = instance->families[name];
+
+    instance->handles.insert(handle);
+    handle->instance = instance;
+    handle->db = instance->db;
+    handle->data = data;
+    handle->meta = instance->meta;
+    return s;
+}
+
+/* Rereads the row counts of the tables after their writes were undone. */
+static void ReloadRowCounts(KVInstance* instance) {
+    for (KVHandle* handle : instance->handles) {
+        if (!ReadRowCount(handle, &handle->rowCount)) {
+            handle->rowCount = ScanRowCount(handle);
+        }
+    }
+}
+
+/*
+ * Returns the batch the writes to the table go to: the batch of the running
+ * statements, or else the given batch, which is written right away.
+ */
+static WriteBatchBase* GetWriteBatch(KVHandle* handle, WriteBatch* single) {
+    WriteBatchWithIndex* pending = handle->instance->pending.get();
+    if (pending) return pending;
+    return single;
+}
+
+/*
+ * Uncounts the expired rows compactions dropped from the table since the
+ * last call. The count goes to the batch of the running statements, if any,
+ * as they write it too.
+ */
+static void UncountExpired(KVHandle* handle) {
+    if (!handle->timestamped) return;
+    int64_t dropped =
+        handle->instance->expiry->TakeDropped(handle->data->GetID());
+    if (dropped == 0) return;
+
+    handle->rowCount = max<int64_t>(handle->rowCount - dropped, 0);
+    WriteBatch single;
+    WriteBatchBase* batch = GetWriteBatch(handle, &single);
+    batch->Put(handle->meta, handle->rowCountKey,
+               EncodeRowCount(handle->rowCount));
+    if (batch == &single) handle->db->Write(WriteOptions(), &single);
+}
+
+/*
+ * Writes the batch of the running statements once it has outgrown the write
+ * batch size, and starts a new one with a save point for each of them. The
+ * rows written so far can't be undone after that, as if each statement had
+ * written them directly. Returns false if the write failed.
+ */
+static bool WriteFullBatch(KVInstance* instance) {
+    WriteBatchWithIndex* pending = instance->pending.get();
+    if (!pending || writeBatchSize == 0 ||
+        pending->GetWriteBatch()->GetDataSize() < writeBatchSize) {
+        return true;
+    }
+
+    Status s = ApplyBatch(instance->db, pending->GetWriteBatch());
+    instance->pending.reset(
+        new WriteBatchWithIndex(BytewiseComparator(), 0, true));
+    for (int writer = 0; writer < instance->writers; writer++) {
+        instance->pending->SetSavePoint();
+    }
+    if (!s.ok()) ReloadRowCounts(instance);
+    return s.ok();
+}
+
+static void NoteDelete(KVHandle* handle, const Slice& key) {
+    if (handle->deletes == 0 || key.compare(handle->firstDeleted) < 0) {
+        handle->firstDeleted.assign(key.data(), key.size());
+    }
+    if (handle->deletes == 0 || key.compare(handle->lastDeleted) > 0) {
+        handle->lastDeleted.assign(key.data(), key.size());
+    }
+    handle->deletes++;
+}
+
+static void ForgetDeletes(KVHandle* handle) {
+    handle->deletes = 0;
+    handle->firstDeleted.clear();
+    handle->lastDeleted.clear();
+}
+
+/*
+ * Marks the files of the table holding keys in the range for compaction, all
+ * of them without a range. The compaction runs in the background threads.
+ * Only level compaction picks the marked files, so with the universal style
+ * nothing is marked, and the tombstones stay until their files are compacted
+ * for their size.
+ */
+static void SuggestCompaction(KVHandle* handle, const Slice* begin,
+                              const Slice* end) {
+    Options options = handle->db->GetOptions(handle->data);
+    if (options.compaction_style != kCompactionStyleLevel) return;
+
+    experimental::SuggestCompactRange(handle->db, handle->data, begin, end);
+}
+
+/*
+ * Once the statements that deleted many rows of the table are written, has
+ * the range of their keys compacted, so that scans don't keep stepping over
+ * the tombstones.
+ */
+static void CompactDeletedRange(KVHandle* handle) {
+    if (compactDeletesMin == 0 || handle->deletes < compactDeletesMin) return;
+
+    Slice first(handle->firstDeleted), last(handle->lastDeleted);
+    SuggestCompaction(handle, &first, &last);
+}
+
 extern "C" {
 
-void* Open(char* path) {
-    DB* db = nullptr;
+/*
+ * Opens the database of a table, or the column family of the table in the
+ * database at the path if a family is given.
+ */
+void* Open(char* path, char* family, KVTableOptions* tableOptions,
+           char** error) {
     Options options;
-    options.IncreaseParallelism();
-    options.create_if_missing = true;
-    Status s = DB::Open(options, string(path), &db);
-    assert(s.ok());
-    return db;
+    PrepareOptions(path, tableOptions, &options);
+
+    KVHandle* handle = new KVHandle();
+    handle->statistics = options.statistics;
+    handle->rowCountKey = MetaKey(ROW_COUNT_KEY, family);
+    Status s = OpenFamily(handle, string(path), family, options);
+    if (!s.ok()) {
+        delete handle;
+        *error = CopyString(s.ToString());
+        return nullptr;
+    }
+
+    /* tables created before the count was kept are counted once */
+    if (!ReadRowCount(handle, &handle->rowCount)) {
+        handle->rowCount = ScanRowCount(handle);
+        handle->db->Put(WriteOptions(), handle->meta, handle->rowCountKey,
+                        EncodeRowCount(handle->rowCount));
+    }
+
+    string formatKey = MetaKey(FORMAT_KEY, family);
+    string format;
+    s = handle->db->Get(ReadOptions(), handle->meta, formatKey, &format);
+    if (!s.ok() && handle->rowCount == 0) {
+        handle->db->Put(WriteOptions(), handle->meta, formatKey,
+                        FORMAT_VERSION);
+    } else if (!s.ok() || format != FORMAT_VERSION) {
+        Close(handle);
+        *error = CopyString("the table was written with another key format, "
+                            "and must be recreated and reloaded");
+        return nullptr;
+    }
+
+    /* rows can only expire if all of them were written with their time */
+    string timestamps = MetaKey(TIMESTAMPS_KEY, family);
+    string flag;
+    handle->timestamped = handle->db->Get(ReadOptions(), handle->meta,
+                                          timestamps, &flag).ok();
+    if (!handle->timestamped && tableOptions->ttl > 0 &&
+        handle->rowCount == 0) {
+        handle->db->Put(WriteOptions(), handle->meta, timestamps, "");
+        handle->timestamped = true;
+    }
+    handle->ttl = handle->timestamped? tableOptions->ttl: 0;
+    handle->instance->expiry->SetTTL(handle->data->GetID(), handle->ttl);
+    UncountExpired(handle);
+
+    return handle;
+}
+
+/*
+ * Drops the column family of a table stored in the database at the path,
+ * along with its row count.
+ */
+bool DropFamily(char* path, char* family, KVTableOptions* tableOptions,
+                char** error) {
+    Options options;
+    PrepareOptions(path, tableOptions, &options);
+
+    KVInstance* instance = nullptr;
+    Status s = OpenInstance(string(path), options, &instance);
+    if (!s.ok()) {
+        *error = CopyString(s.ToString());
+        return false;
+    }
+    instance->refCount++;
+
+    auto found = instance->families.find(family);
+    if (found != instance->families.end()) {
+        instance->db->DropColumnFamily(found->second);
+        instance->db->DestroyColumnFamilyHandle(found->second);
+        instance->families.erase(found);
+    }
+    instance->db->Delete(WriteOptions(), instance->meta,
+                         MetaKey(ROW_COUNT_KEY, family));
+    instance->db->Delete(WriteOptions(), instance->meta,
+                         MetaKey(TIMESTAMPS_KEY, family));
+    instance->db->Delete(WriteOptions(), instance->meta,
+                         MetaKey(FORMAT_KEY, family));
+
+    CloseInstance(instance);
+    return true;
+}
+
+/*
+ * Opens the database without taking its lock, so that it can be read while
+ * a backend has it open for writing. The tuning of the table, if given,
+ * locates the files it keeps in level paths. Returns NULL if it can't be
+ * opened.
+ */
+void* OpenForReadOnly(char* path, char* family,
+                      KVTableOptions* tableOptions) {
+    Options options;
+    BlockBasedTableOptions blockOptions;
+    ApplyEngineOptions(&options, false);
+    UseSharedMemory(&options, &blockOptions);
+    if (tableOptions) ApplyTableOptions(&options, &blockOptions, tableOptions);
+    options.table_factory.reset(NewBlockBasedTableFactory(blockOptions));
+
+    /* the statistics this backend collected while writing the table */
+    auto found = tableStatistics.find(string(path));
+    if (found != tableStatistics.end()) options.statistics = found->second;
+    vector<string> names;
+    if (!DB::ListColumnFamilies(DBOptions(options), string(path), &names).ok()) {
+        return nullptr;
+    }
+
+    /* a read-only database can be opened with a subset of its families */
+    vector<ColumnFamilyDescriptor> families;
+    families.emplace_back(kDefaultColumnFamilyName, ColumnFamilyOptions(options));
+    if (family) {
+        if (find(names.begin(), names.end(), family) == names.end()) {
+            return nullptr;
+        }
+        families.emplace_back(family, ColumnFamilyOptions(options));
+    }
+    bool hasMeta = find(names.begin(), names.end(), META_FAMILY) != names.end();
+    if (hasMeta) {
+        families.emplace_back(META_FAMILY, ColumnFamilyOptions(options));
+    }
+
+    KVHandle* handle = new KVHandle();
+    handle->rowCountKey = MetaKey(ROW_COUNT_KEY, family);
+    handle->statistics = options.statistics;
+    vector<ColumnFamilyHandle*> handles;
+    Status s;
+    {
+        WaitEvent wait;
+        s = DB::OpenForReadOnly(DBOptions(options), string(path), families,
+                                &handles, &handle->db);
+    }
+    if (!s.ok()) {
+        delete handle;
+        return nullptr;
+    }
+    if (family) {
+        delete handles[0];
+        handles.erase(handles.begin());
+    }
+    handle->data = handles[0];
+    handle->meta = hasMeta? handles[1]: nullptr;
+
+    /* fall back to the estimate until a writer has stored the count */
+    uint64_t estimate = 0;
+    if (!handle->meta || !ReadRowCount(handle, &handle->rowCount)) {
+        handle->db->GetIntProperty(handle->data, "rocksdb.estimate-num-keys",
+                                   &estimate);
+        handle->rowCount = estimate;
+    }
+    string flag;
+    handle->timestamped = handle->meta &&
+        handle->db->Get(ReadOptions(), handle->meta,
+                        MetaKey(TIMESTAMPS_KEY, family), &flag).ok();
+
+    return handle;
 }
 
 void Close(void* db) {
     if (db) {
-        delete static_cast<DB*>(db);
+        KVHandle* handle = static_cast<KVHandle*>(db);
+        if (handle->instance) {
+            UncountExpired(handle);
+            handle->instance->handles.erase(handle);
+            CloseInstance(handle->instance);
+        } else {
+            delete handle->meta;
+            delete handle->data;
+            delete handle->db;
+        }
+        delete handle;
     }
 }
 
+/* Sets the capacity of the block cache shared by the tables, in bytes. */
+void SetBlockCacheSize(uint64 size) {
+    blockCacheSize = size;
+    if (blockCache) blockCache->SetCapacity(size);
+}
+
+/*
+ * Sets the memory the memtables of all tables may use before they are
+ * flushed, in bytes. Zero leaves them unbounded.
+ */
+void SetMemtableBudget(uint64 size) {
+    memtableBudget = size;
+    if (writeBufferManager) writeBufferManager->SetBufferSize(size);
+}
+
+/*
+ * Sets the number of rows the statements writing a table must delete for the
+ * range they deleted to be compacted, or 0 to never compact it.
+ */
+void SetCompactDeletesMin(uint64 count) {
+    compactDeletesMin = count;
+}
+
+/*
+ * Sets the size the batch of the running statements may reach before it is
+ * written, or 0 to leave it unbounded.
+ */
+void SetWriteBatchSize(uint64 size) {
+    writeBatchSize = size;
+}
+
+/*
+ * Sets the engine settings used by the next opens. A rate limiter already in
+ * use takes the new rate, while disabling it only affects the next opens.
+ */
+void SetEngineOptions(const KVEngineOptions* engineOptions) {
+    engine = *engineOptions;
+    if (rateLimiter && engine.rateLimit > 0) {
+        rateLimiter->SetBytesPerSecond(engine.rateLimit);
+    }
+}
+
+/*
+ * Returns true if the table expires rows. A table given a ttl after rows were
+ * written without their write time can't.
+ */
+bool ExpiresRows(void* db) {
+    return static_cast<KVHandle*>(db)->ttl > 0;
+}
+
+/* Counts the operations on the database in the given shared counters. */
+void SetOpStats(void* db, KVOpStats* stats) {
+    static_cast<KVHandle*>(db)->stats = stats;
+}
+
+/* Returns the exact number of rows of the table. */
 uint64 Count(void* db) {
-    string num;
-    static_cast<DB*>(db)->GetProperty("rocksdb.estimate-num-keys", &num);
-    return stoull(num);
+    return static_cast<KVHandle*>(db)->rowCount;
+}
+
+uint64 LiveDataSize(void* db) {
+    KVHandle* handle = static_cast<KVHandle*>(db);
+    uint64_t size = 0;
+    handle->db->GetIntProperty(handle->data, "rocksdb.estimate-live-data-size",
+                               &size);
+    return size;
+}
+
+/*
+ * Collects the size estimates of the table. The average key and value widths
+ * come from the properties of the SST files, so they don't cover the rows
+ * that are still in memtables.
+ */
+void GetTableStats(void* db, KVTableStats* stats) {
+    KVHandle* handle = static_cast<KVHandle*>(db);
+
+    stats->keyCount = Count(db);
+    stats->liveDataSize = LiveDataSize(db);
+    stats->keyWidth = 0;
+    stats->valueWidth = 0;
+
+    TablePropertiesCollection props;
+    if (!handle->db->GetPropertiesOfAllTables(handle->data, &props).ok()) {
+        return;
+    }
+
+    uint64_t entries = 0, keySize = 0, valueSize = 0;
+    for (const auto& prop : props) {
+        entries += prop.second->num_entries;
+        keySize += prop.second->raw_key_size;
+        valueSize += prop.second->raw_value_size;
+    }
+    if (entries == 0) return;
+
+    stats->keyWidth = (double) keySize / entries;
+    stats->valueWidth = (double) valueSize / entries;
 }
 
 void* GetIter(void* db) {
-    Iterator* it = static_cast<DB*>(db)->NewIterator(ReadOptions());
-    it->SeekToFirst();
-    return it;
+    KVHandle* handle = static_cast<KVHandle*>(db);
+    KVIterator* iter = new KVIterator();
+    iter->it = handle->db->NewIterator(ReadOptions(), handle->data);
+    iter->stats = handle->stats;
+    iter->timestamped = handle->timestamped;
+    iter->cutoff = ExpiryCutoff(handle);
+    RewindIter(iter);
+    return iter;
 }
 
 void DelIter(void* it) {
     if (it) {
-        delete static_cast<Iterator*>(it);
+        KVIterator* iter = static_cast<KVIterator*>(it);
+        delete iter->it;
+        delete iter;
     }
 }
 
+void RewindIter(void* it) {
+    KVIterator* iter = static_cast<KVIterator*>(it);
+    OpTimer timer(iter->stats, KV_OP_SEEK);
+    CountOp(iter->stats, &KVOpStats::seeks, 1);
+    WaitEvent wait;
+    iter->it->SeekToFirst();
+}
+
+void SeekIter(void* it, char* key, uint32 keyLen) {
+    KVIterator* iter = static_cast<KVIterator*>(it);
+    OpTimer timer(iter->stats, KV_OP_SEEK);
+    CountOp(iter->stats, &KVOpStats::seeks, 1);
+    WaitEvent wait;
+    iter->it->Seek(Slice(key, keyLen));
+}
+
 bool Next(void* db, void* iter, char** key, uint32* keyLen,
           char** value, uint32* valLen) {
-    Iterator* it = static_cast<Iterator*>(iter);
-    if (!it->Valid()) return false;
-    *keyLen = it->key().size(), *valLen = it->value().size();
+    KVIterator* kvIter = static_cast<KVIterator*>(iter);
+    Iterator* it = kvIter->it;
+
+    /* expired rows that compactions haven't dropped yet are skipped */
+    Slice val;
+    for (;; it->Next()) {
+        if (!it->Valid()) return false;
+        val = it->value();
+        if (Unstamp(kvIter->timestamped, kvIter->cutoff, &val)) break;
+    }
+
+    *keyLen = it->key().size(), *valLen = val.size();
     *key = (char*) palloc0(*keyLen);
     *value = (char*) palloc0(*valLen);
-    strncpy(*key, it->key().data(), *keyLen);
-    strncpy(*value, it->value().data(), *valLen);
-    it->Next();
+    memcpy(*key, it->key().data(), *keyLen);
+    memcpy(*value, val.data(), *valLen);
+    {
+        WaitEvent wait;
+        it->Next();
+    }
+
+    CountOp(kvIter->stats, &KVOpStats::rowsScanned, 1);
+    CountOp(kvIter->stats, &KVOpStats::bytesRead, *keyLen + *valLen);
     return true;
 }
 
 bool Get(void* db, char* key, uint32 keyLen, char** value, uint32* valLen) {
+    KVHandle* handle = static_cast<KVHandle*>(db);
+    CountOp(handle->stats, &KVOpStats::gets, 1);
+
     string sval;
-    Status s = static_cast<DB*>(db)->Get(ReadOptions(), Slice(key, keyLen), &sval);
+    Status s;
+    {
+        OpTimer timer(handle->stats, KV_OP_GET);
+        WaitEvent wait;
+        s = handle->db->Get(ReadOptions(), handle->data, Slice(key, keyLen),
+                            &sval);
+    }
     if (!s.ok()) return false;
-    *valLen = sval.length();
+
+    Slice val(sval);
+    if (!Unstamp(handle->timestamped, ExpiryCutoff(handle), &val)) {
+        return false;
+    }
+    *valLen = val.size();
     *value = (char*) palloc0(*valLen);
-    strncpy(*value, sval.c_str(), *valLen);
+    memcpy(*value, val.data(), *valLen);
+
+    CountOp(handle->stats, &KVOpStats::bytesRead, *valLen);
     return true;
 }
 
+void MultiGet(void* db, uint32 count, char** keys, uint32* keyLens,
+              char** values, uint32* valLens, bool* found) {
+    vector<Slice> keySlices;
+    keySlices.reserve(count);
+    for (uint32 i = 0; i < count; i++) {
+        keySlices.emplace_back(keys[i], keyLens[i]);
+    }
+
+    KVHandle* handle = static_cast<KVHandle*>(db);
+    CountOp(handle->stats, &KVOpStats::multiGets, 1);
+    CountOp(handle->stats, &KVOpStats::multiGetKeys, count);
+
+    vector<string> svals;
+    vector<Status> s;
+    {
+        OpTimer timer(handle->stats, KV_OP_MULTIGET);
+        WaitEvent wait;
+        vector<ColumnFamilyHandle*> families(count, handle->data);
+        s = handle->db->MultiGet(ReadOptions(), families, keySlices, &svals);
+    }
+
+    int64_t cutoff = ExpiryCutoff(handle);
+    uint64 bytesRead = 0;
+    for (uint32 i = 0; i < count; i++) {
+        Slice val(svals[i]);
+        found[i] = s[i].ok() && Unstamp(handle->timestamped, cutoff, &val);
+        if (!found[i]) continue;
+        valLens[i] = val.size();
+        values[i] = (char*) palloc0(valLens[i]);
+        memcpy(values[i], val.data(), valLens[i]);
+        bytesRead += valLens[i];
+    }
+    CountOp(handle->stats, &KVOpStats::bytesRead, bytesRead);
+}
+
+/*
+ * Stores the row, counting it if the key is new. Overwriting an existing key
+ * leaves the row count unchanged.
+ */
 bool Put(void* db, char* key, uint32 keyLen, char* value, uint32 valLen) {
-    Status s = static_cast<DB*>(db)->Put(WriteOptions(), Slice(key, keyLen),
-                                         Slice(value, valLen));
-    return s.ok()? true: false;
+    KVHandle* handle = static_cast<KVHandle*>(db);
+    Slice keySlice(key, keyLen);
+    OpTimer timer(handle->stats, KV_OP_PUT);
+    CountOp(handle->stats, &KVOpStats::puts, 1);
+    CountOp(handle->stats, &KVOpStats::bytesWritten, keyLen + valLen);
+
+    UncountExpired(handle);
+    int64_t rowCount = handle->rowCount;
+    bool exists = KeyExists(handle, keySlice);
+
+    string stamped;
+    Slice valSlice(value, valLen);
+    if (handle->timestamped) {
+        int64_t now = CurrentTime();
+        stamped.reserve(valLen + TIMESTAMP_SIZE);
+        stamped.append(value, valLen);
+        stamped.append(reinterpret_cast<const char*>(&now), TIMESTAMP_SIZE);
+        valSlice = stamped;
+    }
+
+    WriteBatch single;
+    WriteBatchBase* batch = GetWriteBatch(handle, &single);
+    batch->Put(handle->data, keySlice, valSlice);
+    if (!exists) {
+        batch->Put(handle->meta, handle->rowCountKey,
+                   EncodeRowCount(++rowCount));
+    }
+
+    if (batch == &single) {
+        Status s = ApplyBatch(handle->db, &single);
+        if (!s.ok()) return false;
+    }
+    handle->rowCount = rowCount;
+    return WriteFullBatch(handle->instance);
 }
 
-bool Delete(void* db, char* key, uint32 keyLen) {
-    Status s = static_cast<DB*>(db)->Delete(WriteOptions(), Slice(key, keyLen));
-    return s.ok()? true: false;
+/*
+ * Deletes the row, if the key is stored, and uncounts it. Sets found, unless
+ * it is NULL, to whether there was a row to delete.
+ */
+bool Delete(void* db, char* key, uint32 keyLen, bool* found) {
+    KVHandle* handle = static_cast<KVHandle*>(db);
+    Slice keySlice(key, keyLen);
+    OpTimer timer(handle->stats, KV_OP_DELETE);
+    CountOp(handle->stats, &KVOpStats::deletes, 1);
+    UncountExpired(handle);
+    bool exists = KeyExists(handle, keySlice);
+    if (found) *found = exists;
+    if (!exists) return true;
+
+    CountOp(handle->stats, &KVOpStats::bytesWritten, keyLen);
+    NoteDelete(handle, keySlice);
+
+    int64_t rowCount = handle->rowCount - 1;
+    WriteBatch single;
+    WriteBatchBase* batch = GetWriteBatch(handle, &single);
+    batch->Delete(handle->data, keySlice);
+    batch->Put(handle->meta, handle->rowCountKey, EncodeRowCount(rowCount));
+
+    if (batch == &single) {
+        Status s = ApplyBatch(handle->db, &single);
+        if (!s.ok()) return false;
+    }
+    handle->rowCount = rowCount;
+    return WriteFullBatch(handle->instance);
+}
+
+/*
+ * Deletes the rows with keys from the lower bound up to, but excluding, the
+ * upper bound, a NULL bound leaving the range open. Sets count to the number
+ * of rows deleted, expired rows aside, which are counted unless the whole of
+ * a table that doesn't expire rows is deleted, but written as a single range
+ * deletion. The rows of a table other statements are writing are deleted one
+ * by one in their batch instead, as it can't hold a range deletion. Returns
+ * false if the write failed.
+ */
+bool DeleteRange(void* db, char* lower, uint32 lowerLen,
+                 char* upper, uint32 upperLen, uint64* count) {
+    KVHandle* handle = static_cast<KVHandle*>(db);
+    OpTimer timer(handle->stats, KV_OP_DELETE);
+    UncountExpired(handle);
+    WriteBatchWithIndex* pending = handle->instance->pending.get();
+    int64_t cutoff = ExpiryCutoff(handle);
+
+    ReadOptions options;
+    Slice upperSlice(upper? upper: "", upperLen);
+    if (upper) options.iterate_upper_bound = &upperSlice;
+    unique_ptr<Iterator> it(handle->db->NewIterator(options, handle->data));
+    if (pending) {
+        it.reset(pending->NewIteratorWithBase(handle->data, it.release()));
+    }
+
+    WriteBatch single;
+    WriteBatchBase* batch = GetWriteBatch(handle, &single);
+    string first, last;
+    uint64_t rows = 0;
+    bool found = false;
+    {
+        WaitEvent wait;
+        if (lower) {
+            it->Seek(Slice(lower, lowerLen));
+        } else {
+            it->SeekToFirst();
+        }
+        if (it->Valid()) first = it->key().ToString();
+
+        if (!lower && !upper && !pending && !handle->timestamped) {
+            /* the whole table, as many rows as it keeps count of */
+            it->SeekToLast();
+            found = it->Valid();
+            if (found) last = it->key().ToString();
+            rows = found? handle->rowCount: 0;
+        } else {
+            /* the batch's own rows aren't bounded by the iterator */
+            for (; it->Valid(); it->Next()) {
+                if (upper && it->key().compare(upperSlice) >= 0) break;
+                last = it->key().ToString();
+
+                /* expired rows are left for the compactions to uncount */
+                Slice value = it->value();
+                if (!Unstamp(handle->timestamped, cutoff, &value)) continue;
+                if (pending) {
+                    batch->Delete(handle->data, it->key());
+                    NoteDelete(handle, it->key());
+                }
+                rows++;
+                found = true;
+            }
+        }
+    }
+    if (!it->status().ok()) return false;
+
+    *count = rows;
+    CountOp(handle->stats, &KVOpStats::deletes, rows);
+    if (!found) return true;
+
+    /* the range ends right after the last key */
+    string end = last;
+    end.push_back('\0');
+    if (!pending) single.DeleteRange(handle->data, first, end);
+
+    int64_t rowCount = max<int64_t>(handle->rowCount - rows, 0);
+    batch->Put(handle->meta, handle->rowCountKey, EncodeRowCount(rowCount));
+
+    if (batch == &single) {
+        Status s = ApplyBatch(handle->db, &single);
+        if (!s.ok()) return false;
+
+        /* range tombstones slow down reads until they are compacted */
+        if (compactDeletesMin > 0 && rows >= compactDeletesMin) {
+            Slice begin(first), finish(end);
+            SuggestCompaction(handle, &begin, &finish);
+        }
+    }
+    handle->rowCount = rowCount;
+    return WriteFullBatch(handle->instance);
+}
+
+/*
+ * Deletes all the rows of the table with one range deletion, and has all its
+ * files compacted, which drops them in the background with level compaction.
+ */
+bool Truncate(void* db, uint64* count) {
+    if (!DeleteRange(db, nullptr, 0, nullptr, 0, count)) return false;
+
+    SuggestCompaction(static_cast<KVHandle*>(db), nullptr, nullptr);
+    return true;
+}
+
+/*
+ * Starts a statement modifying the table. Until it ends, its writes, and
+ * those of the other statements modifying tables of the same database, are
+ * collected in one batch, which is written early if it grows past the write
+ * batch size.
+ */
+void BeginWrites(void* db) {
+    KVInstance* instance = static_cast<KVHandle*>(db)->instance;
+    if (!instance->pending) {
+        instance->pending.reset(
+            new WriteBatchWithIndex(BytewiseComparator(), 0, true));
+    }
+    instance->pending->SetSavePoint();
+    instance->writers++;
+}
+
+/*
+ * Ends a statement modifying the table. The batch is written when the last
+ * writer of the database ends. Returns false if that write failed, in which
+ * case all the collected writes are lost.
+ */
+bool EndWrites(void* db) {
+    KVInstance* instance = static_cast<KVHandle*>(db)->instance;
+    if (instance->writers == 0) return true;
+
+    instance->pending->PopSavePoint();
+    if (--instance->writers > 0) return true;
+
+    Status s = ApplyBatch(instance->db, instance->pending->GetWriteBatch());
+    instance->pending.reset();
+    if (!s.ok()) ReloadRowCounts(instance);
+    for (KVHandle* handle : instance->handles) {
+        if (s.ok()) CompactDeletedRange(handle);
+        ForgetDeletes(handle);
+    }
+    return s.ok();
+}
+
+/* Undoes the writes of a statement that failed. */
+void AbortWrites(void* db) {
+    KVInstance* instance = static_cast<KVHandle*>(db)->instance;
+    if (instance->writers == 0) return;
+
+    instance->pending->RollbackToSavePoint();
+    if (--instance->writers == 0) {
+        instance->pending.reset();
+        for (KVHandle* handle : instance->handles) ForgetDeletes(handle);
+    }
+    ReloadRowCounts(instance);
+}
+
+/*
+ * Starts collecting engine counters. Timing adds the CPU time of Get, Seek
+ * and Next, at the cost of reading the clock around every call.
+ */
+void EnablePerfCounters(bool timing) {
+    perfUsers++;
+    perfTiming = perfTiming || timing;
+    SetPerfLevel(perfTiming ? kEnableTimeAndCPUTimeExceptForMutex :
+                              kEnableCount);
+}
+
+void DisablePerfCounters(void) {
+    if (perfUsers > 0 && --perfUsers == 0) {
+        ResetPerfCounters();
+    }
+}
+
+/* Stops collecting, also after an error skipped DisablePerfCounters. */
+void ResetPerfCounters(void) {
+    perfUsers = 0;
+    perfTiming = false;
+    SetPerfLevel(kDisable);
+}
+
+void ReadPerfCounters(KVPerfCounters* counters) {
+    const PerfContext* perf = get_perf_context();
+    const IOStatsContext* iostats = get_iostats_context();
+
+    counters->blockCacheHits = perf->block_cache_hit_count;
+    counters->blockReads = perf->block_read_count;
+    counters->blockReadBytes = perf->block_read_byte;
+    counters->blockReadTime = perf->block_read_time;
+    counters->memtableLookups = perf->get_from_memtable_count;
+    counters->bloomFilterUseful = perf->bloom_sst_miss_count;
+    counters->bloomFilterPositive = perf->bloom_sst_hit_count;
+    counters->keysSkipped = perf->internal_key_skipped_count;
+    counters->deletesSkipped = perf->internal_delete_skipped_count;
+    counters->bytesRead = iostats->bytes_read;
+    counters->readTime = iostats->read_nanos;
+    counters->getTime = perf->get_cpu_nanos;
+    counters->seekTime = perf->iter_seek_cpu_nanos;
+    counters->nextTime = perf->iter_next_cpu_nanos;
+}
+
+/* Adds the counters collected since the start snapshot to the total. */
+void AccumulatePerfCounters(KVPerfCounters* total,
+                            const KVPerfCounters* start) {
+    KVPerfCounters now;
+    ReadPerfCounters(&now);
+
+    total->blockCacheHits += now.blockCacheHits - start->blockCacheHits;
+    total->blockReads += now.blockReads - start->blockReads;
+    total->blockReadBytes += now.blockReadBytes - start->blockReadBytes;
+    total->blockReadTime += now.blockReadTime - start->blockReadTime;
+    total->memtableLookups += now.memtableLookups - start->memtableLookups;
+    total->bloomFilterUseful += now.bloomFilterUseful - start->bloomFilterUseful;
+    total->bloomFilterPositive +=
+        now.bloomFilterPositive - start->bloomFilterPositive;
+    total->keysSkipped += now.keysSkipped - start->keysSkipped;
+    total->deletesSkipped += now.deletesSkipped - start->deletesSkipped;
+    total->bytesRead += now.bytesRead - start->bytesRead;
+    total->readTime += now.readTime - start->readTime;
+    total->getTime += now.getTime - start->getTime;
+    total->seekTime += now.seekTime - start->seekTime;
+    total->nextTime += now.nextTime - start->nextTime;
+}
+
+/*
+ * Returns the properties of the table: rocksdb.stats, the files per level,
+ * the integer properties above and the column family statistics, including
+ * the write stall counters. The names and values are palloc'd.
+ */
+uint32 GetProperties(void* db, char*** names, char*** values) {
+    KVHandle* handle = static_cast<KVHandle*>(db);
+    vector<pair<string, string>> props;
+
+    string value;
+    if (handle->db->GetProperty(handle->data, "rocksdb.stats", &value)) {
+        props.emplace_back("rocksdb.stats", value);
+    }
+    if (handle->db->GetProperty(handle->data, "rocksdb.levelstats", &value)) {
+        props.emplace_back("rocksdb.levelstats", value);
+    }
+
+    int levels = handle->db->NumberLevels(handle->data);
+    for (int level = 0; level < levels; level++) {
+        string name = "rocksdb.num-files-at-level" + to_string(level);
+        if (handle->db->GetProperty(handle->data, name, &value)) {
+            props.emplace_back(name, value);
+        }
+    }
+
+    for (const char* name : INT_PROPERTIES) {
+        uint64_t intValue = 0;
+        if (handle->db->GetIntProperty(handle->data, name, &intValue)) {
+            props.emplace_back(name, to_string(intValue));
+        }
+    }
+
+    map<string, string> cfstats;
+    if (handle->db->GetMapProperty(handle->data, "rocksdb.cfstats", &cfstats)) {
+        for (const auto& stat : cfstats) {
+            props.emplace_back("rocksdb.cfstats." + stat.first, stat.second);
+        }
+    }
+
+    uint32 count = props.size();
+    *names = (char**) palloc0(count * sizeof(char*));
+    *values = (char**) palloc0(count * sizeof(char*));
+    for (uint32 i = 0; i < count; i++) {
+        (*names)[i] = CopyString(props[i].first);
+        (*values)[i] = CopyString(props[i].second);
+    }
+    return count;
+}
+
+/*
+ * Returns the tickers and histograms of the statistics this backend has
+ * collected on the table, in a palloc'd array. Tickers only have a count.
+ */
+uint32 GetStatistics(void* db, KVStatistic** statistics) {
+    KVHandle* handle = static_cast<KVHandle*>(db);
+    *statistics = NULL;
+    if (!handle->statistics) return 0;
+
+    Statistics* stats = handle->statistics.get();
+    uint32 count = TickersNameMap.size() + HistogramsNameMap.size();
+    KVStatistic* result = (KVStatistic*) palloc0(count * sizeof(KVStatistic));
+
+    uint32 i = 0;
+    for (const auto& ticker : TickersNameMap) {
+        result[i].name = CopyString(ticker.second);
+        result[i].isHistogram = false;
+        result[i].count = stats->getTickerCount(ticker.first);
+        i++;
+    }
+
+    for (const auto& histogram : HistogramsNameMap) {
+        HistogramData data;
+        stats->histogramData(histogram.first, &data);
+        result[i].name = CopyString(histogram.second);
+        result[i].isHistogram = true;
+        result[i].count = data.count;
+        result[i].sum = data.sum;
+        result[i].median = data.median;
+        result[i].p95 = data.percentile95;
+        result[i].p99 = data.percentile99;
+        result[i].max = data.max;
+        i++;
+    }
+
+    *statistics = result;
+    return count;
+}
+
+/*
+ * Sums the memory used by the given databases: their memtables and table
+ * readers, and the block caches they use, along with the block cache and
+ * memtables of all the tables of the backend. Databases shared by several
+ * tables and caches are counted once.
+ */
+void GetMemoryUsage(uint32 count, void** dbs, KVMemoryUsage* usage) {
+    vector<DB*> kvdbs;
+    unordered_set<const Cache*> caches;
+    if (blockCache) caches.insert(blockCache.get());
+    for (uint32 i = 0; i < count; i++) {
+        DB* kvdb = GetDB(dbs[i]);
+        if (find(kvdbs.begin(), kvdbs.end(), kvdb) != kvdbs.end()) continue;
+        kvdbs.push_back(kvdb);
+
+        auto tableOptions = kvdb->GetOptions().table_factory->
+            GetOptions<BlockBasedTableOptions>();
+        if (tableOptions && tableOptions->block_cache) {
+            caches.insert(tableOptions->block_cache.get());
+        }
+    }
+
+    map<MemoryUtil::UsageType, uint64_t> usageByType;
+    MemoryUtil::GetApproxMemoryUsageByType(kvdbs, caches, &usageByType);
+
+    usage->memtables = usageByType[MemoryUtil::kMemTableTotal];
+    usage->unflushedMemtables = usageByType[MemoryUtil::kMemTableUnFlushed];
+    usage->tableReaders = usageByType[MemoryUtil::kTableReadersTotal];
+    usage->blockCache = usageByType[MemoryUtil::kCacheTotal];
+    usage->blockCachePinned = 0;
+    for (const Cache* cache : caches) {
+        usage->blockCachePinned += cache->GetPinnedUsage();
+    }
+
+    /* the budget accounts for the memtables of every table of the backend */
+    if (writeBufferManager && writeBufferManager->enabled()) {
+        usage->memtables = writeBufferManager->memory_usage();
+        usage->unflushedMemtables =
+            writeBufferManager->mutable_memtable_memory_usage();
+    }
 }
 
 }
@@ -14,19 +14,208 @@ extern "C" {
  * C wrapper
  */
 
-void* Open(char* path);
+/* maximum number of levels given their own compression */
+#define KV_MAX_COMPRESSION_LEVELS 7
+#define KV_MAX_LEVEL_PATHS 4
+
+typedef enum KVCompression {
+    KV_COMPRESSION_DEFAULT,
+    KV_COMPRESSION_NONE,
+    KV_COMPRESSION_SNAPPY,
+    KV_COMPRESSION_ZLIB,
+    KV_COMPRESSION_LZ4,
+    KV_COMPRESSION_ZSTD
+} KVCompression;
+
+typedef enum KVCompactionStyle {
+    KV_COMPACTION_DEFAULT,
+    KV_COMPACTION_LEVEL,
+    KV_COMPACTION_UNIVERSAL
+} KVCompactionStyle;
+
+/*
+ * A directory the files of a table are placed in, filled up to the target
+ * size before the files of the next levels go to the next directory.
+ */
+typedef struct KVLevelPath {
+    char *path;
+    uint64 targetSize;
+} KVLevelPath;
+
+/*
+ * Tuning of a table, from the options of the foreign table and its server.
+ * Zero leaves the RocksDB default of a setting. A single compression applies
+ * to all levels, and a list to the levels in order, the last one to the
+ * levels beyond the list.
+ */
+typedef struct KVTableOptions {
+    int compressionLevels;
+    KVCompression compression[KV_MAX_COMPRESSION_LEVELS];
+    int blockSize;
+    int bloomBitsPerKey;
+    int writeBufferSize;
+    int maxWriteBufferNumber;
+    KVCompactionStyle compactionStyle;
+    int targetFileSize;
+    bool cacheIndexAndFilterBlocks;
+    int levelPathCount;
+    KVLevelPath levelPaths[KV_MAX_LEVEL_PATHS];
+    int ttl;                 /* seconds after which rows expire */
+    int deletionTrigger;     /* deletes that get a file compacted */
+    int deletionWindow;      /* consecutive entries they are counted in */
+} KVTableOptions;
+
+/* size estimates of a table, as kept in the shared statistics cache */
+typedef struct KVTableStats {
+    uint64 keyCount;
+    uint64 liveDataSize;
+    double keyWidth;
+    double valueWidth;
+} KVTableStats;
+
+/*
+ * Engine counters of the backend, from the RocksDB PerfContext and
+ * IOStatsContext. They only grow while collection is enabled, so the work of
+ * a call is the difference of two snapshots. Times are in nanoseconds.
+ */
+typedef struct KVPerfCounters {
+    uint64 blockCacheHits;
+    uint64 blockReads;
+    uint64 blockReadBytes;
+    uint64 blockReadTime;
+    uint64 memtableLookups;
+    uint64 bloomFilterUseful;
+    uint64 bloomFilterPositive;
+    uint64 keysSkipped;
+    uint64 deletesSkipped;
+    uint64 bytesRead;
+    uint64 readTime;
+    uint64 getTime;
+    uint64 seekTime;
+    uint64 nextTime;
+} KVPerfCounters;
+
+/* a RocksDB ticker, or a histogram with its percentiles */
+typedef struct KVStatistic {
+    char* name;
+    bool isHistogram;
+    uint64 count;
+    uint64 sum;
+    double median;
+    double p95;
+    double p99;
+    double max;
+} KVStatistic;
+
+/* memory used by RocksDB, in bytes */
+typedef struct KVMemoryUsage {
+    uint64 memtables;
+    uint64 unflushedMemtables;
+    uint64 tableReaders;
+    uint64 blockCache;
+    uint64 blockCachePinned;   /* part of blockCache held by readers */
+} KVMemoryUsage;
+
+/* operations whose latency is recorded in a histogram */
+typedef enum KVOperation {
+    KV_OP_GET,
+    KV_OP_MULTIGET,
+    KV_OP_SEEK,
+    KV_OP_PUT,
+    KV_OP_DELETE,
+    KV_OP_COUNT
+} KVOperation;
+
+/*
+ * Latency histogram buckets: bucket 0 counts calls under 1us, and bucket i
+ * calls of [2^(i-1), 2^i) us, with the last bucket taking everything longer.
+ */
+#define KV_LATENCY_BUCKETS 24
+
+/*
+ * Operation counters of a table, kept in shared memory and updated by every
+ * backend. The fields are only accessed through the GCC atomic builtins, as
+ * the struct is shared with the C++ wrappers, which can't use the atomics of
+ * PostgreSQL.
+ */
+typedef struct KVOpStats {
+    uint64 gets;
+    uint64 multiGets;
+    uint64 multiGetKeys;
+    uint64 seeks;
+    uint64 rowsScanned;
+    uint64 puts;
+    uint64 deletes;
+    uint64 bytesRead;
+    uint64 bytesWritten;
+    uint64 latency[KV_OP_COUNT][KV_LATENCY_BUCKETS];
+} KVOpStats;
+
+/*
+ * Process-wide RocksDB settings, applied to every table a backend opens. The
+ * background threads are shared by all the tables of the backend, and so is
+ * the rate limiter of their background writes. A zero rateLimit disables it.
+ */
+typedef struct KVEngineOptions {
+    int backgroundThreads;
+    int maxBackgroundJobs;
+    int maxSubcompactions;
+    int maxOpenFiles;
+    uint64 bytesPerSync;
+    uint64 rateLimit;
+} KVEngineOptions;
+
+void* Open(char* path, char* family, KVTableOptions* tableOptions,
+           char** error);
+void* OpenForReadOnly(char* path, char* family,
+                      KVTableOptions* tableOptions);
+bool DropFamily(char* path, char* family, KVTableOptions* tableOptions,
+                char** error);
 void Close(void* db);
+void SetBlockCacheSize(uint64 size);
+void SetMemtableBudget(uint64 size);
+void SetCompactDeletesMin(uint64 count);
+void SetWriteBatchSize(uint64 size);
+void SetEngineOptions(const KVEngineOptions* engineOptions);
+void SetOpStats(void* db, KVOpStats* stats);
+bool ExpiresRows(void* db);
 
 uint64 Count(void* db);
+uint32 GetProperties(void* db, char*** names, char*** values);
+uint32 GetStatistics(void* db, KVStatistic** statistics);
+void GetMemoryUsage(uint32 count, void** dbs, KVMemoryUsage* usage);
+uint64 LiveDataSize(void* db);
+void GetTableStats(void* db, KVTableStats* stats);
 
 void* GetIter(void* db);
 void DelIter(void* it);
+void RewindIter(void* it);
+void SeekIter(void* it, char* key, uint32 keyLen);
 bool Next(void* db, void* iter, char** key, uint32* keyLen,
           char** value, uint32* valLen);
 
 bool Get(void* db, char* key, uint32 keyLen, char** value, uint32* valLen);
+void MultiGet(void* db, uint32 count, char** keys, uint32* keyLens,
+              char** values, uint32* valLens, bool* found);
 bool Put(void* db, char* key, uint32 keyLen, char* value, uint32 valLen);
-bool Delete(void* db, char* key, uint32 keyLen);
+bool Delete(void* db, char* key, uint32 keyLen, bool* found);
+bool DeleteRange(void* db, char* lower, uint32 lowerLen,
+                 char* upper, uint32 upperLen, uint64* count);
+bool Truncate(void* db, uint64* count);
+void BeginWrites(void* db);
+bool EndWrites(void* db);
+void AbortWrites(void* db);
+
+/* implemented by the FDW, which has access to the wait event reporting */
+void ReportWaitStart(void);
+void ReportWaitEnd(void);
+
+void EnablePerfCounters(bool timing);
+void DisablePerfCounters(void);
+void ResetPerfCounters(void);
+void ReadPerfCounters(KVPerfCounters* counters);
+void AccumulatePerfCounters(KVPerfCounters* total,
+                            const KVPerfCounters* start);
 
 
 #if defined(__cplusplus)
@@ -2,17 +2,43 @@
 #include <src/kv_utility.h>
 #include "postgres.h"
 #include "access/reloptions.h"
+#include "access/stratnum.h"
+#include "access/sysattr.h"
 #include "foreign/fdwapi.h"
 #include "foreign/foreign.h"
+#include "optimizer/clauses.h"
+#include "optimizer/cost.h"
 #include "optimizer/pathnode.h"
+#include "optimizer/paths.h"
 #include "optimizer/planmain.h"
 #include "optimizer/restrictinfo.h"
+#include "optimizer/var.h"
 #include "funcapi.h"
 #include "utils/rel.h"
+#include "nodes/extensible.h"
 #include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
 #include "access/tuptoaster.h"
-#include "catalog/pg_operator.h"
-#include "utils/syscache.h"
+#include "catalog/pg_aggregate.h"
+#include "catalog/pg_namespace.h"
+#include "catalog/pg_type.h"
+#include "commands/explain.h"
+#include "commands/vacuum.h"
+#include "executor/executor.h"
+#include "executor/instrument.h"
+#include "mb/pg_wchar.h"
+#include "parser/parse_coerce.h"
+#include "parser/parse_relation.h"
+#include "parser/parsetree.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/fmgroids.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/pg_locale.h"
+#include "utils/ruleutils.h"
+#include "utils/sampling.h"
+#include "utils/selfuncs.h"
 #include "utils/typcache.h"
 
 
@@ -24,15 +50,108 @@ PG_FUNCTION_INFO_V1(kv_fdw_validator);
 
 #define KVKEYJUNK "__key_junk"
 
+/* maximum number of keys resolved by one MultiGet call */
+#define KV_MULTIGET_BATCH_SIZE 1000
+
+/*
+ * Cost model constants, relative to seq_page_cost. Creating an iterator
+ * pins the current memtables and table readers, a seek positions it with a
+ * binary search over every level, and advancing it is cheap compared to
+ * both. Decoding a row is charged as cpu_tuple_cost on top.
+ */
+#define KV_ITER_STARTUP_COST 10.0
+#define KV_SEEK_COST 4.0
+#define KV_NEXT_COST 0.01
+#define KV_GET_COST 1.0
+#define KV_MULTIGET_KEY_COST 0.5
+
+
+/*
+ * The ways a scan can access the table. The method chosen for a path is
+ * passed from the path through the plan to the executor in fdw_private.
+ */
+typedef enum {
+    KV_SCAN_FULL,      /* iterate over all keys */
+    KV_SCAN_RANGE,     /* seek to a lower bound and stop at an upper bound */
+    KV_SCAN_POINT,     /* Get a single key */
+    KV_SCAN_MULTIGET,  /* MultiGet a list of keys */
+    KV_SCAN_SKIP,      /* return each distinct key prefix once */
+    KV_SCAN_COUNT      /* return the row count kept by the table */
+} KVAccessMethod;
+
+#define KV_SCAN_KEY_METHODS (KV_SCAN_MULTIGET + 1)
+
+/* The kinds of quals on the key column that an access method can use. */
+typedef enum {
+    KV_QUAL_NONE,
+    KV_QUAL_EQUAL,     /* key = expr */
+    KV_QUAL_ANY,       /* key = ANY(array expr) */
+    KV_QUAL_LOWER,     /* key > expr or key >= expr */
+    KV_QUAL_UPPER      /* key < expr or key <= expr */
+} KVQualKind;
+
+/*
+ * Indexes of the items in the fdw_private list of a ForeignScan plan. The
+ * quals are classified once in GetForeignPlan: keys compared with constants
+ * are serialized there and stored as bytea constants, and the other values
+ * are stored in fdw_exprs and evaluated by the executor. A missing constant
+ * key is a null bytea constant, and a missing expression has index -1.
+ */
+enum KVScanPrivateIndex {
+    KVScanPrivateRelationId,      /* Integer: OID of the scanned table */
+    KVScanPrivateMethod,          /* Integer: KVAccessMethod */
+    KVScanPrivatePrefixLength,    /* Integer: prefix length of a skip scan */
+    KVScanPrivateKeys,            /* List of lookup keys, sorted and distinct */
+    KVScanPrivateKeyExpr,         /* Integer: fdw_exprs index of lookup value */
+    KVScanPrivateLowerKey,        /* lower bound of a range scan */
+    KVScanPrivateLowerExpr,       /* Integer: fdw_exprs index of lower bound */
+    KVScanPrivateLowerInclusive,  /* Integer: lower bound is inclusive */
+    KVScanPrivateUpperKey,        /* upper bound of a range scan */
+    KVScanPrivateUpperExpr,       /* Integer: fdw_exprs index of upper bound */
+    KVScanPrivateUpperInclusive,  /* Integer: upper bound is inclusive */
+    KVScanPrivateUpdateAttrs,     /* direct update: attributes it sets */
+    KVScanPrivateUpdateExprs      /* direct update: fdw_exprs of their values */
+};
 
 /*
  * The plan state is set up in GetForeignRelSize and stashed away in
  * baserel->fdw_private and fetched in GetForeignPaths.
  */
 typedef struct {
-    void *db;
+    Oid relationId;
+    Oid keyTypeId;
+    double totalRows;
+    bool expiresRows;
+
+    /*
+     * Number of rows each access method reads from the table to answer the
+     * restriction quals, or -1 if the quals don't allow the method.
+     */
+    double accessRows[KV_SCAN_KEY_METHODS];
 } TablePlanState;
 
+/*
+ * The scan clauses of a plan, split by GetForeignPlan into the key quals the
+ * access method enforces and the quals left for the executor to check, along
+ * with the keys and bounds that go into fdw_private.
+ */
+typedef struct {
+    List *keyClauses;
+    List *localClauses;
+    List *exprs;           /* values evaluated by the executor */
+
+    bool hasKey;
+    List *keys;
+    int keyExpr;
+
+    Const *lowerKey;
+    int lowerExpr;
+    bool lowerInclusive;
+    Const *upperKey;
+    int upperExpr;
+    bool upperInclusive;
+} KVScanQuals;
+
 /*
  * The scan state is for maintaining state for a scan, either for a
  * SELECT or UPDATE or DELETE.
@@ -41,147 +160,133 @@ typedef struct {
  * subsequently used in IterateForeignScan, EndForeignScan and ReScanForeignScan.
  */
 typedef struct {
+    Oid relationId;
     void *db;
     void *iter;
     bool isKeyBased;
-    bool done;
-    StringInfo key;
+
+    KVAccessMethod method;
+    bool scanDone;
+
+    /*
+     * Range scans seek to the lower bound and stop after the upper bound.
+     * Constant bounds are serialized by the planner, and the others are
+     * evaluated on the first iteration after begin or rescan.
+     */
+    StringInfo lowerKey;
+    ExprState *lowerExprState;
+    bool lowerInclusive;
+    StringInfo upperKey;
+    ExprState *upperExprState;
+    bool upperInclusive;
+    bool rangeReady;
+
+    /*
+     * Skip scans return each distinct prefix of skipPrefixLength characters
+     * of the key once, seeking past the other keys sharing the prefix.
+     */
+    int skipPrefixLength;
+
+    /*
+     * Key based lookups: keyExprState yields either a single key or, for
+     * key = ANY(array), an array of keys. The keys are evaluated on the first
+     * iteration after begin or rescan, since they may depend on parameters
+     * supplied by an outer relation. Constant keys are serialized by the
+     * planner, and keyExprState is NULL then.
+     */
+    ExprState *keyExprState;
+    bool keyIsArray;
+    bool keysReady;
+    StringInfo *keys;      /* sorted, distinct serialized keys */
+    uint32 keyCount;
+    uint32 nextKey;        /* first key of the next batch */
+    MemoryContext lookupContext;
+
+    /* results of the current MultiGet batch */
+    char **batchValues;
+    uint32 *batchValLens;
+    bool *batchFound;
+    uint32 batchStart;
+    uint32 batchCount;
+    uint32 batchIndex;
+    MemoryContext batchContext;
+
+    /* rows read from the table, reported by EXPLAIN ANALYZE */
+    uint64 rowsFetched;
+
+    /* engine counters for EXPLAIN (ANALYZE, BUFFERS), NULL if not collected */
+    KVPerfCounters *perfCounters;
+
+    /* phase timings, NULL unless kv_fdw.trace_timing is on */
+    KVTrace *trace;
 } TableReadState;
 
 /*
  * The modify state is for maintaining state of modify operations.
  *
- * It is set up in BeginForeignModify and stashed in
- * rinfo->ri_FdwState and subsequently used in ExecForeignInsert,
+ * It is set up in BeginForeignModify, or BeginForeignInsert for COPY, and
+ * stashed in rinfo->ri_FdwState and subsequently used in ExecForeignInsert,
  * ExecForeignUpdate, ExecForeignDelete and EndForeignModify.
  */
 typedef struct {
+    Oid relationId;
     void *db;
     CmdType operation;
     AttrNumber keyJunkNo;
-} TableWriteState;
-
-
-static void GetForeignRelSize(PlannerInfo *root,
-                              RelOptInfo *baserel,
-                              Oid foreignTableId) {
-    printf("\n-----------------GetForeignRelSize----------------------\n");
-    /*
-     * Obtain relation size estimates for a foreign table. This is called at
-     * the beginning of planning for a query that scans a foreign table. root
-     * is the planner's global information about the query; baserel is the
-     * planner's information about this table; and foreigntableid is the
-     * pg_class OID of the foreign table. (foreigntableid could be obtained
-     * from the planner data structures, but it's passed explicitly to save
-     * effort.)
-     *
-     * This function should update baserel->rows to be the expected number of
-     * rows returned by the table scan, after accounting for the filtering
-     * done by the restriction quals. The initial value of baserel->rows is
-     * just a constant default estimate, which should be replaced if at all
-     * possible. The function may also choose to update baserel->width if it
-     * can compute a better estimate of the average result row width.
-     */
-
-    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
-
-    TablePlanState *planState = palloc0(sizeof(TablePlanState));
-
-    FdwOptions *fdwOptions = KVGetOptions(foreignTableId);
-    planState->db = Open(fdwOptions->filename);
-
-    baserel->fdw_private = (void *) planState;
-
-    /* TODO better estimation */
-    baserel->rows = Count(planState->db);
-}
-
-static void GetForeignPaths(PlannerInfo *root,
-                            RelOptInfo *baserel,
-                            Oid foreignTableId) {
-    printf("\n-----------------GetForeignPaths----------------------\n");
-    /*
-     * Create possible access paths for a scan on a foreign table. This is
-     * called during query planning. The parameters are the same as for
-     * GetForeignRelSize, which has already been called.
-     *
-     * This function must generate at least one access path (ForeignPath node)
-     * for a scan on the foreign table and must call add_path to add each such
-     * path to baserel->pathlist. It's recommended to use
-     * create_foreignscan_path to build the ForeignPath nodes. The function
-     * can generate multiple access paths, e.g., a path which has valid
-     * pathkeys to represent a pre-sorted result. Each access path must
-     * contain cost estimates, and can contain any FDW-private information
-     * that is needed to identify the specific scan method intended.
-     */
-
-    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
 
-    Cost startupCost = 0;
-    Cost totalCost = startupCost + baserel->rows;
-
-    /* Create a ForeignPath node and add it as only possible path */
-    add_path(baserel,
-             (Path *) create_foreignscan_path(root,
-                                              baserel,
-                                              NULL,  /* default pathtarget */
-                                              baserel->rows,
-                                              startupCost,
-                                              totalCost,
-                                              NIL,   /* no pathkeys */
-                                              NULL,  /* no outer rel either */
-                                              NULL,  /* no extra plan */
-                                              NIL)); /* no fdw_private data */
-}
-
-static ForeignScan *GetForeignPlan(PlannerInfo *root,
-                                   RelOptInfo *baserel,
-                                   Oid foreignTableId,
-                                   ForeignPath *bestPath,
-                                   List *targetList,
-                                   List *scanClauses,
-                                   Plan *outerPlan) {
-    printf("\n-----------------GetForeignPlan----------------------\n");
-    /*
-     * Create a ForeignScan plan node from the selected foreign access path.
-     * This is called at the end of query planning. The parameters are as for
-     * GetForeignRelSize, plus the selected ForeignPath (previously produced
-     * by GetForeignPaths), the target list to be emitted by the plan node,
-     * and the restriction clauses to be enforced by the plan node.
-     *
-     * This function must create and return a ForeignScan plan node; it's
-     * recommended to use make_foreignscan to build the ForeignScan node.
-     *
-     */
+    /* rows written to the table, reported by EXPLAIN ANALYZE */
+    uint64 rowsWritten;
 
-    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+    /* engine counters for EXPLAIN (ANALYZE, BUFFERS), NULL if not collected */
+    KVPerfCounters *perfCounters;
 
-    /*
-     * We have no native ability to evaluate restriction clauses, so we just
-     * put all the scan_clauses into the plan node's qual list for the
-     * executor to check. So all we have to do here is strip RestrictInfo
-     * nodes from the clauses and ignore pseudoconstants (which will be
-     * handled elsewhere).
-     */
+    /* phase timings, NULL unless kv_fdw.trace_timing is on */
+    KVTrace *trace;
+} TableWriteState;
 
-    scanClauses = extract_actual_clauses(scanClauses, false);
+/*
+ * The direct modify state is for an UPDATE or DELETE executed without a scan
+ * feeding ExecForeignUpdate or ExecForeignDelete. A DELETE of a key range,
+ * or of the whole table, is one range deletion, and the rows of a key
+ * lookup are deleted, or have the columns the UPDATE sets replaced in their
+ * stored value, key by key.
+ *
+ * It is set up in BeginDirectModify and stashed in node->fdw_state and
+ * subsequently used in IterateDirectModify and EndDirectModify.
+ */
+typedef struct {
+    Oid relationId;
+    void *db;
+    CmdType operation;
+    KVAccessMethod method;
+
+    /* the bounds of a range, as for a range scan */
+    StringInfo lowerKey;
+    ExprState *lowerExprState;
+    bool lowerInclusive;
+    StringInfo upperKey;
+    ExprState *upperExprState;
+    bool upperInclusive;
+
+    /* the keys of a lookup, as for a key based scan */
+    ExprState *keyExprState;
+    bool keyIsArray;
+    StringInfo *keys;
+    uint32 keyCount;
+
+    /* the attributes an update sets, and the states of their values */
+    int updateCount;
+    AttrNumber *updateAttrs;
+    ExprState **updateExprStates;
+
+    bool writing;          /* the writes of the lookup go in a batch */
+    bool done;
+    uint64 rowsModified;
 
-    /*
-     * Build the fdw_private list that will be available to the executor.
-     */
-    TablePlanState *planState = (TablePlanState *) baserel->fdw_private;
-    List *fdwPrivate = list_make1(planState->db);
+    /* phase timings, NULL unless kv_fdw.trace_timing is on */
+    KVTrace *trace;
+} TableDirectState;
 
-    /* Create the ForeignScan node */
-    return make_foreignscan(targetList,
-                            scanClauses,
-                            baserel->relid,
-                            NIL, /* no expressions to evaluate */
-                            fdwPrivate,
-                            NIL, /* no custom tlist */
-                            NIL, /* no remote quals */
-                            NULL);
-}
 
 static void SerializeAttribute(TupleDesc tupleDescriptor,
                                Index index,
@@ -212,194 +317,1690 @@ static void SerializeAttribute(TupleDesc tupleDescriptor,
     buffer->len = datumLength;
 }
 
-static void GetKeyBasedQual(Node *node,
-                            TupleDesc tupleDescriptor,
-                            TableReadState *readState) {
-    if (!node || !IsA(node, OpExpr)) {
-        return;
+/*
+ * Keys are stored in an order-preserving encoding, so that the bytewise
+ * ordering of RocksDB matches the ordering of the key column. Integers are
+ * stored big endian with the sign bit flipped, and text, varchar and bytea
+ * are stored as their raw bytes, which sorts like the C collation. Keys of
+ * other types keep their in-tuple representation and only support equality.
+ */
+static bool IsOrderPreservingKeyType(Oid typeId) {
+    switch (typeId) {
+        case INT2OID:
+        case INT4OID:
+        case INT8OID:
+        case TEXTOID:
+        case VARCHAROID:
+        case BYTEAOID:
+            return true;
+        default:
+            return false;
     }
+}
 
-    OpExpr *op = (OpExpr *) node;
-    if (list_length(op->args) != 2) {
-        return;
-    }
+static void SerializeKeyInteger(int64 value, int length, StringInfo key) {
+    uint64 encoded = ((uint64) value) ^ (UINT64CONST(1) << (length * 8 - 1));
 
-    Node *left = list_nth(op->args, 0);
-    if (!IsA(left, Var)) {
-        return;
+    enlargeStringInfo(key, length);
+    for (int index = 0; index < length; index++) {
+        key->data[key->len + index] = (char) (encoded >> ((length - 1 - index) * 8));
     }
+    key->len += length;
+}
 
-    Node *right = list_nth(op->args, 1);
-    if (!IsA(right, Const)) {
-        return;
+static int64 DeserializeKeyInteger(const char *data, int length) {
+    uint64 encoded = 0;
+    for (int index = 0; index < length; index++) {
+        encoded = (encoded << 8) | (uint8) data[index];
     }
+    encoded ^= (UINT64CONST(1) << (length * 8 - 1));
 
-    Index varattno = ((Var *) left)->varattno;
-    if (varattno != 1) {
-        return;
+    /* sign extend the value to 64 bits */
+    int shift = 64 - length * 8;
+    return ((int64) (encoded << shift)) >> shift;
+}
+
+static void SerializeKey(TupleDesc tupleDescriptor, Datum datum, StringInfo key) {
+    Form_pg_attribute attributeForm = TupleDescAttr(tupleDescriptor, 0);
+
+    switch (attributeForm->atttypid) {
+        case INT2OID:
+            SerializeKeyInteger(DatumGetInt16(datum), sizeof(int16), key);
+            return;
+        case INT4OID:
+            SerializeKeyInteger(DatumGetInt32(datum), sizeof(int32), key);
+            return;
+        case INT8OID:
+            SerializeKeyInteger(DatumGetInt64(datum), sizeof(int64), key);
+            return;
+        case TEXTOID:
+        case VARCHAROID:
+        case BYTEAOID: {
+            struct varlena *value = PG_DETOAST_DATUM_PACKED(datum);
+            appendBinaryStringInfo(key, VARDATA_ANY(value), VARSIZE_ANY_EXHDR(value));
+            return;
+        }
+        default:
+            break;
     }
 
-    /* get the name of the operator according to PG_OPERATOR OID */
-    HeapTuple opertup = SearchSysCache1(OPEROID, ObjectIdGetDatum(op->opno));
-    if (!HeapTupleIsValid(opertup)) {
-        ereport(ERROR, (errmsg("cache lookup failed for operator %u", op->opno)));
+    if (attributeForm->attlen == -1) {
+        /* Make sure item to be inserted is not toasted */
+        datum = PointerGetDatum(PG_DETOAST_DATUM_PACKED(datum));
+
+        if (attributeForm->attstorage != 'p' && VARATT_CAN_MAKE_SHORT(datum)) {
+            /* convert to short varlena -- no alignment */
+            Pointer val = DatumGetPointer(datum);
+            uint32 shortSize = VARATT_CONVERTED_SHORT_SIZE(val);
+            Pointer temp = palloc0(shortSize);
+            SET_VARSIZE_SHORT(temp, shortSize);
+            memcpy(temp + 1, VARDATA(val), shortSize - 1);
+            datum = PointerGetDatum(temp);
+        }
     }
-    Form_pg_operator operform = (Form_pg_operator) GETSTRUCT(opertup);
-    char *oprname = NameStr(operform->oprname);
-    if (strncmp(oprname, "=", NAMEDATALEN)) {
-        ReleaseSysCache(opertup);
-        return;
+
+    SerializeAttribute(tupleDescriptor, 0, datum, key);
+}
+
+static Datum DeserializeKey(TupleDesc tupleDescriptor, StringInfo key) {
+    Form_pg_attribute attributeForm = TupleDescAttr(tupleDescriptor, 0);
+
+    switch (attributeForm->atttypid) {
+        case INT2OID:
+            return Int16GetDatum(DeserializeKeyInteger(key->data, sizeof(int16)));
+        case INT4OID:
+            return Int32GetDatum(DeserializeKeyInteger(key->data, sizeof(int32)));
+        case INT8OID:
+            return Int64GetDatum(DeserializeKeyInteger(key->data, sizeof(int64)));
+        case TEXTOID:
+        case VARCHAROID:
+        case BYTEAOID: {
+            struct varlena *value = palloc(VARHDRSZ + key->len);
+            SET_VARSIZE(value, VARHDRSZ + key->len);
+            memcpy(VARDATA(value), key->data, key->len);
+            return PointerGetDatum(value);
+        }
+        default:
+            return fetch_att(key->data, attributeForm->attbyval, attributeForm->attlen);
     }
-    ReleaseSysCache(opertup);
+}
 
-    Const *constNode = ((Const *) right);
-    Datum datum = constNode->constvalue;
+static bool IsIntegerKeyType(Oid typeId) {
+    return typeId == INT2OID || typeId == INT4OID || typeId == INT8OID;
+}
 
-    TypeCacheEntry *typeEntry = lookup_type_cache(constNode->consttype, 0);
-    /* Make sure item to be inserted is not toasted */
-    if (typeEntry->typlen == -1) {
-        datum = PointerGetDatum(PG_DETOAST_DATUM_PACKED(datum));
+static int64 DatumGetKeyInteger(Datum datum, Oid typeId) {
+    switch (typeId) {
+        case INT2OID:
+            return DatumGetInt16(datum);
+        case INT4OID:
+            return DatumGetInt32(datum);
+        default:
+            return DatumGetInt64(datum);
+    }
+}
+
+/*
+ * Serializes a lookup value of the key column the same way the key of a
+ * stored tuple is serialized. Integer keys are also compared with integers
+ * of the other widths, which are converted to the key type. A value out of
+ * its range becomes a key that sorts before or after all the keys of the
+ * table: it matches no key, and a range bounded by it starts or ends with
+ * the table.
+ */
+static StringInfo SerializeLookupKey(TupleDesc tupleDescriptor,
+                                     Datum datum,
+                                     Oid valueTypeId) {
+    StringInfo key = makeStringInfo();
+    Oid keyTypeId = TupleDescAttr(tupleDescriptor, 0)->atttypid;
+    if (valueTypeId == keyTypeId || !IsIntegerKeyType(valueTypeId) ||
+        !IsIntegerKeyType(keyTypeId)) {
+        SerializeKey(tupleDescriptor, datum, key);
+        return key;
     }
 
-    if (typeEntry->typlen == -1 && typeEntry->typstorage != 'p' &&
-        VARATT_CAN_MAKE_SHORT(datum)) {
-        /* convert to short varlena -- no alignment */
-        Pointer val = DatumGetPointer(datum);
-        uint32 shortSize = VARATT_CONVERTED_SHORT_SIZE(val);
-        Pointer temp = palloc0(shortSize);
-        SET_VARSIZE_SHORT(temp, shortSize);
-        memcpy(temp + 1, VARDATA(val), shortSize - 1);
-        datum = PointerGetDatum(temp);
+    int64 value = DatumGetKeyInteger(datum, valueTypeId);
+    int length = sizeof(int64);
+    int64 minValue = PG_INT64_MIN;
+    int64 maxValue = PG_INT64_MAX;
+    if (keyTypeId == INT2OID) {
+        length = sizeof(int16);
+        minValue = PG_INT16_MIN;
+        maxValue = PG_INT16_MAX;
+    } else if (keyTypeId == INT4OID) {
+        length = sizeof(int32);
+        minValue = PG_INT32_MIN;
+        maxValue = PG_INT32_MAX;
     }
 
-    /*
-     * We can push down this qual if:
-     * - The operatory is =
-     * - The qual is on the key column
-     */
-    readState->isKeyBased = true;
-    readState->key = makeStringInfo();
-    SerializeAttribute(tupleDescriptor, varattno-1, datum, readState->key);
+    if (value > maxValue) {
+        /* longer than the greatest key, whose bytes are all 0xFF */
+        for (int index = 0; index <= length; index++) {
+            appendStringInfoChar(key, (char) 0xFF);
+        }
+    } else if (value >= minValue) {
+        SerializeKeyInteger(value, length, key);
+    }
 
-    return;
+    return key;
 }
 
-static void BeginForeignScan(ForeignScanState *scanState, int executorFlags) {
-    printf("\n-----------------BeginForeignScan----------------------\n");
-    /*
-     * Begin executing a foreign scan. This is called during executor startup.
-     * It should perform any initialization needed before the scan can start,
-     * but not start executing the actual scan (that should be done upon the
-     * first call to IterateForeignScan). The ForeignScanState node has
-     * already been created, but its fdw_state field is still NULL.
-     * Information about the table to scan is accessible through the
-     * ForeignScanState node (in particular, from the underlying ForeignScan
-     * plan node, which contains any FDW-private information provided by
-     * GetForeignPlan). eflags contains flag bits describing the executor's
-     * operating mode for this plan node.
-     *
-     * Note that when (eflags & EXEC_FLAG_EXPLAIN_ONLY) is true, this function
-     * should not perform any externally-visible actions; it should only do
-     * the minimum required to make the node state valid for
-     * ExplainForeignScan and EndForeignScan.
-     *
-     */
+/* Returns the type of the value an expression of the scan evaluates to. */
+static Oid ExprStateType(ExprState *exprState) {
+    return exprType((Node *) exprState->expr);
+}
 
-    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+static int CompareKeyBytes(const char *left, uint32 leftLen,
+                           const char *right, uint32 rightLen) {
+    int result = memcmp(left, right, Min(leftLen, rightLen));
+    if (result != 0) {
+        return result;
+    }
 
-    TableReadState *readState = palloc0(sizeof(TableReadState));
+    return (leftLen > rightLen) - (leftLen < rightLen);
+}
 
-    ForeignScan *foreignScan = (ForeignScan *) scanState->ss.ps.plan;
-    readState->db = list_nth((List *) foreignScan->fdw_private, 0);
+static int CompareKeys(const void *a, const void *b) {
+    StringInfo left = *((const StringInfo *) a);
+    StringInfo right = *((const StringInfo *) b);
 
-    readState->iter = NULL;
-    readState->isKeyBased = false;
-    readState->done = false;
-    readState->key = NULL;
+    return CompareKeyBytes(left->data, left->len, right->data, right->len);
+}
 
-    scanState->fdw_state = (void *) readState;
+/*
+ * Serializes the lookup keys of a value, which is either a single key or an
+ * array of keys. The keys are sorted and deduplicated, so that MultiGet reads
+ * them in key order and each matching row is returned only once. Null never
+ * equals a key, so it yields no keys.
+ */
+static StringInfo *SerializeLookupKeys(TupleDesc tupleDescriptor,
+                                       Datum value,
+                                       Oid valueTypeId,
+                                       bool isNull,
+                                       bool isArray,
+                                       uint32 *keyCount) {
+    List *keyList = NIL;
+    if (!isNull && isArray) {
+        ArrayType *array = DatumGetArrayTypeP(value);
+        Oid elementTypeId = ARR_ELEMTYPE(array);
+
+        int16 typeLength;
+        bool byValue;
+        char typeAlign;
+        get_typlenbyvalalign(elementTypeId, &typeLength, &byValue, &typeAlign);
+
+        Datum *elements = NULL;
+        bool *elementNulls = NULL;
+        int elementCount = 0;
+        deconstruct_array(array, elementTypeId, typeLength, byValue, typeAlign,
+                          &elements, &elementNulls, &elementCount);
+
+        for (int index = 0; index < elementCount; index++) {
+            if (!elementNulls[index]) {
+                keyList = lappend(keyList,
+                                  SerializeLookupKey(tupleDescriptor,
+                                                     elements[index],
+                                                     elementTypeId));
+            }
+        }
+    } else if (!isNull) {
+        keyList = list_make1(SerializeLookupKey(tupleDescriptor, value,
+                                                valueTypeId));
+    }
 
-    /* must after readState is recorded, otherwise explain won't close db */
-    if (executorFlags & EXEC_FLAG_EXPLAIN_ONLY) {
-        return;
+    *keyCount = 0;
+    if (keyList == NIL) {
+        return NULL;
     }
 
+    StringInfo *keys = palloc0(list_length(keyList) * sizeof(StringInfo));
+
     ListCell *lc;
-    foreach (lc, scanState->ss.ps.plan->qual) {
-        Expr *state = lfirst(lc);
-        GetKeyBasedQual((Node *) state,
-                        scanState->ss.ss_currentRelation->rd_att,
-                        readState);
-        if (readState->isKeyBased) {
-            printf("\nkey_based_qual\n");
-            break;
-        }
+    foreach (lc, keyList) {
+        keys[(*keyCount)++] = (StringInfo) lfirst(lc);
     }
 
-    if (!readState->isKeyBased) {
-        readState->iter = GetIter(readState->db);
-    }
-}
+    qsort(keys, *keyCount, sizeof(StringInfo), CompareKeys);
 
-static void DeserializeTuple(StringInfo key,
-                             StringInfo value,
-                             TupleTableSlot *tupleSlot) {
+    uint32 distinctCount = 1;
+    for (uint32 index = 1; index < *keyCount; index++) {
+        if (CompareKeys(&keys[index], &keys[distinctCount - 1]) != 0) {
+            keys[distinctCount++] = keys[index];
+        }
+    }
+    *keyCount = distinctCount;
 
-    Datum *values = tupleSlot->tts_values;
-    bool *nulls = tupleSlot->tts_isnull;
+    return keys;
+}
 
-    TupleDesc tupleDescriptor = tupleSlot->tts_tupleDescriptor;
-    uint32 count = tupleDescriptor->natts;
+/*
+ * Keys serialized by the planner are stored in fdw_private as bytea
+ * constants, which can be copied with the plan. A null constant stands for a
+ * missing key.
+ */
+static Const *MakeKeyConst(StringInfo key) {
+    if (!key) {
+        return makeNullConst(BYTEAOID, -1, InvalidOid);
+    }
 
-    /* initialize all values for this row to null */
-    memset(values, 0, count * sizeof(Datum));
-    memset(nulls, false, count * sizeof(bool));
+    bytea *value = palloc(VARHDRSZ + key->len);
+    SET_VARSIZE(value, VARHDRSZ + key->len);
+    memcpy(VARDATA(value), key->data, key->len);
 
-    uint32 bufLen = (count - 1 + 7) / 8;
+    return makeConst(BYTEAOID, -1, InvalidOid, -1, PointerGetDatum(value),
+                     false, false);
+}
 
-    StringInfo buffer = makeStringInfo();
-    enlargeStringInfo(buffer, bufLen);
-    buffer->len = bufLen;
+static StringInfo KeyFromConst(Const *keyConst) {
+    if (keyConst->constisnull) {
+        return NULL;
+    }
 
-    memcpy(buffer->data, value->data, bufLen);
+    bytea *value = DatumGetByteaPP(keyConst->constvalue);
+    StringInfo key = makeStringInfo();
+    appendBinaryStringInfo(key, VARDATA_ANY(value), VARSIZE_ANY_EXHDR(value));
 
-    for (uint32 index = 1; index < count; index++) {
+    return key;
+}
 
-        uint32 byteIndex = (index - 1) / 8;
-        uint32 bitIndex = (index - 1) % 8;
-        uint8 bitmask = (1 << bitIndex);
-        nulls[index] = (buffer->data[byteIndex] & bitmask)? false: true;
+/*
+ * Checks if the given node references the key column, which is always the
+ * first column of the table. Binary compatible casts are looked through.
+ */
+static bool IsKeyVar(Node *node, Index relid) {
+    if (node && IsA(node, RelabelType)) {
+        node = (Node *) ((RelabelType *) node)->arg;
     }
 
-    uint32 offset = 0;
-    char *current = key->data;
-    for (uint32 index = 0; index < count; index++) {
+    if (!node || !IsA(node, Var)) {
+        return false;
+    }
 
-        if (nulls[index]) {
-            if (index == 0) {
-                ereport(ERROR, (errmsg("first column cannot be null!")));
-            }
-            continue;
-        }
+    Var *var = (Var *) node;
+    return var->varno == relid && var->varattno == 1;
+}
 
-        Form_pg_attribute attributeForm = TupleDescAttr(tupleDescriptor, index);
-        bool byValue = attributeForm->attbyval;
-        int typeLength = attributeForm->attlen;
+/*
+ * Returns the btree strategy of the operator for the key type, or 0 if the
+ * operator doesn't compare keys. Operators are identified by the operator
+ * family of the key type rather than by name, so that any "=" or "<" that
+ * happens to be in the search path isn't mistaken for a key comparison. Key
+ * types without a btree operator class only support equality, which is taken
+ * from their hash operator class.
+ */
+static int KeyOperatorStrategy(Oid operatorId, Oid keyTypeId) {
+    TypeCacheEntry *typeEntry =
+        lookup_type_cache(keyTypeId, TYPECACHE_BTREE_OPFAMILY |
+                                     TYPECACHE_HASH_OPFAMILY);
 
-        values[index] = fetch_att(current, byValue, typeLength);
-        offset = att_addlength_datum(offset, typeLength, current);
+    if (OidIsValid(typeEntry->btree_opf)) {
+        return get_op_opfamily_strategy(operatorId, typeEntry->btree_opf);
+    }
 
-        if (index == 0) {
-            offset = bufLen;
-        }
-        current = value->data + offset;
+    if (OidIsValid(typeEntry->hash_opf) &&
+        get_op_opfamily_strategy(operatorId, typeEntry->hash_opf) ==
+            HTEqualStrategyNumber) {
+        return BTEqualStrategyNumber;
     }
+
+    return 0;
 }
 
-static TupleTableSlot *IterateForeignScan(ForeignScanState *scanState) {
-    printf("\n-----------------IterateForeignScan----------------------\n");
-    /*
-     * Fetch one row from the foreign source, returning it in a tuple table
+/*
+ * Checks if a value of the given type can be serialized as a key of the
+ * table, i.e. it has the same binary representation as the key column, or
+ * it is an integer of another width compared with an integer key, which is
+ * converted when it is serialized.
+ */
+static bool IsKeyCompatibleType(Oid valueTypeId, Oid keyTypeId) {
+    return valueTypeId == keyTypeId ||
+           IsBinaryCoercible(valueTypeId, keyTypeId) ||
+           (IsIntegerKeyType(valueTypeId) && IsIntegerKeyType(keyTypeId));
+}
+
+/*
+ * Classifies a qual on the key column. For a usable qual, valueNode is set to
+ * the expression the key is compared with, and inclusive tells whether a
+ * range bound includes that value. The value must not depend on the scanned
+ * row, but it may refer to other relations; those references are replaced by
+ * parameters of a nested loop before the plan is executed.
+ */
+static KVQualKind ClassifyKeyQual(Node *node,
+                                  Index relid,
+                                  Oid keyTypeId,
+                                  Node **valueNode,
+                                  bool *inclusive) {
+    if (!node) {
+        return KV_QUAL_NONE;
+    }
+
+    Oid operatorId = InvalidOid;
+    Oid collationId = InvalidOid;
+    bool isArray = false;
+    List *args = NIL;
+    if (IsA(node, OpExpr)) {
+        OpExpr *op = (OpExpr *) node;
+        operatorId = op->opno;
+        collationId = op->inputcollid;
+        args = op->args;
+    } else if (IsA(node, ScalarArrayOpExpr)) {
+        ScalarArrayOpExpr *op = (ScalarArrayOpExpr *) node;
+        if (!op->useOr) {
+            return KV_QUAL_NONE;
+        }
+        operatorId = op->opno;
+        collationId = op->inputcollid;
+        args = op->args;
+        isArray = true;
+    } else {
+        return KV_QUAL_NONE;
+    }
+
+    if (list_length(args) != 2) {
+        return KV_QUAL_NONE;
+    }
+
+    Node *left = linitial(args);
+    Node *right = lsecond(args);
+    bool commuted = false;
+    if (!isArray && !IsKeyVar(left, relid)) {
+        Node *temp = left;
+        left = right;
+        right = temp;
+        commuted = true;
+    }
+
+    if (!IsKeyVar(left, relid)) {
+        return KV_QUAL_NONE;
+    }
+
+    if (bms_is_member(relid, pull_varnos(right)) ||
+        contain_volatile_functions(right)) {
+        return KV_QUAL_NONE;
+    }
+
+    Oid valueTypeId = isArray? get_element_type(exprType(right)): exprType(right);
+    if (!IsKeyCompatibleType(valueTypeId, keyTypeId)) {
+        return KV_QUAL_NONE;
+    }
+
+    int strategy = KeyOperatorStrategy(operatorId, keyTypeId);
+    *valueNode = right;
+    *inclusive = true;
+
+    if (strategy == BTEqualStrategyNumber) {
+        return isArray? KV_QUAL_ANY: KV_QUAL_EQUAL;
+    }
+
+    if (isArray || !IsOrderPreservingKeyType(keyTypeId)) {
+        return KV_QUAL_NONE;
+    }
+
+    /* text ranges follow the byte order of the keys only in the C collation */
+    if ((keyTypeId == TEXTOID || keyTypeId == VARCHAROID) &&
+        !lc_collate_is_c(collationId)) {
+        return KV_QUAL_NONE;
+    }
+
+    bool isUpper = false;
+    switch (strategy) {
+        case BTLessStrategyNumber:
+            isUpper = true;
+            *inclusive = false;
+            break;
+        case BTLessEqualStrategyNumber:
+            isUpper = true;
+            break;
+        case BTGreaterStrategyNumber:
+            *inclusive = false;
+            break;
+        case BTGreaterEqualStrategyNumber:
+            break;
+        default:
+            return KV_QUAL_NONE;
+    }
+
+    /* expr < key bounds the key from below */
+    if (commuted) {
+        isUpper = !isUpper;
+    }
+
+    return isUpper? KV_QUAL_UPPER: KV_QUAL_LOWER;
+}
+
+/*
+ * Checks if the join clause has the form key = expr, where expr only refers
+ * to other relations. Such a clause can drive a point lookup per outer row.
+ */
+static bool IsKeyJoinClause(RestrictInfo *restrictInfo,
+                            RelOptInfo *baserel,
+                            Oid keyTypeId) {
+    Node *valueNode = NULL;
+    bool inclusive = false;
+    KVQualKind kind = ClassifyKeyQual((Node *) restrictInfo->clause,
+                                      baserel->relid,
+                                      keyTypeId,
+                                      &valueNode,
+                                      &inclusive);
+
+    return kind == KV_QUAL_EQUAL;
+}
+
+/*
+ * Callback for generate_implied_equalities_for_column, which accepts the
+ * equivalence members that are the key column of the table.
+ */
+static bool IsKeyEquivalenceMember(PlannerInfo *root,
+                                   RelOptInfo *baserel,
+                                   EquivalenceClass *ec,
+                                   EquivalenceMember *em,
+                                   void *arg) {
+    return IsKeyVar((Node *) em->em_expr, baserel->relid);
+}
+
+/*
+ * Estimates the rows each access method reads to answer the restriction
+ * quals of the table, and returns the quals that no access method uses.
+ * Equality on the key reads at most one row, = ANY reads one row per array
+ * element, and the fraction of a range is estimated from the column
+ * statistics collected by ANALYZE, as the planner doesn't open the database.
+ */
+static List *EstimateAccessRows(PlannerInfo *root,
+                                RelOptInfo *baserel,
+                                Oid foreignTableId,
+                                TablePlanState *planState) {
+    Relation relation = heap_open(foreignTableId, NoLock);
+    TupleDesc tupleDescriptor = RelationGetDescr(relation);
+    Oid keyTypeId = TupleDescAttr(tupleDescriptor, 0)->atttypid;
+    planState->keyTypeId = keyTypeId;
+
+    double totalRows = planState->totalRows;
+    for (int method = 0; method < KV_SCAN_KEY_METHODS; method++) {
+        planState->accessRows[method] = -1;
+    }
+    planState->accessRows[KV_SCAN_FULL] = totalRows;
+
+    List *otherClauses = NIL;
+    List *rangeClauses = NIL;
+
+    ListCell *lc;
+    foreach (lc, baserel->baserestrictinfo) {
+        RestrictInfo *restrictInfo = (RestrictInfo *) lfirst(lc);
+
+        Node *valueNode = NULL;
+        bool inclusive = false;
+        KVQualKind kind = ClassifyKeyQual((Node *) restrictInfo->clause,
+                                          baserel->relid,
+                                          keyTypeId,
+                                          &valueNode,
+                                          &inclusive);
+        if (kind == KV_QUAL_EQUAL) {
+            /* the key is unique */
+            planState->accessRows[KV_SCAN_POINT] = Min(totalRows, 1);
+        } else if (kind == KV_QUAL_ANY) {
+            double rows = 0;
+            if (IsA(valueNode, Const) && !((Const *) valueNode)->constisnull) {
+                ArrayType *array =
+                    DatumGetArrayTypeP(((Const *) valueNode)->constvalue);
+                rows = ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array));
+            } else {
+                rows = totalRows * clause_selectivity(root,
+                                                      (Node *) restrictInfo,
+                                                      baserel->relid,
+                                                      JOIN_INNER,
+                                                      NULL);
+            }
+            rows = Min(rows, totalRows);
+
+            double *multiGetRows = &planState->accessRows[KV_SCAN_MULTIGET];
+            if (*multiGetRows < 0 || rows < *multiGetRows) {
+                *multiGetRows = rows;
+            }
+        } else if (kind == KV_QUAL_LOWER || kind == KV_QUAL_UPPER) {
+            rangeClauses = lappend(rangeClauses, restrictInfo);
+        } else {
+            otherClauses = lappend(otherClauses, restrictInfo);
+        }
+    }
+
+    if (rangeClauses != NIL) {
+        Selectivity rangeSelectivity = clauselist_selectivity(root,
+                                                              rangeClauses,
+                                                              baserel->relid,
+                                                              JOIN_INNER,
+                                                              NULL);
+        planState->accessRows[KV_SCAN_RANGE] = rangeSelectivity * totalRows;
+    }
+
+    heap_close(relation, NoLock);
+
+    return otherClauses;
+}
+
+/*
+ * Estimates the cost of reading the given number of rows with an access
+ * method, not including the evaluation of quals and the target list.
+ */
+static void EstimateAccessCost(KVAccessMethod method,
+                               double fetchedRows,
+                               Cost *startupCost,
+                               Cost *runCost) {
+    switch (method) {
+        case KV_SCAN_FULL:
+            *startupCost = KV_ITER_STARTUP_COST;
+            *runCost = fetchedRows * (KV_NEXT_COST + cpu_tuple_cost);
+            break;
+        case KV_SCAN_RANGE:
+            *startupCost = KV_ITER_STARTUP_COST + KV_SEEK_COST;
+            *runCost = fetchedRows * (KV_NEXT_COST + cpu_tuple_cost);
+            break;
+        case KV_SCAN_POINT:
+            *startupCost = 0;
+            *runCost = KV_GET_COST + fetchedRows * cpu_tuple_cost;
+            break;
+        case KV_SCAN_MULTIGET:
+            *startupCost = 0;
+            *runCost = fetchedRows * (KV_MULTIGET_KEY_COST + cpu_tuple_cost);
+            break;
+        case KV_SCAN_SKIP:
+            /* one seek per distinct prefix */
+            *startupCost = KV_ITER_STARTUP_COST;
+            *runCost = fetchedRows * (KV_SEEK_COST + cpu_tuple_cost);
+            break;
+        case KV_SCAN_COUNT:
+            *startupCost = 0;
+            *runCost = cpu_tuple_cost;
+            break;
+    }
+}
+
+/*
+ * Adds the cost of evaluating the restriction quals on the fetched rows and
+ * the target list on the returned rows.
+ */
+static void AddQualAndTargetCost(RelOptInfo *baserel,
+                                 double fetchedRows,
+                                 double returnedRows,
+                                 Cost *startupCost,
+                                 Cost *runCost) {
+    *startupCost += baserel->baserestrictcost.startup +
+                    baserel->reltarget->cost.startup;
+    *runCost += baserel->baserestrictcost.per_tuple * fetchedRows +
+                baserel->reltarget->cost.per_tuple * returnedRows;
+}
+
+static void GetForeignRelSize(PlannerInfo *root,
+                              RelOptInfo *baserel,
+                              Oid foreignTableId) {
+    /*
+     * Obtain relation size estimates for a foreign table. This is called at
+     * the beginning of planning for a query that scans a foreign table. root
+     * is the planner's global information about the query; baserel is the
+     * planner's information about this table; and foreigntableid is the
+     * pg_class OID of the foreign table. (foreigntableid could be obtained
+     * from the planner data structures, but it's passed explicitly to save
+     * effort.)
+     *
+     * This function should update baserel->rows to be the expected number of
+     * rows returned by the table scan, after accounting for the filtering
+     * done by the restriction quals. The initial value of baserel->rows is
+     * just a constant default estimate, which should be replaced if at all
+     * possible. The function may also choose to update baserel->width if it
+     * can compute a better estimate of the average result row width.
+     */
+
+    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+
+    TablePlanState *planState = palloc0(sizeof(TablePlanState));
+    planState->relationId = foreignTableId;
+    planState->expiresRows =
+        KVGetOptions(foreignTableId)->tableOptions.ttl > 0;
+
+    baserel->fdw_private = (void *) planState;
+
+    /* the size estimates come from the shared statistics cache */
+    KVTableStats stats;
+    KVGetTableStats(foreignTableId, &stats);
+
+    planState->totalRows = stats.keyCount;
+    baserel->tuples = stats.keyCount;
+    baserel->pages = (BlockNumber) (stats.liveDataSize / BLCKSZ);
+    List *otherClauses = EstimateAccessRows(root, baserel, foreignTableId,
+                                            planState);
+
+    /*
+     * The cheapest access method reads the fewest rows, and the quals it
+     * doesn't use filter them further.
+     */
+    double fetchedRows = planState->totalRows;
+    for (int method = 0; method < KV_SCAN_KEY_METHODS; method++) {
+        if (planState->accessRows[method] >= 0) {
+            fetchedRows = Min(fetchedRows, planState->accessRows[method]);
+        }
+    }
+
+    Selectivity otherSelectivity = clauselist_selectivity(root,
+                                                          otherClauses,
+                                                          baserel->relid,
+                                                          JOIN_INNER,
+                                                          NULL);
+    baserel->rows = clamp_row_est(fetchedRows * otherSelectivity);
+}
+
+static void GetForeignPaths(PlannerInfo *root,
+                            RelOptInfo *baserel,
+                            Oid foreignTableId) {
+    /*
+     * Create possible access paths for a scan on a foreign table. This is
+     * called during query planning. The parameters are the same as for
+     * GetForeignRelSize, which has already been called.
+     *
+     * This function must generate at least one access path (ForeignPath node)
+     * for a scan on the foreign table and must call add_path to add each such
+     * path to baserel->pathlist. It's recommended to use
+     * create_foreignscan_path to build the ForeignPath nodes. The function
+     * can generate multiple access paths, e.g., a path which has valid
+     * pathkeys to represent a pre-sorted result. Each access path must
+     * contain cost estimates, and can contain any FDW-private information
+     * that is needed to identify the specific scan method intended.
+     */
+
+    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+
+    /* Create a ForeignPath node for each access method the quals allow */
+    TablePlanState *planState = (TablePlanState *) baserel->fdw_private;
+    for (int method = 0; method < KV_SCAN_KEY_METHODS; method++) {
+        double fetchedRows = planState->accessRows[method];
+        if (fetchedRows < 0) {
+            continue;
+        }
+
+        Cost startupCost = 0;
+        Cost runCost = 0;
+        EstimateAccessCost(method, fetchedRows, &startupCost, &runCost);
+        AddQualAndTargetCost(baserel, fetchedRows, baserel->rows,
+                             &startupCost, &runCost);
+
+        add_path(baserel,
+                 (Path *) create_foreignscan_path(root,
+                                                  baserel,
+                                                  NULL,  /* default pathtarget */
+                                                  baserel->rows,
+                                                  startupCost,
+                                                  startupCost + runCost,
+                                                  NIL,   /* no pathkeys */
+                                                  NULL,  /* no outer rel either */
+                                                  NULL,  /* no extra plan */
+                                                  list_make1(makeInteger(method))));
+    }
+
+    /*
+     * Add parameterized paths for join clauses on the key column, so that a
+     * nested loop can resolve each outer row with a point lookup instead of
+     * scanning the whole table.
+     */
+    List *keyJoinClauses = NIL;
+    ListCell *lc;
+    foreach (lc, baserel->joininfo) {
+        RestrictInfo *restrictInfo = (RestrictInfo *) lfirst(lc);
+        if (join_clause_is_movable_to(restrictInfo, baserel) &&
+            IsKeyJoinClause(restrictInfo, baserel, planState->keyTypeId)) {
+            keyJoinClauses = lappend(keyJoinClauses, restrictInfo);
+        }
+    }
+
+    if (baserel->has_eclass_joins) {
+        List *ecClauses =
+            generate_implied_equalities_for_column(root,
+                                                   baserel,
+                                                   IsKeyEquivalenceMember,
+                                                   NULL,
+                                                   baserel->lateral_referencers);
+        foreach (lc, ecClauses) {
+            RestrictInfo *restrictInfo = (RestrictInfo *) lfirst(lc);
+            if (IsKeyJoinClause(restrictInfo, baserel, planState->keyTypeId)) {
+                keyJoinClauses = lappend(keyJoinClauses, restrictInfo);
+            }
+        }
+    }
+
+    foreach (lc, keyJoinClauses) {
+        RestrictInfo *restrictInfo = (RestrictInfo *) lfirst(lc);
+
+        Relids requiredOuter = bms_union(restrictInfo->clause_relids,
+                                         baserel->lateral_relids);
+        requiredOuter = bms_del_member(requiredOuter, baserel->relid);
+        if (bms_is_empty(requiredOuter)) {
+            continue;
+        }
+
+        /* the key is unique, so each lookup returns at most one row */
+        double lookupRows = 1;
+        Cost startupCost = 0;
+        Cost runCost = 0;
+        EstimateAccessCost(KV_SCAN_POINT, lookupRows, &startupCost, &runCost);
+        AddQualAndTargetCost(baserel, lookupRows, lookupRows,
+                             &startupCost, &runCost);
+
+        add_path(baserel,
+                 (Path *) create_foreignscan_path(root,
+                                                  baserel,
+                                                  NULL,
+                                                  lookupRows,
+                                                  startupCost,
+                                                  startupCost + runCost,
+                                                  NIL,
+                                                  requiredOuter,
+                                                  NULL,
+                                                  list_make1(makeInteger(KV_SCAN_POINT))));
+    }
+}
+
+/*
+ * Checks if the expression takes a prefix of the key, i.e. it is left(key, n)
+ * or substr(key, 1, n), and returns the prefix length n in characters.
+ * Returns 0 for any other expression.
+ */
+static int SkipScanPrefixLength(Node *node, Index relid) {
+    if (!node || !IsA(node, FuncExpr)) {
+        return 0;
+    }
+
+    FuncExpr *func = (FuncExpr *) node;
+    Node *lengthArg = NULL;
+    if (func->funcid == F_TEXT_LEFT && list_length(func->args) == 2) {
+        lengthArg = lsecond(func->args);
+    } else if (func->funcid == F_TEXT_SUBSTR && list_length(func->args) == 3) {
+        Node *startArg = lsecond(func->args);
+        if (!IsA(startArg, Const) || ((Const *) startArg)->constisnull ||
+            DatumGetInt32(((Const *) startArg)->constvalue) != 1) {
+            return 0;
+        }
+        lengthArg = lthird(func->args);
+    } else {
+        return 0;
+    }
+
+    if (!IsKeyVar(linitial(func->args), relid)) {
+        return 0;
+    }
+
+    if (!IsA(lengthArg, Const) || ((Const *) lengthArg)->constisnull) {
+        return 0;
+    }
+
+    return Max(DatumGetInt32(((Const *) lengthArg)->constvalue), 0);
+}
+
+/*
+ * Checks if the expression is a plain count(*), which is answered from the
+ * row count the table keeps.
+ */
+static bool IsCountStar(Node *node) {
+    if (!node || !IsA(node, Aggref)) {
+        return false;
+    }
+
+    Aggref *aggref = (Aggref *) node;
+    if (!aggref->aggstar || aggref->aggfilter || aggref->aggdistinct ||
+        aggref->aggorder || aggref->agglevelsup != 0 ||
+        aggref->aggkind != AGGKIND_NORMAL ||
+        aggref->aggsplit != AGGSPLIT_SIMPLE) {
+        return false;
+    }
+
+    char *functionName = get_func_name(aggref->aggfnoid);
+    return get_func_namespace(aggref->aggfnoid) == PG_CATALOG_NAMESPACE &&
+           functionName && strncmp(functionName, "count", NAMEDATALEN) == 0;
+}
+
+static void GetForeignUpperPaths(PlannerInfo *root,
+                                 UpperRelationKind stage,
+                                 RelOptInfo *inputRel,
+                                 RelOptInfo *outputRel,
+                                 void *extra) {
+    /*
+     * Create possible access paths for an upper relation, i.e. a step of
+     * post-scan/join processing such as grouping or duplicate removal. This
+     * is called with the foreign relation that feeds the step as input_rel.
+     * Paths must be added to output_rel with add_path.
+     */
+
+    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+
+    if (stage != UPPERREL_GROUP_AGG && stage != UPPERREL_DISTINCT) {
+        return;
+    }
+
+    /*
+     * Skip scans and counts read a single table, and every prefix or row of
+     * it must be returned or counted.
+     */
+    if (inputRel->reloptkind != RELOPT_BASEREL ||
+        inputRel->baserestrictinfo != NIL ||
+        outputRel->fdw_private != NULL) {
+        return;
+    }
+
+    /*
+     * PostgreSQL 11 doesn't set the target of the DISTINCT step. Its input is
+     * the target the window step sorts on, which is also the one it outputs.
+     */
+    Query *parse = root->parse;
+    PathTarget *target = stage == UPPERREL_DISTINCT?
+                         root->upper_targets[UPPERREL_WINDOW]:
+                         root->upper_targets[stage];
+    if (target == NULL || list_length(target->exprs) != 1) {
+        return;
+    }
+
+    if (stage == UPPERREL_GROUP_AGG && parse->hasAggs) {
+        if (parse->havingQual || parse->groupingSets ||
+            parse->groupClause != NIL ||
+            !IsCountStar(linitial(target->exprs))) {
+            return;
+        }
+
+        /* the kept count includes expired rows not yet compacted away */
+        TablePlanState *planState = (TablePlanState *) inputRel->fdw_private;
+        if (planState->expiresRows) {
+            return;
+        }
+
+        Cost startupCost = 0;
+        Cost runCost = 0;
+        EstimateAccessCost(KV_SCAN_COUNT, 1, &startupCost, &runCost);
+
+        /* the plan state of the input relation identifies the table */
+        outputRel->fdw_private = inputRel->fdw_private;
+
+        add_path(outputRel,
+                 (Path *) create_foreignscan_path(root,
+                                                  outputRel,
+                                                  target,
+                                                  1,
+                                                  startupCost,
+                                                  startupCost + runCost,
+                                                  NIL,
+                                                  NULL,
+                                                  NULL,
+                                                  list_make1(makeInteger(KV_SCAN_COUNT))));
+        return;
+    }
+
+    if (stage == UPPERREL_GROUP_AGG) {
+        if (parse->havingQual || parse->groupingSets ||
+            list_length(parse->groupClause) != 1) {
+            return;
+        }
+    } else if (parse->hasDistinctOn || list_length(parse->distinctClause) != 1) {
+        return;
+    }
+
+    /* prefixes of text keys are prefixes of their stored bytes */
+    Oid foreignTableId = planner_rt_fetch(inputRel->relid, root)->relid;
+    Oid keyTypeId = get_atttype(foreignTableId, 1);
+    if (keyTypeId != TEXTOID && keyTypeId != VARCHAROID) {
+        return;
+    }
+
+    int prefixLength = SkipScanPrefixLength(linitial(target->exprs),
+                                            inputRel->relid);
+    if (prefixLength <= 0) {
+        return;
+    }
+
+    double groupCount = estimate_num_groups(root, target->exprs,
+                                            inputRel->rows, NULL);
+    Cost startupCost = 0;
+    Cost runCost = 0;
+    EstimateAccessCost(KV_SCAN_SKIP, groupCount, &startupCost, &runCost);
+
+    /* the plan state of the input relation identifies the table */
+    outputRel->fdw_private = inputRel->fdw_private;
+
+    add_path(outputRel,
+             (Path *) create_foreignscan_path(root,
+                                              outputRel,
+                                              target,
+                                              groupCount,
+                                              startupCost,
+                                              startupCost + runCost,
+                                              NIL,
+                                              NULL,
+                                              NULL,
+                                              list_make2(makeInteger(KV_SCAN_SKIP),
+                                                         makeInteger(prefixLength))));
+}
+
+/*
+ * Adds a value compared with the key to the expressions the executor
+ * evaluates, and returns its index in fdw_exprs.
+ */
+static int AddScanExpr(KVScanQuals *scanQuals, Node *valueNode) {
+    scanQuals->exprs = lappend(scanQuals->exprs, valueNode);
+    return list_length(scanQuals->exprs) - 1;
+}
+
+/*
+ * Splits the scan clauses into the key quals the access method enforces and
+ * the quals left for the executor, and prepares the keys and bounds of the
+ * access method. Constant keys are serialized here, so that executing a
+ * cached plan doesn't classify the quals or serialize the keys again.
+ */
+static void PlanKeyQuals(RelOptInfo *baserel,
+                         Oid foreignTableId,
+                         KVAccessMethod method,
+                         List *scanClauses,
+                         KVScanQuals *scanQuals) {
+    memset(scanQuals, 0, sizeof(KVScanQuals));
+    scanQuals->keyExpr = -1;
+    scanQuals->lowerKey = MakeKeyConst(NULL);
+    scanQuals->lowerExpr = -1;
+    scanQuals->lowerInclusive = true;
+    scanQuals->upperKey = MakeKeyConst(NULL);
+    scanQuals->upperExpr = -1;
+    scanQuals->upperInclusive = true;
+
+    if (method != KV_SCAN_POINT && method != KV_SCAN_MULTIGET &&
+        method != KV_SCAN_RANGE) {
+        scanQuals->localClauses = scanClauses;
+        return;
+    }
+
+    Relation relation = heap_open(foreignTableId, NoLock);
+    TupleDesc tupleDescriptor = RelationGetDescr(relation);
+    Oid keyTypeId = TupleDescAttr(tupleDescriptor, 0)->atttypid;
+
+    bool hasLower = false;
+    bool hasUpper = false;
+
+    ListCell *lc;
+    foreach (lc, scanClauses) {
+        RestrictInfo *restrictInfo = lfirst_node(RestrictInfo, lc);
+
+        Node *valueNode = NULL;
+        bool inclusive = false;
+        KVQualKind kind = KV_QUAL_NONE;
+        if (!restrictInfo->pseudoconstant) {
+            kind = ClassifyKeyQual((Node *) restrictInfo->clause,
+                                   baserel->relid,
+                                   keyTypeId,
+                                   &valueNode,
+                                   &inclusive);
+        }
+
+        bool isConst = valueNode && IsA(valueNode, Const);
+        bool isNullConst = isConst && ((Const *) valueNode)->constisnull;
+
+        bool used = false;
+        if (((kind == KV_QUAL_EQUAL && method == KV_SCAN_POINT) ||
+             (kind == KV_QUAL_ANY && method == KV_SCAN_MULTIGET)) &&
+            !scanQuals->hasKey) {
+            if (isConst) {
+                Const *valueConst = (Const *) valueNode;
+                uint32 keyCount = 0;
+                StringInfo *keys = SerializeLookupKeys(tupleDescriptor,
+                                                       valueConst->constvalue,
+                                                       valueConst->consttype,
+                                                       valueConst->constisnull,
+                                                       kind == KV_QUAL_ANY,
+                                                       &keyCount);
+                for (uint32 index = 0; index < keyCount; index++) {
+                    scanQuals->keys = lappend(scanQuals->keys,
+                                              MakeKeyConst(keys[index]));
+                }
+            } else {
+                scanQuals->keyExpr = AddScanExpr(scanQuals, valueNode);
+            }
+            scanQuals->hasKey = true;
+            used = true;
+        } else if (kind == KV_QUAL_LOWER && method == KV_SCAN_RANGE &&
+                   !hasLower && !isNullConst) {
+            if (isConst) {
+                StringInfo lowerKey =
+                    SerializeLookupKey(tupleDescriptor,
+                                       ((Const *) valueNode)->constvalue,
+                                       ((Const *) valueNode)->consttype);
+                if (!inclusive) {
+                    /* the smallest key greater than the bound */
+                    appendStringInfoChar(lowerKey, '\0');
+                }
+                scanQuals->lowerKey = MakeKeyConst(lowerKey);
+            } else {
+                scanQuals->lowerExpr = AddScanExpr(scanQuals, valueNode);
+                scanQuals->lowerInclusive = inclusive;
+            }
+            hasLower = true;
+            used = true;
+        } else if (kind == KV_QUAL_UPPER && method == KV_SCAN_RANGE &&
+                   !hasUpper && !isNullConst) {
+            if (isConst) {
+                StringInfo upperKey =
+                    SerializeLookupKey(tupleDescriptor,
+                                       ((Const *) valueNode)->constvalue,
+                                       ((Const *) valueNode)->consttype);
+                scanQuals->upperKey = MakeKeyConst(upperKey);
+            } else {
+                scanQuals->upperExpr = AddScanExpr(scanQuals, valueNode);
+            }
+            scanQuals->upperInclusive = inclusive;
+            hasUpper = true;
+            used = true;
+        }
+
+        if (used) {
+            scanQuals->keyClauses = lappend(scanQuals->keyClauses, restrictInfo);
+        } else {
+            scanQuals->localClauses = lappend(scanQuals->localClauses,
+                                              restrictInfo);
+        }
+    }
+
+    heap_close(relation, NoLock);
+}
+
+static ForeignScan *GetForeignPlan(PlannerInfo *root,
+                                   RelOptInfo *baserel,
+                                   Oid foreignTableId,
+                                   ForeignPath *bestPath,
+                                   List *targetList,
+                                   List *scanClauses,
+                                   Plan *outerPlan) {
+    /*
+     * Create a ForeignScan plan node from the selected foreign access path.
+     * This is called at the end of query planning. The parameters are as for
+     * GetForeignRelSize, plus the selected ForeignPath (previously produced
+     * by GetForeignPaths), the target list to be emitted by the plan node,
+     * and the restriction clauses to be enforced by the plan node.
+     *
+     * This function must create and return a ForeignScan plan node; it's
+     * recommended to use make_foreignscan to build the ForeignScan node.
+     *
+     */
+
+    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+
+    /*
+     * Skip scans and counts compute an upper relation themselves, so they
+     * scan no base relation and describe their output by fdw_scan_tlist.
+     */
+    Index scanRelid = baserel->relid;
+    List *fdwScanTlist = NIL;
+    if (baserel->reloptkind == RELOPT_UPPER_REL) {
+        scanRelid = 0;
+        fdwScanTlist = targetList;
+    }
+
+    KVAccessMethod method = intVal(linitial(bestPath->fdw_private));
+    int prefixLength = 0;
+    if (method == KV_SCAN_SKIP) {
+        prefixLength = intVal(lsecond(bestPath->fdw_private));
+    }
+
+    /*
+     * Classify the scan clauses once, and find the ones the chosen access
+     * method enforces. Those are not checked again by the executor, and the
+     * others stay in the plan node's qual list.
+     */
+    KVScanQuals scanQuals;
+    PlanKeyQuals(baserel, foreignTableId, method, scanClauses, &scanQuals);
+
+    if ((method == KV_SCAN_POINT || method == KV_SCAN_MULTIGET) &&
+        !scanQuals.hasKey) {
+        /* shouldn't happen, as the path was built from these quals */
+        method = KV_SCAN_FULL;
+    }
+
+    /*
+     * Strip RestrictInfo nodes from the clauses and ignore pseudoconstants
+     * (which will be handled elsewhere).
+     */
+    List *localClauses = extract_actual_clauses(scanQuals.localClauses, false);
+    List *keyClauses = extract_actual_clauses(scanQuals.keyClauses, false);
+
+    /*
+     * Build the fdw_private list that will be available to the executor.
+     */
+    TablePlanState *planState = (TablePlanState *) baserel->fdw_private;
+    List *fdwPrivate = list_make3(makeInteger(planState->relationId),
+                                  makeInteger(method),
+                                  makeInteger(prefixLength));
+    fdwPrivate = lappend(fdwPrivate, scanQuals.keys);
+    fdwPrivate = lappend(fdwPrivate, makeInteger(scanQuals.keyExpr));
+    fdwPrivate = lappend(fdwPrivate, scanQuals.lowerKey);
+    fdwPrivate = lappend(fdwPrivate, makeInteger(scanQuals.lowerExpr));
+    fdwPrivate = lappend(fdwPrivate, makeInteger(scanQuals.lowerInclusive));
+    fdwPrivate = lappend(fdwPrivate, scanQuals.upperKey);
+    fdwPrivate = lappend(fdwPrivate, makeInteger(scanQuals.upperExpr));
+    fdwPrivate = lappend(fdwPrivate, makeInteger(scanQuals.upperInclusive));
+
+    /* Create the ForeignScan node */
+    return make_foreignscan(targetList,
+                            localClauses,
+                            scanRelid,
+                            scanQuals.exprs,
+                            fdwPrivate,
+                            fdwScanTlist,
+                            keyClauses, /* rechecked for EvalPlanQual */
+                            NULL);
+}
+
+/* Restarts a key based scan at its first key. */
+static void RewindLookupKeys(TableReadState *readState) {
+    readState->nextKey = 0;
+    readState->batchStart = 0;
+    readState->batchCount = 0;
+    readState->batchIndex = 0;
+}
+
+/* Evaluates the lookup keys of a key based scan. */
+static void BuildLookupKeys(ForeignScanState *scanState,
+                            TableReadState *readState) {
+    MemoryContextReset(readState->lookupContext);
+    MemoryContext oldContext = MemoryContextSwitchTo(readState->lookupContext);
+
+    ExprContext *exprContext = scanState->ss.ps.ps_ExprContext;
+    TupleDesc tupleDescriptor = scanState->ss.ss_currentRelation->rd_att;
+
+    bool isNull = false;
+    Datum value = ExecEvalExpr(readState->keyExprState, exprContext, &isNull);
+
+    Oid valueTypeId = ExprStateType(readState->keyExprState);
+    readState->keys = SerializeLookupKeys(tupleDescriptor, value, valueTypeId,
+                                          isNull, readState->keyIsArray,
+                                          &readState->keyCount);
+
+    RewindLookupKeys(readState);
+    readState->keysReady = true;
+
+    MemoryContextSwitchTo(oldContext);
+}
+
+/*
+ * Resolves the next batch of lookup keys, using a single Get for one key and
+ * a MultiGet for more keys.
+ */
+static void FetchKeyBatch(TableReadState *readState) {
+    MemoryContextReset(readState->batchContext);
+    MemoryContext oldContext = MemoryContextSwitchTo(readState->batchContext);
+
+    uint32 count = Min(KV_MULTIGET_BATCH_SIZE,
+                       readState->keyCount - readState->nextKey);
+    StringInfo *keys = readState->keys + readState->nextKey;
+
+    readState->batchValues = palloc0(count * sizeof(char *));
+    readState->batchValLens = palloc0(count * sizeof(uint32));
+    readState->batchFound = palloc0(count * sizeof(bool));
+
+    instr_time start;
+    KVTraceStart(readState->trace, KV_PHASE_GET, &start);
+
+    if (count == 1) {
+        readState->batchFound[0] = Get(readState->db,
+                                       keys[0]->data,
+                                       keys[0]->len,
+                                       &readState->batchValues[0],
+                                       &readState->batchValLens[0]);
+    } else {
+        char **keyData = palloc0(count * sizeof(char *));
+        uint32 *keyLens = palloc0(count * sizeof(uint32));
+        for (uint32 index = 0; index < count; index++) {
+            keyData[index] = keys[index]->data;
+            keyLens[index] = keys[index]->len;
+        }
+
+        MultiGet(readState->db, count, keyData, keyLens,
+                 readState->batchValues, readState->batchValLens,
+                 readState->batchFound);
+    }
+
+    KVTraceDone(readState->trace, KV_PHASE_GET, &start);
+
+    readState->batchStart = readState->nextKey;
+    readState->batchCount = count;
+    readState->batchIndex = 0;
+    readState->nextKey += count;
+
+    MemoryContextSwitchTo(oldContext);
+}
+
+/* Returns the next row found by a key based scan. */
+static bool NextLookupRow(ForeignScanState *scanState,
+                          TableReadState *readState,
+                          char **key, uint32 *keyLen,
+                          char **value, uint32 *valLen) {
+    if (!readState->keysReady) {
+        BuildLookupKeys(scanState, readState);
+    }
+
+    for (;;) {
+        if (readState->batchIndex == readState->batchCount) {
+            if (readState->nextKey == readState->keyCount) {
+                return false;
+            }
+            FetchKeyBatch(readState);
+        }
+
+        uint32 index = readState->batchIndex++;
+        if (readState->batchFound[index]) {
+            readState->rowsFetched++;
+            StringInfo lookupKey = readState->keys[readState->batchStart + index];
+            *key = lookupKey->data;
+            *keyLen = lookupKey->len;
+            *value = readState->batchValues[index];
+            *valLen = readState->batchValLens[index];
+            return true;
+        }
+    }
+}
+
+/* Returns the state of the fdw_exprs entry with the given index, if any. */
+static ExprState *GetScanExprState(List *exprStates, int index) {
+    if (index < 0) {
+        return NULL;
+    }
+
+    return (ExprState *) list_nth(exprStates, index);
+}
+
+/*
+ * Starts collecting the engine counters of a node when the query runs under
+ * EXPLAIN (ANALYZE, BUFFERS). Returns the counters to accumulate into, or NULL
+ * if the query is not instrumented.
+ */
+static KVPerfCounters *BeginPerfCounters(EState *executorState) {
+    int instrument = executorState->es_instrument;
+    if (!(instrument & INSTRUMENT_BUFFERS)) {
+        return NULL;
+    }
+
+    EnablePerfCounters((instrument & INSTRUMENT_TIMER) != 0);
+    return palloc0(sizeof(KVPerfCounters));
+}
+
+static void BeginForeignScan(ForeignScanState *scanState, int executorFlags) {
+    /*
+     * Begin executing a foreign scan. This is called during executor startup.
+     * It should perform any initialization needed before the scan can start,
+     * but not start executing the actual scan (that should be done upon the
+     * first call to IterateForeignScan). The ForeignScanState node has
+     * already been created, but its fdw_state field is still NULL.
+     * Information about the table to scan is accessible through the
+     * ForeignScanState node (in particular, from the underlying ForeignScan
+     * plan node, which contains any FDW-private information provided by
+     * GetForeignPlan). eflags contains flag bits describing the executor's
+     * operating mode for this plan node.
+     *
+     * Note that when (eflags & EXEC_FLAG_EXPLAIN_ONLY) is true, this function
+     * should not perform any externally-visible actions; it should only do
+     * the minimum required to make the node state valid for
+     * ExplainForeignScan and EndForeignScan.
+     *
+     */
+
+    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+
+    TableReadState *readState = palloc0(sizeof(TableReadState));
+
+    ForeignScan *foreignScan = (ForeignScan *) scanState->ss.ps.plan;
+    List *fdwPrivate = foreignScan->fdw_private;
+    readState->relationId =
+        intVal(list_nth(fdwPrivate, KVScanPrivateRelationId));
+
+    readState->method = intVal(list_nth(fdwPrivate, KVScanPrivateMethod));
+
+    readState->iter = NULL;
+    readState->isKeyBased = false;
+    readState->keysReady = false;
+    readState->scanDone = false;
+    readState->rangeReady = false;
+    readState->skipPrefixLength =
+        intVal(list_nth(fdwPrivate, KVScanPrivatePrefixLength));
+
+    scanState->fdw_state = (void *) readState;
+
+    /* the database is only opened for execution */
+    if (executorFlags & EXEC_FLAG_EXPLAIN_ONLY) {
+        return;
+    }
+
+    readState->trace = KVTraceBegin();
+
+    instr_time start;
+    KVTraceStart(readState->trace, KV_PHASE_OPEN, &start);
+    readState->db = KVAcquireDB(readState->relationId);
+    KVTraceDone(readState->trace, KV_PHASE_OPEN, &start);
+
+    readState->perfCounters = BeginPerfCounters(scanState->ss.ps.state);
+
+    List *exprStates = ExecInitExprList(foreignScan->fdw_exprs,
+                                        &scanState->ss.ps);
+
+    MemoryContext queryContext = scanState->ss.ps.state->es_query_cxt;
+    readState->lookupContext = AllocSetContextCreate(queryContext,
+                                                     "kv_fdw lookup keys",
+                                                     ALLOCSET_DEFAULT_SIZES);
+
+    KVAccessMethod method = readState->method;
+    if (method == KV_SCAN_POINT || method == KV_SCAN_MULTIGET) {
+        readState->isKeyBased = true;
+        readState->keyIsArray = method == KV_SCAN_MULTIGET;
+        int keyExpr = intVal(list_nth(fdwPrivate, KVScanPrivateKeyExpr));
+        readState->keyExprState = GetScanExprState(exprStates, keyExpr);
+
+        if (!readState->keyExprState) {
+            List *keyList = (List *) list_nth(fdwPrivate, KVScanPrivateKeys);
+            readState->keys = palloc0(list_length(keyList) * sizeof(StringInfo));
+            readState->keyCount = 0;
+
+            ListCell *lc;
+            foreach (lc, keyList) {
+                readState->keys[readState->keyCount++] =
+                    KeyFromConst((Const *) lfirst(lc));
+            }
+            readState->keysReady = true;
+        }
+
+        readState->batchContext = AllocSetContextCreate(queryContext,
+                                                        "kv_fdw lookup batch",
+                                                        ALLOCSET_DEFAULT_SIZES);
+    } else if (method != KV_SCAN_COUNT) {
+        if (method == KV_SCAN_RANGE) {
+            int lowerExpr = intVal(list_nth(fdwPrivate, KVScanPrivateLowerExpr));
+            int upperExpr = intVal(list_nth(fdwPrivate, KVScanPrivateUpperExpr));
+
+            readState->lowerKey =
+                KeyFromConst(list_nth(fdwPrivate, KVScanPrivateLowerKey));
+            readState->lowerExprState = GetScanExprState(exprStates, lowerExpr);
+            readState->lowerInclusive =
+                intVal(list_nth(fdwPrivate, KVScanPrivateLowerInclusive));
+
+            readState->upperKey =
+                KeyFromConst(list_nth(fdwPrivate, KVScanPrivateUpperKey));
+            readState->upperExprState = GetScanExprState(exprStates, upperExpr);
+            readState->upperInclusive =
+                intVal(list_nth(fdwPrivate, KVScanPrivateUpperInclusive));
+        }
+
+        KVTraceStart(readState->trace, KV_PHASE_SEEK, &start);
+        readState->iter = GetIter(readState->db);
+        KVTraceDone(readState->trace, KV_PHASE_SEEK, &start);
+    }
+}
+
+/* Decodes a stored row into the values and nulls of the table's columns. */
+static void DeserializeRow(StringInfo key,
+                           StringInfo value,
+                           TupleDesc tupleDescriptor,
+                           Datum *values,
+                           bool *nulls) {
+    uint32 count = tupleDescriptor->natts;
+
+    /* initialize all values for this row to null */
+    memset(values, 0, count * sizeof(Datum));
+    memset(nulls, false, count * sizeof(bool));
+
+    uint32 bufLen = (count - 1 + 7) / 8;
+
+    StringInfo buffer = makeStringInfo();
+    enlargeStringInfo(buffer, bufLen);
+    buffer->len = bufLen;
+
+    memcpy(buffer->data, value->data, bufLen);
+
+    for (uint32 index = 1; index < count; index++) {
+
+        uint32 byteIndex = (index - 1) / 8;
+        uint32 bitIndex = (index - 1) % 8;
+        uint8 bitmask = (1 << bitIndex);
+        nulls[index] = (buffer->data[byteIndex] & bitmask)? false: true;
+    }
+
+    values[0] = DeserializeKey(tupleDescriptor, key);
+
+    uint32 offset = bufLen;
+    char *current = value->data + offset;
+    for (uint32 index = 1; index < count; index++) {
+
+        if (nulls[index]) {
+            continue;
+        }
+
+        Form_pg_attribute attributeForm = TupleDescAttr(tupleDescriptor, index);
+        bool byValue = attributeForm->attbyval;
+        int typeLength = attributeForm->attlen;
+
+        values[index] = fetch_att(current, byValue, typeLength);
+        offset = att_addlength_datum(offset, typeLength, current);
+        current = value->data + offset;
+    }
+}
+
+static void DeserializeTuple(StringInfo key,
+                             StringInfo value,
+                             TupleTableSlot *tupleSlot) {
+    DeserializeRow(key, value, tupleSlot->tts_tupleDescriptor,
+                   tupleSlot->tts_values, tupleSlot->tts_isnull);
+}
+
+/*
+ * Computes the smallest key that is greater than every key starting with the
+ * given prefix. Returns false if there is no such key.
+ */
+static bool PrefixSuccessor(const char *prefix, uint32 prefixLen,
+                            StringInfo successor) {
+    while (prefixLen > 0 && (uint8) prefix[prefixLen - 1] == 0xFF) {
+        prefixLen--;
+    }
+
+    if (prefixLen == 0) {
+        return false;
+    }
+
+    resetStringInfo(successor);
+    appendBinaryStringInfo(successor, prefix, prefixLen);
+    successor->data[prefixLen - 1]++;
+
+    return true;
+}
+
+/*
+ * Positions the iterator of a range scan at its lower bound and evaluates
+ * the bounds that aren't constant. A null bound matches no rows.
+ */
+static void StartRangeScan(ForeignScanState *scanState,
+                           TableReadState *readState) {
+    MemoryContextReset(readState->lookupContext);
+    MemoryContext oldContext = MemoryContextSwitchTo(readState->lookupContext);
+
+    ExprContext *exprContext = scanState->ss.ps.ps_ExprContext;
+    TupleDesc tupleDescriptor = scanState->ss.ss_currentRelation->rd_att;
+
+    if (readState->upperExprState) {
+        bool isNull = false;
+        Datum value = ExecEvalExpr(readState->upperExprState, exprContext,
+                                   &isNull);
+        readState->upperKey = NULL;
+        if (isNull) {
+            readState->scanDone = true;
+        } else {
+            readState->upperKey =
+                SerializeLookupKey(tupleDescriptor, value,
+                                   ExprStateType(readState->upperExprState));
+        }
+    }
+
+    StringInfo lowerKey = readState->lowerKey;
+    if (readState->lowerExprState && !readState->scanDone) {
+        bool isNull = false;
+        Datum value = ExecEvalExpr(readState->lowerExprState, exprContext,
+                                   &isNull);
+        if (isNull) {
+            readState->scanDone = true;
+        } else {
+            Oid valueTypeId = ExprStateType(readState->lowerExprState);
+            lowerKey = SerializeLookupKey(tupleDescriptor, value, valueTypeId);
+            if (!readState->lowerInclusive) {
+                /* the smallest key greater than the bound */
+                appendStringInfoChar(lowerKey, '\0');
+            }
+        }
+    }
+
+    if (lowerKey && !readState->scanDone) {
+        instr_time start;
+        KVTraceStart(readState->trace, KV_PHASE_SEEK, &start);
+        SeekIter(readState->iter, lowerKey->data, lowerKey->len);
+        KVTraceDone(readState->trace, KV_PHASE_SEEK, &start);
+    }
+
+    readState->rangeReady = true;
+
+    MemoryContextSwitchTo(oldContext);
+}
+
+/*
+ * Returns the next row of an iterator scan, stopping at the upper bound of a
+ * range scan.
+ */
+static bool NextRangeRow(ForeignScanState *scanState,
+                         TableReadState *readState,
+                         char **key, uint32 *keyLen,
+                         char **value, uint32 *valLen) {
+    if (!readState->rangeReady) {
+        StartRangeScan(scanState, readState);
+    }
+
+    if (readState->scanDone) {
+        return false;
+    }
+
+    instr_time start;
+    KVTraceStart(readState->trace, KV_PHASE_NEXT, &start);
+    bool found = Next(readState->db, readState->iter, key, keyLen, value, valLen);
+    KVTraceDone(readState->trace, KV_PHASE_NEXT, &start);
+    if (!found) {
+        return false;
+    }
+    readState->rowsFetched++;
+
+    StringInfo upperKey = readState->upperKey;
+    if (upperKey) {
+        int result = CompareKeyBytes(*key, *keyLen, upperKey->data, upperKey->len);
+        if (result > 0 || (result == 0 && !readState->upperInclusive)) {
+            readState->scanDone = true;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Returns the next distinct key prefix of a skip scan, and seeks past the
+ * keys that share it.
+ */
+static bool NextSkipScanRow(TableReadState *readState,
+                            TupleTableSlot *tupleSlot) {
+    if (readState->scanDone) {
+        return false;
+    }
+
+    char *k = NULL, *v = NULL;
+    uint32 kLen = 0, vLen = 0;
+
+    instr_time start;
+    KVTraceStart(readState->trace, KV_PHASE_NEXT, &start);
+    bool found = Next(readState->db, readState->iter, &k, &kLen, &v, &vLen);
+    KVTraceDone(readState->trace, KV_PHASE_NEXT, &start);
+    if (!found) {
+        return false;
+    }
+    readState->rowsFetched++;
+
+    int prefixLen = pg_mbcharcliplen(k, kLen, readState->skipPrefixLength);
+
+    tupleSlot->tts_values[0] =
+        PointerGetDatum(cstring_to_text_with_len(k, prefixLen));
+    tupleSlot->tts_isnull[0] = false;
+
+    /*
+     * A key shorter than the prefix is its own prefix, which the longer keys
+     * starting with it don't share, so only the key itself is skipped.
+     */
+    StringInfo successor = makeStringInfo();
+    if (prefixLen == kLen &&
+        pg_mbstrlen_with_len(k, kLen) < readState->skipPrefixLength) {
+        appendBinaryStringInfo(successor, k, kLen);
+        appendStringInfoChar(successor, '\0');
+        KVTraceStart(readState->trace, KV_PHASE_SEEK, &start);
+        SeekIter(readState->iter, successor->data, successor->len);
+        KVTraceDone(readState->trace, KV_PHASE_SEEK, &start);
+    } else if (PrefixSuccessor(k, prefixLen, successor)) {
+        KVTraceStart(readState->trace, KV_PHASE_SEEK, &start);
+        SeekIter(readState->iter, successor->data, successor->len);
+        KVTraceDone(readState->trace, KV_PHASE_SEEK, &start);
+    } else {
+        readState->scanDone = true;
+    }
+
+    return true;
+}
+
+/*
+ * Reads the next row with the access method of the scan into the slot, and
+ * leaves the slot empty at the end of the scan.
+ */
+static void FetchNextRow(ForeignScanState *scanState,
+                         TableReadState *readState,
+                         TupleTableSlot *tupleSlot) {
+    if (readState->method == KV_SCAN_SKIP) {
+        if (NextSkipScanRow(readState, tupleSlot)) {
+            ExecStoreVirtualTuple(tupleSlot);
+        }
+        return;
+    }
+
+    if (readState->method == KV_SCAN_COUNT) {
+        if (!readState->scanDone) {
+            int64 rowCount = (int64) Count(readState->db);
+            tupleSlot->tts_values[0] = Int64GetDatum(rowCount);
+            tupleSlot->tts_isnull[0] = false;
+            ExecStoreVirtualTuple(tupleSlot);
+            readState->scanDone = true;
+        }
+        return;
+    }
+
+    char *k = NULL, *v = NULL;
+    uint32 kLen = 0, vLen = 0;
+
+    bool found = false;
+    if (readState->isKeyBased) {
+        found = NextLookupRow(scanState, readState, &k, &kLen, &v, &vLen);
+    } else {
+        found = NextRangeRow(scanState, readState, &k, &kLen, &v, &vLen);
+    }
+
+    if (found) {
+        StringInfo key = makeStringInfo();
+        appendBinaryStringInfo(key, k, kLen);
+        StringInfo value = makeStringInfo();
+        appendBinaryStringInfo(value, v, vLen);
+
+        instr_time start;
+        KVTraceStart(readState->trace, KV_PHASE_DESERIALIZE, &start);
+        DeserializeTuple(key, value, tupleSlot);
+        KVTraceDone(readState->trace, KV_PHASE_DESERIALIZE, &start);
+
+        ExecStoreVirtualTuple(tupleSlot);
+    }
+}
+
+static TupleTableSlot *IterateForeignScan(ForeignScanState *scanState) {
+    /*
+     * Fetch one row from the foreign source, returning it in a tuple table
      * slot (the node's ScanTupleSlot should be used for this purpose). Return
      * NULL if no more rows are available. The tuple table slot infrastructure
      * allows either a physical or virtual tuple to be returned; in most cases
@@ -409,551 +2010,2140 @@ static TupleTableSlot *IterateForeignScan(ForeignScanState *scanState) {
      * need longer-lived storage, or use the es_query_cxt of the node's
      * EState.
      *
-     * The rows returned must match the column signature of the foreign table
-     * being scanned. If you choose to optimize away fetching columns that are
-     * not needed, you should insert nulls in those column positions.
+     * The rows returned must match the column signature of the foreign table
+     * being scanned. If you choose to optimize away fetching columns that are
+     * not needed, you should insert nulls in those column positions.
+     *
+     * Note that PostgreSQL's executor doesn't care whether the rows returned
+     * violate any NOT NULL constraints that were defined on the foreign table
+     * columns — but the planner does care, and may optimize queries
+     * incorrectly if NULL values are present in a column declared not to
+     * contain them. If a NULL value is encountered when the user has declared
+     * that none should be present, it may be appropriate to raise an error
+     * (just as you would need to do in the case of a data type mismatch).
+     */
+
+    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+
+    TupleTableSlot *tupleSlot = scanState->ss.ss_ScanTupleSlot;
+    ExecClearTuple(tupleSlot);
+
+    TableReadState *readState = (TableReadState *) scanState->fdw_state;
+
+    KVPerfCounters perfStart;
+    if (readState->perfCounters) {
+        ReadPerfCounters(&perfStart);
+    }
+
+    FetchNextRow(scanState, readState, tupleSlot);
+
+    if (readState->perfCounters) {
+        AccumulatePerfCounters(readState->perfCounters, &perfStart);
+    }
+
+    return tupleSlot;
+}
+
+static void ReScanForeignScan(ForeignScanState *scanState) {
+    /*
+     * Restart the scan from the beginning. Note that any parameters the scan
+     * depends on may have changed value, so the new scan does not necessarily
+     * return exactly the same rows.
+     */
+
+    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+
+    TableReadState *readState = (TableReadState *) scanState->fdw_state;
+
+    if (readState->isKeyBased) {
+        if (readState->keyExprState) {
+            /* parameters may have changed, so evaluate the keys again */
+            readState->keysReady = false;
+        } else {
+            RewindLookupKeys(readState);
+        }
+    } else if (readState->iter) {
+        instr_time start;
+        KVTraceStart(readState->trace, KV_PHASE_SEEK, &start);
+        RewindIter(readState->iter);
+        KVTraceDone(readState->trace, KV_PHASE_SEEK, &start);
+        readState->scanDone = false;
+        readState->rangeReady = false;
+    } else {
+        readState->scanDone = false;
+    }
+}
+
+static void EndForeignScan(ForeignScanState *scanState) {
+    /*
+     * End the scan and release resources. It is normally not important to
+     * release palloc'd memory, but for example open files and connections to
+     * remote servers should be cleaned up.
+     */
+
+    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+
+    TableReadState *readState = (TableReadState *) scanState->fdw_state;
+
+    if (readState) {
+        if (readState->iter) {
+            DelIter(readState->iter);
+            readState->iter = NULL;
+        }
+
+        if (readState->perfCounters) {
+            DisablePerfCounters();
+        }
+
+        if (readState->trace) {
+            KVTraceReport(readState->trace, "scan", readState->relationId);
+        }
+
+        if (readState->db) {
+            KVReleaseDB(readState->relationId, false);
+            readState->db = NULL;
+        }
+    }
+}
+
+static void AddForeignUpdateTargets(Query *parsetree,
+                                    RangeTblEntry *tableEntry,
+                                    Relation targetRelation) {
+    /*
+     * UPDATE and DELETE operations are performed against rows previously
+     * fetched by the table-scanning functions. The FDW may need extra
+     * information, such as a row ID or the values of primary-key columns, to
+     * ensure that it can identify the exact row to update or delete. To
+     * support that, this function can add extra hidden, or "junk", target
+     * columns to the list of columns that are to be retrieved from the
+     * foreign table during an UPDATE or DELETE.
+     *
+     * To do that, add TargetEntry items to parsetree->targetList, containing
+     * expressions for the extra values to be fetched. Each such entry must be
+     * marked resjunk = true, and must have a distinct resname that will
+     * identify it at execution time. Avoid using names matching ctidN or
+     * wholerowN, as the core system can generate junk columns of these names.
+     *
+     * This function is called in the rewriter, not the planner, so the
+     * information available is a bit different from that available to the
+     * planning routines. parsetree is the parse tree for the UPDATE or DELETE
+     * command, while target_rte and target_relation describe the target
+     * foreign table.
+     *
+     * If the AddForeignUpdateTargets pointer is set to NULL, no extra target
+     * expressions are added. (This will make it impossible to implement
+     * DELETE operations, though UPDATE may still be feasible if the FDW
+     * relies on an unchanging primary key to identify rows.)
+     */
+
+    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+
+    Form_pg_attribute attr = &RelationGetDescr(targetRelation)->attrs[0];
+
+    /*
+     * Code adapted from redis_fdw
+     *
+     * In KV, we need the key name. It's the first column in the table
+     * regardless of the table type. Knowing the key, we can delete it.
+     */
+    Var *var = makeVar(parsetree->resultRelation,
+                       1,
+                       attr->atttypid,
+                       attr->atttypmod,
+                       InvalidOid,
+                       0);
+    /* Wrap it in a resjunk TLE with the right name ... */
+    const char *attrname = KVKEYJUNK;
+    AttrNumber resno = list_length(parsetree->targetList) + 1;
+    /* is this true? */
+    Assert(resno == 1);
+    TargetEntry *entry = makeTargetEntry((Expr *) var,
+                                         resno,
+                                         pstrdup(attrname),
+                                         true);
+    /* ... and add it to the query's targetlist */
+    parsetree->targetList = lappend(parsetree->targetList, entry);
+}
+
+static List *PlanForeignModify(PlannerInfo *plannerInfo,
+                               ModifyTable *plan,
+                               Index resultRelation,
+                               int subplanIndex) {
+    /*
+     * Perform any additional planning actions needed for an insert, update,
+     * or delete on a foreign table. This function generates the FDW-private
+     * information that will be attached to the ModifyTable plan node that
+     * performs the update action. This private information must have the form
+     * of a List, and will be delivered to BeginForeignModify during the
+     * execution stage.
+     *
+     * root is the planner's global information about the query. plan is the
+     * ModifyTable plan node, which is complete except for the fdwPrivLists
+     * field. resultRelation identifies the target foreign table by its
+     * rangetable index. subplan_index identifies which target of the
+     * ModifyTable plan node this is, counting from zero; use this if you want
+     * to index into plan->plans or other substructure of the plan node.
+     *
+     * If the PlanForeignModify pointer is set to NULL, no additional
+     * plan-time actions are taken, and the fdw_private list delivered to
+     * BeginForeignModify will be NIL.
+     */
+
+    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+
+    /* the database is opened by BeginForeignModify */
+    return NIL;
+}
+
+/*
+ * Opens the table for the rows a statement writes, which are collected in the
+ * batch of its database until the statement ends.
+ */
+static TableWriteState *BeginTableWrites(Relation relation,
+                                         CmdType operation,
+                                         EState *executorState) {
+    TableWriteState *writeState = palloc0(sizeof(TableWriteState));
+    writeState->operation = operation;
+
+    /* shares the handle of the scan feeding an UPDATE or DELETE */
+    writeState->relationId = RelationGetRelid(relation);
+    writeState->trace = KVTraceBegin();
+
+    instr_time start;
+    KVTraceStart(writeState->trace, KV_PHASE_OPEN, &start);
+    writeState->db = KVAcquireDB(writeState->relationId);
+    KVTraceDone(writeState->trace, KV_PHASE_OPEN, &start);
+    KVBeginWrites(writeState->relationId, writeState->db);
+
+    writeState->perfCounters = BeginPerfCounters(executorState);
+
+    return writeState;
+}
+
+static void BeginForeignModify(ModifyTableState *modifyTableState,
+                               ResultRelInfo *relationInfo,
+                               List *fdwPrivate,
+                               int subplanIndex,
+                               int executorFlags) {
+    /*
+     * Begin executing a foreign table modification operation. This routine is
+     * called during executor startup. It should perform any initialization
+     * needed prior to the actual table modifications. Subsequently,
+     * ExecForeignInsert, ExecForeignUpdate or ExecForeignDelete will be
+     * called for each tuple to be inserted, updated, or deleted.
+     *
+     * mtstate is the overall state of the ModifyTable plan node being
+     * executed; global data about the plan and execution state is available
+     * via this structure. rinfo is the ResultRelInfo struct describing the
+     * target foreign table. (The ri_FdwState field of ResultRelInfo is
+     * available for the FDW to store any private state it needs for this
+     * operation.) fdw_private contains the private data generated by
+     * PlanForeignModify, if any. subplan_index identifies which target of the
+     * ModifyTable plan node this is. eflags contains flag bits describing the
+     * executor's operating mode for this plan node.
+     *
+     * Note that when (eflags & EXEC_FLAG_EXPLAIN_ONLY) is true, this function
+     * should not perform any externally-visible actions; it should only do
+     * the minimum required to make the node state valid for
+     * ExplainForeignModify and EndForeignModify.
+     *
+     * If the BeginForeignModify pointer is set to NULL, no action is taken
+     * during executor startup.
+     */
+
+    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+
+    if (executorFlags & EXEC_FLAG_EXPLAIN_ONLY) {
+        return;
+    }
+
+    CmdType operation = modifyTableState->operation;
+    if (operation != CMD_INSERT && operation != CMD_UPDATE &&
+        operation != CMD_DELETE) {
+        ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                        errmsg("not insert, update & delete")));
+    }
+
+    TableWriteState *writeState =
+        BeginTableWrites(relationInfo->ri_RelationDesc, operation,
+                         modifyTableState->ps.state);
+
+    if (operation == CMD_DELETE) {
+        /* Find the ctid resjunk column in the subplan's result */
+        Plan *subplan = modifyTableState->mt_plans[subplanIndex]->plan;
+        writeState->keyJunkNo =
+                ExecFindJunkAttributeInTlist(subplan->targetlist, KVKEYJUNK);
+        if (!AttributeNumberIsValid(writeState->keyJunkNo)) {
+            ereport(ERROR, (errmsg("could not find key junk column")));
+        }
+    }
+
+    relationInfo->ri_FdwState = (void *) writeState;
+}
+
+static void SerializeTuple(StringInfo key,
+                           StringInfo value,
+                           TupleTableSlot *tupleSlot) {
+
+    TupleDesc tupleDescriptor = tupleSlot->tts_tupleDescriptor;
+    uint32 count = tupleDescriptor->natts;
+
+    uint32 nullsLen = (count - 1 + 7) / 8;
+
+    /*
+     * contrary to isnull array, store exists array
+     * to accommodate bug from storage engine
+     */
+    StringInfo nulls = makeStringInfo();
+    enlargeStringInfo(nulls, nullsLen);
+    nulls->len = nullsLen;
+    memset(nulls->data, 0xFF, nullsLen);
+
+    value->len += nullsLen;
+
+    for (uint32 index = 0; index < count; index++) {
+
+        if (tupleSlot->tts_isnull[index]) {
+            if (index == 0) {
+                ereport(ERROR, (errmsg("first column cannot be null!")));
+            }
+            uint32 byteIndex = (index - 1) / 8;
+            uint32 bitIndex = (index - 1) % 8;
+            uint8 bitmask = (1 << bitIndex);
+            nulls->data[byteIndex] &= ~bitmask;
+            continue;
+        }
+
+        Datum datum = tupleSlot->tts_values[index];
+        if (index == 0) {
+            SerializeKey(tupleDescriptor, datum, key);
+        } else {
+            SerializeAttribute(tupleDescriptor, index, datum, value);
+        }
+    }
+
+    memcpy(value->data, nulls->data, nullsLen);
+}
+
+static TupleTableSlot *ExecForeignInsert(EState *executorState,
+                                         ResultRelInfo *relationInfo,
+                                         TupleTableSlot *tupleSlot,
+                                         TupleTableSlot *planSlot) {
+    /*
+     * Insert one tuple into the foreign table. estate is global execution
+     * state for the query. rinfo is the ResultRelInfo struct describing the
+     * target foreign table. slot contains the tuple to be inserted; it will
+     * match the rowtype definition of the foreign table. planSlot contains
+     * the tuple that was generated by the ModifyTable plan node's subplan; it
+     * differs from slot in possibly containing additional "junk" columns.
+     * (The planSlot is typically of little interest for INSERT cases, but is
+     * provided for completeness.)
+     *
+     * The return value is either a slot containing the data that was actually
+     * inserted (this might differ from the data supplied, for example as a
+     * result of trigger actions), or NULL if no row was actually inserted
+     * (again, typically as a result of triggers). The passed-in slot can be
+     * re-used for this purpose.
+     *
+     * The data in the returned slot is used only if the INSERT query has a
+     * RETURNING clause. Hence, the FDW could choose to optimize away
+     * returning some or all columns depending on the contents of the
+     * RETURNING clause. However, some slot must be returned to indicate
+     * success, or the query's reported rowcount will be wrong.
+     *
+     * If the ExecForeignInsert pointer is set to NULL, attempts to insert
+     * into the foreign table will fail with an error message.
+     */
+
+    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+
+    TupleDesc tupleDescriptor = tupleSlot->tts_tupleDescriptor;
+    if (HeapTupleHasExternal(tupleSlot->tts_tuple)) {
+        /* detoast any toasted attributes */
+        tupleSlot->tts_tuple = toast_flatten_tuple(tupleSlot->tts_tuple,
+                                                   tupleDescriptor);
+    }
+
+    slot_getallattrs(tupleSlot);
+
+    StringInfo key = makeStringInfo();
+    StringInfo value = makeStringInfo();
+
+    SerializeTuple(key, value, tupleSlot);
+
+    TableWriteState *writeState = (TableWriteState *) relationInfo->ri_FdwState;
+
+    KVPerfCounters perfStart;
+    if (writeState->perfCounters) {
+        ReadPerfCounters(&perfStart);
+    }
+
+    instr_time start;
+    KVTraceStart(writeState->trace, KV_PHASE_WRITE, &start);
+    if (!Put(writeState->db, key->data, key->len, value->data, value->len)) {
+        ereport(ERROR, (errmsg("error from ExecForeignInsert")));
+    }
+    KVTraceDone(writeState->trace, KV_PHASE_WRITE, &start);
+    writeState->rowsWritten++;
+
+    if (writeState->perfCounters) {
+        AccumulatePerfCounters(writeState->perfCounters, &perfStart);
+    }
+
+    return tupleSlot;
+}
+
+static TupleTableSlot *ExecForeignUpdate(EState *executorState,
+                                         ResultRelInfo *relationInfo,
+                                         TupleTableSlot *tupleSlot,
+                                         TupleTableSlot *planSlot) {
+    /*
+     * Update one tuple in the foreign table. estate is global execution state
+     * for the query. rinfo is the ResultRelInfo struct describing the target
+     * foreign table. slot contains the new data for the tuple; it will match
+     * the rowtype definition of the foreign table. planSlot contains the
+     * tuple that was generated by the ModifyTable plan node's subplan; it
+     * differs from slot in possibly containing additional "junk" columns. In
+     * particular, any junk columns that were requested by
+     * AddForeignUpdateTargets will be available from this slot.
+     *
+     * The return value is either a slot containing the row as it was actually
+     * updated (this might differ from the data supplied, for example as a
+     * result of trigger actions), or NULL if no row was actually updated
+     * (again, typically as a result of triggers). The passed-in slot can be
+     * re-used for this purpose.
+     *
+     * The data in the returned slot is used only if the UPDATE query has a
+     * RETURNING clause. Hence, the FDW could choose to optimize away
+     * returning some or all columns depending on the contents of the
+     * RETURNING clause. However, some slot must be returned to indicate
+     * success, or the query's reported rowcount will be wrong.
+     *
+     * If the ExecForeignUpdate pointer is set to NULL, attempts to update the
+     * foreign table will fail with an error message.
+     *
+     */
+
+    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+
+    TupleDesc tupleDescriptor = tupleSlot->tts_tupleDescriptor;
+    if (HeapTupleHasExternal(tupleSlot->tts_tuple)) {
+        /* detoast any toasted attributes */
+        tupleSlot->tts_tuple = toast_flatten_tuple(tupleSlot->tts_tuple,
+                                                   tupleDescriptor);
+    }
+    slot_getallattrs(tupleSlot);
+
+    StringInfo key = makeStringInfo();
+    StringInfo value = makeStringInfo();
+
+    SerializeTuple(key, value, tupleSlot);
+
+    TableWriteState *writeState = (TableWriteState *) relationInfo->ri_FdwState;
+
+    KVPerfCounters perfStart;
+    if (writeState->perfCounters) {
+        ReadPerfCounters(&perfStart);
+    }
+
+    instr_time start;
+    KVTraceStart(writeState->trace, KV_PHASE_WRITE, &start);
+    if (!Put(writeState->db, key->data, key->len, value->data, value->len)) {
+        ereport(ERROR, (errmsg("error from ExecForeignUpdate")));
+    }
+    KVTraceDone(writeState->trace, KV_PHASE_WRITE, &start);
+    writeState->rowsWritten++;
+
+    if (writeState->perfCounters) {
+        AccumulatePerfCounters(writeState->perfCounters, &perfStart);
+    }
+
+    return tupleSlot;
+}
+
+static TupleTableSlot *ExecForeignDelete(EState *executorState,
+                                         ResultRelInfo *relationInfo,
+                                         TupleTableSlot *tupleSlot,
+                                         TupleTableSlot *planSlot) {
+    /*
+     * Delete one tuple from the foreign table. estate is global execution
+     * state for the query. rinfo is the ResultRelInfo struct describing the
+     * target foreign table. slot contains nothing useful upon call, but can
+     * be used to hold the returned tuple. planSlot contains the tuple that
+     * was generated by the ModifyTable plan node's subplan; in particular, it
+     * will carry any junk columns that were requested by
+     * AddForeignUpdateTargets. The junk column(s) must be used to identify
+     * the tuple to be deleted.
+     *
+     * The return value is either a slot containing the row that was deleted,
+     * or NULL if no row was deleted (typically as a result of triggers). The
+     * passed-in slot can be used to hold the tuple to be returned.
+     *
+     * The data in the returned slot is used only if the DELETE query has a
+     * RETURNING clause. Hence, the FDW could choose to optimize away
+     * returning some or all columns depending on the contents of the
+     * RETURNING clause. However, some slot must be returned to indicate
+     * success, or the query's reported rowcount will be wrong.
+     *
+     * If the ExecForeignDelete pointer is set to NULL, attempts to delete
+     * from the foreign table will fail with an error message.
+     */
+
+    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+
+    TableWriteState *writeState = (TableWriteState *) relationInfo->ri_FdwState;
+
+    bool isnull = true;
+    ExecGetJunkAttribute(planSlot, writeState->keyJunkNo, &isnull);
+    if (isnull) {
+        ereport(ERROR, (errmsg("can't get junk key value")));
+    }
+
+    slot_getallattrs(planSlot);
+
+    StringInfo key = makeStringInfo();
+    StringInfo value = makeStringInfo();
+
+    SerializeTuple(key, value, planSlot);
+
+    KVPerfCounters perfStart;
+    if (writeState->perfCounters) {
+        ReadPerfCounters(&perfStart);
+    }
+
+    instr_time start;
+    KVTraceStart(writeState->trace, KV_PHASE_WRITE, &start);
+    if (!Delete(writeState->db, key->data, key->len, NULL)) {
+        ereport(ERROR, (errmsg("error from ExecForeignDelete")));
+    }
+    KVTraceDone(writeState->trace, KV_PHASE_WRITE, &start);
+    writeState->rowsWritten++;
+
+    if (writeState->perfCounters) {
+        AccumulatePerfCounters(writeState->perfCounters, &perfStart);
+    }
+
+    return tupleSlot;
+}
+
+static void EndForeignModify(EState *executorState, ResultRelInfo *relationInfo) {
+    /*
+     * End the table update and release resources. It is normally not
+     * important to release palloc'd memory, but for example open files and
+     * connections to remote servers should be cleaned up.
+     *
+     * If the EndForeignModify pointer is set to NULL, no action is taken
+     * during executor shutdown.
+     */
+
+    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+
+    TableWriteState *writeState = (TableWriteState *) relationInfo->ri_FdwState;
+
+    if (writeState && writeState->perfCounters) {
+        DisablePerfCounters();
+    }
+
+    if (writeState && writeState->db) {
+        /* the writes of the statement go to the database in one batch */
+        instr_time start;
+        KVTraceStart(writeState->trace, KV_PHASE_WRITE, &start);
+        KVEndWrites(writeState->relationId, writeState->db);
+        KVTraceDone(writeState->trace, KV_PHASE_WRITE, &start);
+    }
+
+    if (writeState && writeState->trace) {
+        KVTraceReport(writeState->trace, "modify", writeState->relationId);
+    }
+
+    if (writeState && writeState->db) {
+        KVReleaseDB(writeState->relationId, true);
+        writeState->db = NULL;
+    }
+}
+
+static void BeginForeignInsert(ModifyTableState *modifyTableState,
+                               ResultRelInfo *relationInfo) {
+    /*
+     * Begin executing an insert operation on a foreign table. This routine is
+     * called right before the first tuple is inserted into the foreign table
+     * in both cases when it is the partition chosen for tuple routing and the
+     * target specified in a COPY FROM command. It should perform any
+     * initialization needed prior to the actual insertion. Subsequently,
+     * ExecForeignInsert will be called for each tuple to be inserted into
+     * the foreign table.
+     *
+     * If the BeginForeignInsert pointer is set to NULL, no action is taken
+     * for the initialization.
+     */
+
+    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+
+    /* the rows of a COPY go in one batch, like those of an INSERT */
+    relationInfo->ri_FdwState =
+        BeginTableWrites(relationInfo->ri_RelationDesc, CMD_INSERT,
+                         modifyTableState->ps.state);
+}
+
+static void EndForeignInsert(EState *executorState,
+                             ResultRelInfo *relationInfo) {
+    /*
+     * End the insert operation and release resources. It is normally not
+     * important to release palloc'd memory, but for example open files and
+     * connections to remote servers should be cleaned up.
      *
-     * Note that PostgreSQL's executor doesn't care whether the rows returned
-     * violate any NOT NULL constraints that were defined on the foreign table
-     * columns — but the planner does care, and may optimize queries
-     * incorrectly if NULL values are present in a column declared not to
-     * contain them. If a NULL value is encountered when the user has declared
-     * that none should be present, it may be appropriate to raise an error
-     * (just as you would need to do in the case of a data type mismatch).
+     * If the EndForeignInsert pointer is set to NULL, no action is taken for
+     * the termination.
+     */
+
+    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+
+    EndForeignModify(executorState, relationInfo);
+}
+
+/*
+ * Checks that an UPDATE only sets columns other than the key to values that
+ * don't depend on the row, and moves those values to the expressions the
+ * scan evaluates. The attributes and the indexes of their values are added
+ * to the private list of the scan.
+ */
+static bool PlanDirectUpdate(PlannerInfo *root,
+                             Index resultRelation,
+                             ForeignScan *foreignScan) {
+    RangeTblEntry *tableEntry = planner_rt_fetch(resultRelation, root);
+
+    List *updateAttrs = NIL;
+    List *updateExprs = NIL;
+    List *fdwExprs = foreignScan->fdw_exprs;
+
+    int column = -1;
+    while ((column = bms_next_member(tableEntry->updatedCols, column)) >= 0) {
+        AttrNumber attributeNumber = column + FirstLowInvalidHeapAttributeNumber;
+        if (attributeNumber <= 1) {
+            /* a new key moves the row, which takes a scan */
+            return false;
+        }
+
+        TargetEntry *targetEntry =
+            get_tle_by_resno(foreignScan->scan.plan.targetlist, attributeNumber);
+        if (!targetEntry) {
+            return false;
+        }
+
+        /* the values are evaluated once for all the keys */
+        Node *valueNode = (Node *) targetEntry->expr;
+        if (contain_var_clause(valueNode) ||
+            contain_volatile_functions(valueNode) ||
+            contain_subplans(valueNode)) {
+            return false;
+        }
+
+        updateAttrs = lappend_int(updateAttrs, attributeNumber);
+        fdwExprs = lappend(fdwExprs, copyObject(valueNode));
+        updateExprs = lappend_int(updateExprs, list_length(fdwExprs) - 1);
+    }
+
+    foreignScan->fdw_exprs = fdwExprs;
+    foreignScan->fdw_private = lappend(foreignScan->fdw_private, updateAttrs);
+    foreignScan->fdw_private = lappend(foreignScan->fdw_private, updateExprs);
+    return true;
+}
+
+static bool PlanDirectModify(PlannerInfo *root,
+                             ModifyTable *plan,
+                             Index resultRelation,
+                             int subplanIndex) {
+    /*
+     * Decide whether it is safe to execute a direct modification on the
+     * remote server. If so, return true after performing planning actions
+     * needed for that. Otherwise, return false. This optional function is
+     * called during query planning. If this function succeeds,
+     * BeginDirectModify, IterateDirectModify and EndDirectModify will be
+     * called at the execution stage, instead. Otherwise, the table
+     * modification will be executed using the table-updating functions
+     * described above. The parameters are the same as for PlanForeignModify.
+     */
+
+    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+
+    CmdType operation = plan->operation;
+    if ((operation != CMD_UPDATE && operation != CMD_DELETE) ||
+        plan->returningLists != NIL) {
+        return false;
+    }
+
+    /*
+     * The rows must come straight from a scan of the table whose access
+     * method enforces all of its quals, so that every row it finds is
+     * modified.
+     */
+    Plan *subplan = (Plan *) list_nth(plan->plans, subplanIndex);
+    if (!IsA(subplan, ForeignScan) || subplan->qual != NIL) {
+        return false;
+    }
+
+    ForeignScan *foreignScan = (ForeignScan *) subplan;
+    if (foreignScan->scan.scanrelid != resultRelation) {
+        return false;
+    }
+
+    /*
+     * A DELETE of a range is a range deletion, and the rows of a lookup are
+     * modified key by key.
+     */
+    List *fdwPrivate = foreignScan->fdw_private;
+    KVAccessMethod method = intVal(list_nth(fdwPrivate, KVScanPrivateMethod));
+    bool isLookup = method == KV_SCAN_POINT || method == KV_SCAN_MULTIGET;
+    bool isRange = method == KV_SCAN_FULL || method == KV_SCAN_RANGE;
+    if (operation == CMD_UPDATE) {
+        if (!isLookup || !PlanDirectUpdate(root, resultRelation, foreignScan)) {
+            return false;
+        }
+    } else if (!isLookup && !isRange) {
+        return false;
+    }
+
+    foreignScan->operation = operation;
+    return true;
+}
+
+static void BeginDirectModify(ForeignScanState *scanState, int executorFlags) {
+    /*
+     * Prepare to execute a direct modification on the remote server. This is
+     * called during executor startup. It should perform any initialization
+     * needed prior to the direct modification (that should be done upon the
+     * first call to IterateDirectModify). The ForeignScanState node has
+     * already been created, but its fdw_state field is still NULL.
+     * Information about the table to modify is accessible through the
+     * ForeignScanState node (in particular, from the underlying ForeignScan
+     * plan node, which contains any FDW-private information provided by
+     * PlanDirectModify).
+     *
+     * Note that when (eflags & EXEC_FLAG_EXPLAIN_ONLY) is true, this function
+     * should not perform any externally-visible actions; it should only do
+     * the minimum required to make the node state valid for
+     * ExplainDirectModify and EndDirectModify.
+     */
+
+    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+
+    TableDirectState *directState = palloc0(sizeof(TableDirectState));
+
+    ForeignScan *foreignScan = (ForeignScan *) scanState->ss.ps.plan;
+    List *fdwPrivate = foreignScan->fdw_private;
+    directState->relationId =
+        intVal(list_nth(fdwPrivate, KVScanPrivateRelationId));
+    directState->operation = foreignScan->operation;
+    directState->method = intVal(list_nth(fdwPrivate, KVScanPrivateMethod));
+
+    scanState->fdw_state = (void *) directState;
+
+    /* the database is only opened for execution */
+    if (executorFlags & EXEC_FLAG_EXPLAIN_ONLY) {
+        return;
+    }
+
+    directState->trace = KVTraceBegin();
+
+    instr_time start;
+    KVTraceStart(directState->trace, KV_PHASE_OPEN, &start);
+    directState->db = KVAcquireDB(directState->relationId);
+    KVTraceDone(directState->trace, KV_PHASE_OPEN, &start);
+
+    List *exprStates = ExecInitExprList(foreignScan->fdw_exprs,
+                                        &scanState->ss.ps);
+
+    KVAccessMethod method = directState->method;
+    if (method == KV_SCAN_RANGE) {
+        int lowerExpr = intVal(list_nth(fdwPrivate, KVScanPrivateLowerExpr));
+        int upperExpr = intVal(list_nth(fdwPrivate, KVScanPrivateUpperExpr));
+
+        directState->lowerKey =
+            KeyFromConst(list_nth(fdwPrivate, KVScanPrivateLowerKey));
+        directState->lowerExprState = GetScanExprState(exprStates, lowerExpr);
+        directState->lowerInclusive =
+            intVal(list_nth(fdwPrivate, KVScanPrivateLowerInclusive));
+
+        directState->upperKey =
+            KeyFromConst(list_nth(fdwPrivate, KVScanPrivateUpperKey));
+        directState->upperExprState = GetScanExprState(exprStates, upperExpr);
+        directState->upperInclusive =
+            intVal(list_nth(fdwPrivate, KVScanPrivateUpperInclusive));
+    } else if (method == KV_SCAN_POINT || method == KV_SCAN_MULTIGET) {
+        directState->keyIsArray = method == KV_SCAN_MULTIGET;
+        int keyExpr = intVal(list_nth(fdwPrivate, KVScanPrivateKeyExpr));
+        directState->keyExprState = GetScanExprState(exprStates, keyExpr);
+
+        if (!directState->keyExprState) {
+            List *keyList = (List *) list_nth(fdwPrivate, KVScanPrivateKeys);
+            directState->keys = palloc0(list_length(keyList) * sizeof(StringInfo));
+
+            ListCell *lc;
+            foreach (lc, keyList) {
+                directState->keys[directState->keyCount++] =
+                    KeyFromConst((Const *) lfirst(lc));
+            }
+        }
+
+        if (directState->operation == CMD_UPDATE) {
+            List *updateAttrs = list_nth(fdwPrivate, KVScanPrivateUpdateAttrs);
+            List *updateExprs = list_nth(fdwPrivate, KVScanPrivateUpdateExprs);
+            int updateCount = list_length(updateAttrs);
+
+            directState->updateCount = updateCount;
+            directState->updateAttrs = palloc0(updateCount * sizeof(AttrNumber));
+            directState->updateExprStates =
+                palloc0(updateCount * sizeof(ExprState *));
+
+            for (int index = 0; index < updateCount; index++) {
+                directState->updateAttrs[index] = list_nth_int(updateAttrs, index);
+                directState->updateExprStates[index] =
+                    GetScanExprState(exprStates, list_nth_int(updateExprs, index));
+            }
+        }
+
+        /* the rows of all the keys are written in one batch */
+        KVBeginWrites(directState->relationId, directState->db);
+        directState->writing = true;
+    }
+}
+
+/*
+ * Evaluates a bound of the range to delete that isn't constant. Returns NULL
+ * if it is null, in which case no row is deleted.
+ */
+static StringInfo EvaluateDeleteBound(ForeignScanState *scanState,
+                                      ExprState *exprState) {
+    ExprContext *exprContext = scanState->ss.ps.ps_ExprContext;
+    TupleDesc tupleDescriptor = scanState->ss.ss_currentRelation->rd_att;
+
+    bool isNull = false;
+    Datum value = ExecEvalExpr(exprState, exprContext, &isNull);
+    if (isNull) {
+        return NULL;
+    }
+
+    return SerializeLookupKey(tupleDescriptor, value, ExprStateType(exprState));
+}
+
+/*
+ * Deletes the rows of the range, from the inclusive lower bound up to the
+ * exclusive upper bound that DeleteRange takes.
+ */
+static void ExecuteRangeDelete(ForeignScanState *scanState,
+                               TableDirectState *directState) {
+    StringInfo lowerKey = directState->lowerKey;
+    if (directState->lowerExprState) {
+        lowerKey = EvaluateDeleteBound(scanState, directState->lowerExprState);
+        if (!lowerKey) {
+            return;
+        }
+        if (!directState->lowerInclusive) {
+            /* the smallest key greater than the bound */
+            appendStringInfoChar(lowerKey, '\0');
+        }
+    }
+
+    StringInfo upperKey = directState->upperKey;
+    if (directState->upperExprState) {
+        upperKey = EvaluateDeleteBound(scanState, directState->upperExprState);
+        if (!upperKey) {
+            return;
+        }
+    }
+    if (upperKey && directState->upperInclusive) {
+        /* the smallest key greater than the bound */
+        appendStringInfoChar(upperKey, '\0');
+    }
+
+    instr_time start;
+    KVTraceStart(directState->trace, KV_PHASE_WRITE, &start);
+    bool deleted = DeleteRange(directState->db,
+                               lowerKey? lowerKey->data: NULL,
+                               lowerKey? lowerKey->len: 0,
+                               upperKey? upperKey->data: NULL,
+                               upperKey? upperKey->len: 0,
+                               &directState->rowsModified);
+    KVTraceDone(directState->trace, KV_PHASE_WRITE, &start);
+
+    if (!deleted) {
+        ereport(ERROR, (errmsg("could not delete the rows of table \"%s\"",
+                               get_rel_name(directState->relationId))));
+    }
+}
+
+/*
+ * Builds the stored value of a row from its current one, with the attributes
+ * the update sets replaced by their new values. The other attributes are
+ * copied as they are stored, without deserializing them.
+ */
+static void UpdateStoredValue(TupleDesc tupleDescriptor,
+                              TableDirectState *directState,
+                              Datum *newValues,
+                              bool *newNulls,
+                              char *value,
+                              uint32 valLen,
+                              StringInfo newValue) {
+    uint32 count = tupleDescriptor->natts;
+    uint32 nullsLen = (count - 1 + 7) / 8;
+
+    /* the bitmap of the attributes that exist, as in SerializeTuple */
+    appendBinaryStringInfo(newValue, value, nullsLen);
+
+    uint32 offset = nullsLen;
+    for (uint32 index = 1; index < count; index++) {
+        uint32 byteIndex = (index - 1) / 8;
+        uint8 bitmask = (1 << ((index - 1) % 8));
+        bool exists = (value[byteIndex] & bitmask) != 0;
+
+        Form_pg_attribute attributeForm = TupleDescAttr(tupleDescriptor, index);
+        uint32 start = offset;
+        if (exists) {
+            offset = att_addlength_pointer(offset, attributeForm->attlen,
+                                           value + offset);
+        }
+
+        int update = -1;
+        for (int updateIndex = 0; updateIndex < directState->updateCount;
+             updateIndex++) {
+            if (directState->updateAttrs[updateIndex] == index + 1) {
+                update = updateIndex;
+                break;
+            }
+        }
+
+        if (update < 0) {
+            appendBinaryStringInfo(newValue, value + start, offset - start);
+        } else if (newNulls[update]) {
+            newValue->data[byteIndex] &= ~bitmask;
+        } else {
+            newValue->data[byteIndex] |= bitmask;
+            SerializeAttribute(tupleDescriptor, index, newValues[update],
+                               newValue);
+        }
+    }
+
+    Assert(offset == valLen);
+}
+
+/*
+ * Deletes the rows of the keys of a lookup, or updates them with a read and
+ * a write of their stored value each.
+ */
+static void ExecuteKeyModify(ForeignScanState *scanState,
+                             TableDirectState *directState) {
+    ExprContext *exprContext = scanState->ss.ps.ps_ExprContext;
+    TupleDesc tupleDescriptor = scanState->ss.ss_currentRelation->rd_att;
+
+    if (directState->keyExprState) {
+        bool isNull = false;
+        Datum value = ExecEvalExpr(directState->keyExprState, exprContext,
+                                   &isNull);
+        directState->keys =
+            SerializeLookupKeys(tupleDescriptor, value,
+                                ExprStateType(directState->keyExprState),
+                                isNull, directState->keyIsArray,
+                                                &directState->keyCount);
+    }
+
+    int updateCount = directState->updateCount;
+    Datum *newValues = palloc0(Max(updateCount, 1) * sizeof(Datum));
+    bool *newNulls = palloc0(Max(updateCount, 1) * sizeof(bool));
+    for (int index = 0; index < updateCount; index++) {
+        Datum newValue = ExecEvalExpr(directState->updateExprStates[index],
+                                      exprContext, &newNulls[index]);
+
+        /* stored values are never toasted */
+        AttrNumber attributeNumber = directState->updateAttrs[index];
+        if (!newNulls[index] &&
+            TupleDescAttr(tupleDescriptor, attributeNumber - 1)->attlen == -1) {
+            newValue = PointerGetDatum(PG_DETOAST_DATUM_PACKED(newValue));
+        }
+        newValues[index] = newValue;
+    }
+
+    instr_time start;
+    KVTraceStart(directState->trace, KV_PHASE_WRITE, &start);
+    for (uint32 index = 0; index < directState->keyCount; index++) {
+        StringInfo key = directState->keys[index];
+
+        if (directState->operation == CMD_DELETE) {
+            bool found = false;
+            if (!Delete(directState->db, key->data, key->len, &found)) {
+                ereport(ERROR, (errmsg("error from IterateDirectModify")));
+            }
+            directState->rowsModified += found? 1: 0;
+            continue;
+        }
+
+        char *value = NULL;
+        uint32 valLen = 0;
+        if (!Get(directState->db, key->data, key->len, &value, &valLen)) {
+            continue;
+        }
+
+        StringInfo newValue = makeStringInfo();
+        UpdateStoredValue(tupleDescriptor, directState, newValues, newNulls,
+                          value, valLen, newValue);
+        if (!Put(directState->db, key->data, key->len,
+                 newValue->data, newValue->len)) {
+            ereport(ERROR, (errmsg("error from IterateDirectModify")));
+        }
+        directState->rowsModified++;
+
+        pfree(value);
+        pfree(newValue->data);
+        pfree(newValue);
+    }
+
+    /* the statement's rows go to the database in one batch */
+    directState->writing = false;
+    KVEndWrites(directState->relationId, directState->db);
+    KVTraceDone(directState->trace, KV_PHASE_WRITE, &start);
+}
+
+static TupleTableSlot *IterateDirectModify(ForeignScanState *scanState) {
+    /*
+     * When the INSERT, UPDATE or DELETE query doesn't have a RETURNING
+     * clause, just return NULL after a direct modification on the remote
+     * server. When the query has the clause, fetch one result containing the
+     * data needed for the RETURNING calculation, returning it in a tuple
+     * table slot (the node's ScanTupleSlot should be used for this purpose).
+     * The data that was actually inserted, updated or deleted must be stored
+     * in the es_result_relation_info->ri_projectReturning->pi_exprContext->
+     * ecxt_scantuple of the node's EState. Return NULL if no more rows are
+     * available. Note that this is called in a short-lived memory context
+     * that will be reset between invocations.
+     */
+
+    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+
+    TableDirectState *directState = (TableDirectState *) scanState->fdw_state;
+    TupleTableSlot *tupleSlot = scanState->ss.ss_ScanTupleSlot;
+
+    if (directState->done) {
+        return ExecClearTuple(tupleSlot);
+    }
+
+    if (directState->method == KV_SCAN_POINT ||
+        directState->method == KV_SCAN_MULTIGET) {
+        ExecuteKeyModify(scanState, directState);
+    } else {
+        ExecuteRangeDelete(scanState, directState);
+    }
+    directState->done = true;
+
+    /* the rows are counted like those ExecForeignUpdate/Delete report */
+    EState *executorState = scanState->ss.ps.state;
+    executorState->es_processed += directState->rowsModified;
+
+    Instrumentation *instrument = scanState->ss.ps.instrument;
+    if (instrument) {
+        instrument->tuplecount += directState->rowsModified;
+    }
+
+    return ExecClearTuple(tupleSlot);
+}
+
+static void EndDirectModify(ForeignScanState *scanState) {
+    /*
+     * Clean up following a direct modification on the remote server. It is
+     * normally not important to release palloc'd memory, but for example
+     * open files and connections to the remote server should be cleaned up.
+     */
+
+    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+
+    TableDirectState *directState = (TableDirectState *) scanState->fdw_state;
+
+    if (directState && directState->writing) {
+        directState->writing = false;
+        KVEndWrites(directState->relationId, directState->db);
+    }
+
+    if (directState && directState->trace) {
+        KVTraceReport(directState->trace, "modify", directState->relationId);
+    }
+
+    if (directState && directState->db) {
+        KVReleaseDB(directState->relationId, true);
+        directState->db = NULL;
+    }
+}
+
+/*
+ * Shows the engine counters of a node, like BUFFERS does for heap tables.
+ * Block reads are the block cache misses, and the useful bloom filter checks
+ * are the SST files skipped without reading a block. The CPU times are only
+ * collected with TIMING.
+ */
+static void ExplainPerfCounters(KVPerfCounters *counters,
+                                ExplainState *explainState) {
+    ExplainPropertyInteger("KV Block Cache Hits", NULL,
+                           counters->blockCacheHits, explainState);
+    ExplainPropertyInteger("KV Block Reads", NULL,
+                           counters->blockReads, explainState);
+    ExplainPropertyInteger("KV Block Read Bytes", "bytes",
+                           counters->blockReadBytes, explainState);
+    ExplainPropertyInteger("KV Memtable Lookups", NULL,
+                           counters->memtableLookups, explainState);
+    ExplainPropertyInteger("KV Bloom Filter Useful", NULL,
+                           counters->bloomFilterUseful, explainState);
+    ExplainPropertyInteger("KV Bloom Filter Positive", NULL,
+                           counters->bloomFilterPositive, explainState);
+    ExplainPropertyInteger("KV Keys Skipped", NULL,
+                           counters->keysSkipped, explainState);
+    ExplainPropertyInteger("KV Deletes Skipped", NULL,
+                           counters->deletesSkipped, explainState);
+    ExplainPropertyInteger("KV File Bytes Read", "bytes",
+                           counters->bytesRead, explainState);
+
+    if (explainState->timing) {
+        ExplainPropertyFloat("KV Block Read Time", "ms",
+                             counters->blockReadTime / 1000000.0, 3,
+                             explainState);
+        ExplainPropertyFloat("KV File Read Time", "ms",
+                             counters->readTime / 1000000.0, 3, explainState);
+        ExplainPropertyFloat("KV Get CPU Time", "ms",
+                             counters->getTime / 1000000.0, 3, explainState);
+        ExplainPropertyFloat("KV Seek CPU Time", "ms",
+                             counters->seekTime / 1000000.0, 3, explainState);
+        ExplainPropertyFloat("KV Next CPU Time", "ms",
+                             counters->nextTime / 1000000.0, 3, explainState);
+    }
+}
+
+/* Returns the name of the access method shown by EXPLAIN. */
+static const char *AccessMethodName(KVAccessMethod method) {
+    switch (method) {
+        case KV_SCAN_FULL:
+            return "Full Scan";
+        case KV_SCAN_RANGE:
+            return "Range Scan";
+        case KV_SCAN_POINT:
+            return "Point Get";
+        case KV_SCAN_MULTIGET:
+            return "MultiGet";
+        case KV_SCAN_SKIP:
+            return "Skip Scan";
+        case KV_SCAN_COUNT:
+            return "Row Count";
+    }
+
+    return "Unknown";
+}
+
+/* Shows the key quals, enforced by the access method rather than a filter. */
+static void ExplainKeyConditions(ForeignScanState *scanState,
+                                 ExplainState *explainState) {
+    ForeignScan *foreignScan = (ForeignScan *) scanState->ss.ps.plan;
+    if (foreignScan->fdw_recheck_quals == NIL) {
+        return;
+    }
+
+    List *context = set_deparse_context_planstate(explainState->deparse_cxt,
+                                                  (Node *) scanState,
+                                                  NIL);
+    bool usePrefix = list_length(explainState->rtable) > 1 ||
+                     explainState->verbose;
+    Expr *keyQuals = make_ands_explicit(foreignScan->fdw_recheck_quals);
+    char *conditions = deparse_expression((Node *) keyQuals, context,
+                                          usePrefix, false);
+    ExplainPropertyText("KV Key Conditions", conditions, explainState);
+}
+
+static void ExplainForeignScan(ForeignScanState *scanState,
+                               struct ExplainState * explainState) {
+    /*
+     * Print additional EXPLAIN output for a foreign table scan. This function
+     * can call ExplainPropertyText and related functions to add fields to the
+     * EXPLAIN output. The flag fields in es can be used to determine what to
+     * print, and the state of the ForeignScanState node can be inspected to
+     * provide run-time statistics in the EXPLAIN ANALYZE case.
+     *
+     * If the ExplainForeignScan pointer is set to NULL, no additional
+     * information is printed during EXPLAIN.
+     */
+
+    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+
+    TableReadState *readState = (TableReadState *) scanState->fdw_state;
+    ForeignScan *foreignScan = (ForeignScan *) scanState->ss.ps.plan;
+    List *fdwPrivate = foreignScan->fdw_private;
+    KVAccessMethod method = readState->method;
+
+    ExplainPropertyText("KV Access Method", AccessMethodName(method),
+                        explainState);
+
+    ExplainKeyConditions(scanState, explainState);
+
+    if (method == KV_SCAN_POINT || method == KV_SCAN_MULTIGET) {
+        /* the number of keys is only known in advance for constants */
+        if (intVal(list_nth(fdwPrivate, KVScanPrivateKeyExpr)) < 0) {
+            List *keyList = (List *) list_nth(fdwPrivate, KVScanPrivateKeys);
+            ExplainPropertyInteger("KV Lookup Keys", NULL,
+                                   list_length(keyList), explainState);
+        }
+        if (method == KV_SCAN_MULTIGET) {
+            ExplainPropertyInteger("KV MultiGet Batch Size", NULL,
+                                   KV_MULTIGET_BATCH_SIZE, explainState);
+        }
+    } else if (method == KV_SCAN_SKIP) {
+        ExplainPropertyInteger("KV Prefix Length", NULL,
+                               readState->skipPrefixLength, explainState);
+    }
+
+    if (explainState->verbose) {
+        FdwOptions *fdwOptions = KVGetOptions(readState->relationId);
+        ExplainPropertyText("KV Table Path", fdwOptions->filename, explainState);
+    }
+
+    if (explainState->analyze) {
+        ExplainPropertyInteger("KV Rows Fetched", NULL,
+                               readState->rowsFetched, explainState);
+    }
+
+    if (explainState->analyze && readState->perfCounters) {
+        ExplainPerfCounters(readState->perfCounters, explainState);
+    }
+}
+
+static void ExplainForeignModify(ModifyTableState *modifyTableState,
+                                 ResultRelInfo *relationInfo,
+                                 List *fdwPrivate,
+                                 int subplanIndex,
+                                 struct ExplainState *explainState) {
+    /*
+     * Print additional EXPLAIN output for a foreign table update. This
+     * function can call ExplainPropertyText and related functions to add
+     * fields to the EXPLAIN output. The flag fields in es can be used to
+     * determine what to print, and the state of the ModifyTableState node can
+     * be inspected to provide run-time statistics in the EXPLAIN ANALYZE
+     * case. The first four arguments are the same as for BeginForeignModify.
+     *
+     * If the ExplainForeignModify pointer is set to NULL, no additional
+     * information is printed during EXPLAIN.
      */
 
     ereport(DEBUG1, (errmsg("entering function %s", __func__)));
 
-    TupleTableSlot *tupleSlot = scanState->ss.ss_ScanTupleSlot;
-    ExecClearTuple(tupleSlot);
-
-    TableReadState *readState = (TableReadState *) scanState->fdw_state;
-    char *k = NULL, *v = NULL;
-    uint32 kLen = 0, vLen = 0;
-
-    bool found = false;
-    if (readState->isKeyBased) {
-        if (!readState->done) {
-            k = readState->key->data;
-            kLen = readState->key->len;
-            found = Get(readState->db, k, kLen, &v, &vLen);
-            readState->done = true;
-        }
-    } else {
-        found = Next(readState->db, readState->iter, &k, &kLen, &v, &vLen);
+    if (explainState->verbose) {
+        Oid foreignTableId = RelationGetRelid(relationInfo->ri_RelationDesc);
+        FdwOptions *fdwOptions = KVGetOptions(foreignTableId);
+        ExplainPropertyText("KV Table Path", fdwOptions->filename, explainState);
     }
 
-    if (found) {
-        StringInfo key = makeStringInfo();
-        appendBinaryStringInfo(key, k, kLen);
-        StringInfo value = makeStringInfo();
-        appendBinaryStringInfo(value, v, vLen);
-
-        DeserializeTuple(key, value, tupleSlot);
-
-        ExecStoreVirtualTuple(tupleSlot);
+    TableWriteState *writeState = (TableWriteState *) relationInfo->ri_FdwState;
+    if (explainState->analyze && writeState) {
+        ExplainPropertyInteger("KV Rows Written", NULL,
+                               writeState->rowsWritten, explainState);
     }
 
-    return tupleSlot;
+    if (explainState->analyze && writeState && writeState->perfCounters) {
+        ExplainPerfCounters(writeState->perfCounters, explainState);
+    }
 }
 
-static void ReScanForeignScan(ForeignScanState *scanState) {
-    printf("\n-----------------ReScanForeignScan----------------------\n");
+static void ExplainDirectModify(ForeignScanState *scanState,
+                                struct ExplainState *explainState) {
     /*
-     * Restart the scan from the beginning. Note that any parameters the scan
-     * depends on may have changed value, so the new scan does not necessarily
-     * return exactly the same rows.
+     * Print additional EXPLAIN output for a direct modification on the
+     * remote server. This function can call ExplainPropertyText and related
+     * functions to add fields to the EXPLAIN output. The flag fields in es
+     * can be used to determine what to print, and the state of the
+     * ForeignScanState node can be inspected to provide run-time statistics
+     * in the EXPLAIN ANALYZE case.
      */
 
     ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+
+    TableDirectState *directState = (TableDirectState *) scanState->fdw_state;
+    ForeignScan *foreignScan = (ForeignScan *) scanState->ss.ps.plan;
+    List *fdwPrivate = foreignScan->fdw_private;
+    KVAccessMethod method = directState->method;
+    bool isLookup = method == KV_SCAN_POINT || method == KV_SCAN_MULTIGET;
+    bool isUpdate = directState->operation == CMD_UPDATE;
+
+    const char *methodName = "Range Delete";
+    if (isLookup) {
+        methodName = isUpdate? "Key Update": "Key Delete";
+    }
+    ExplainPropertyText("KV Access Method", methodName, explainState);
+    ExplainKeyConditions(scanState, explainState);
+
+    /* the number of keys is only known in advance for constants */
+    if (isLookup && intVal(list_nth(fdwPrivate, KVScanPrivateKeyExpr)) < 0) {
+        List *keyList = (List *) list_nth(fdwPrivate, KVScanPrivateKeys);
+        ExplainPropertyInteger("KV Lookup Keys", NULL,
+                               list_length(keyList), explainState);
+    }
+
+    if (explainState->verbose) {
+        FdwOptions *fdwOptions = KVGetOptions(directState->relationId);
+        ExplainPropertyText("KV Table Path", fdwOptions->filename, explainState);
+    }
+
+    if (explainState->analyze) {
+        ExplainPropertyInteger(isUpdate? "KV Rows Updated": "KV Rows Deleted",
+                               NULL, directState->rowsModified, explainState);
+    }
 }
 
-static void EndForeignScan(ForeignScanState *scanState) {
-    printf("\n-----------------EndForeignScan----------------------\n");
-    /*
-     * End the scan and release resources. It is normally not important to
-     * release palloc'd memory, but for example open files and connections to
-     * remote servers should be cleaned up.
-     */
+/*
+ * A batched join looks up the rows of a table joined on key = expr, where
+ * expr only refers to the outer relation, a batch of outer rows at a time:
+ * it reads up to KV_MULTIGET_BATCH_SIZE outer rows, serializes their keys and
+ * resolves them with one MultiGet, instead of the Get per outer row of a
+ * nested loop over a parameterized lookup. It is a CustomScan over the outer
+ * plan, and returns the outer rows in their order, each joined with the row
+ * of its key. Only inner and left joins are batched.
+ */
+typedef struct {
+    CustomPath path;
+    JoinType joinType;
+    RelOptInfo *innerRel;
+    RestrictInfo *keyClause;   /* key = expr */
+    Node *valueNode;           /* expr */
+    List *restrictList;        /* all the clauses of the join */
+} KVJoinPath;
 
-    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+/*
+ * Indexes of the items in the custom_private list of a batched join plan. Its
+ * scan tuple holds the columns of the outer plan, followed by the columns of
+ * the table the join uses. custom_exprs holds the expression of the key,
+ * followed by the quals deciding if the row of a left join matches.
+ */
+enum KVJoinPrivateIndex {
+    KVJoinPrivateRelationId,   /* Integer: OID of the looked up table */
+    KVJoinPrivateJoinType,     /* Integer: JOIN_INNER or JOIN_LEFT */
+    KVJoinPrivateOuterCount,   /* Integer: columns of the outer plan */
+    KVJoinPrivateAttrs         /* List of Integer: the columns of the table */
+};
 
-    TableReadState *readState = (TableReadState *) scanState->fdw_state;
+/*
+ * The join state is set up in BeginJoin and used in ExecJoin, ReScanJoin and
+ * EndJoin.
+ */
+typedef struct {
+    CustomScanState css;
+    Oid relationId;
+    Relation relation;
+    void *db;
+    JoinType joinType;
+
+    int outerCount;
+    int attrCount;
+    AttrNumber *attrs;
+    Datum *rowValues;          /* a decoded row of the table */
+    bool *rowNulls;
+
+    ExprState *keyExprState;
+    ExprState *joinQual;
+    TupleTableSlot *outerSlot;
+    bool outerDone;
+
+    /* the outer rows of the current batch, and the rows of their keys */
+    MinimalTuple *batchTuples;
+    StringInfo *batchKeys;     /* NULL for a null key */
+    char **batchValues;
+    uint32 *batchValLens;
+    bool *batchFound;
+    uint32 batchCount;
+    uint32 batchIndex;
+    MemoryContext batchContext;
+
+    /* reported by EXPLAIN ANALYZE */
+    uint64 rowsFetched;
+    uint64 batchesFetched;
+
+    /* engine counters for EXPLAIN (ANALYZE, BUFFERS), NULL if not collected */
+    KVPerfCounters *perfCounters;
+
+    /* phase timings, NULL unless kv_fdw.trace_timing is on */
+    KVTrace *trace;
+} KVJoinState;
+
+static Plan *PlanJoinPath(PlannerInfo *root,
+                          RelOptInfo *rel,
+                          CustomPath *bestPath,
+                          List *targetList,
+                          List *clauses,
+                          List *customPlans);
+static Node *CreateJoinState(CustomScan *customScan);
+static void BeginJoin(CustomScanState *node, EState *executorState,
+                      int executorFlags);
+static TupleTableSlot *ExecJoin(CustomScanState *node);
+static void EndJoin(CustomScanState *node);
+static void ReScanJoin(CustomScanState *node);
+static void ExplainJoin(CustomScanState *node, List *ancestors,
+                        ExplainState *explainState);
+
+static const CustomPathMethods KVJoinPathMethods = {
+    .CustomName = "KV Batched Join",
+    .PlanCustomPath = PlanJoinPath
+};
+
+static const CustomScanMethods KVJoinScanMethods = {
+    .CustomName = "KV Batched Join",
+    .CreateCustomScanState = CreateJoinState
+};
+
+static const CustomExecMethods KVJoinExecMethods = {
+    .CustomName = "KV Batched Join",
+    .BeginCustomScan = BeginJoin,
+    .ExecCustomScan = ExecJoin,
+    .EndCustomScan = EndJoin,
+    .ReScanCustomScan = ReScanJoin,
+    .ExplainCustomScan = ExplainJoin
+};
 
-    if (readState) {
-        if (readState->iter) {
-            DelIter(readState->iter);
-            readState->iter = NULL;
+/*
+ * Adds the distinct columns of the table that the expression uses to vars.
+ * Returns false if it uses a system column or the whole row, which a batched
+ * join doesn't return.
+ */
+static bool CollectJoinVars(Node *node, Index relid, List **vars) {
+    List *nodeVars = pull_var_clause(node, PVC_RECURSE_PLACEHOLDERS);
+
+    ListCell *lc;
+    foreach (lc, nodeVars) {
+        Var *var = (Var *) lfirst(lc);
+        if (var->varno != relid) {
+            continue;
+        }
+        if (var->varattno <= 0) {
+            return false;
         }
 
-        if (readState->db) {
-            Close(readState->db);
-            readState->db = NULL;
+        bool found = false;
+        ListCell *vc;
+        foreach (vc, *vars) {
+            if (((Var *) lfirst(vc))->varattno == var->varattno) {
+                found = true;
+                break;
+            }
+        }
+        if (!found) {
+            *vars = lappend(*vars, var);
         }
     }
+
+    return true;
 }
 
-static void AddForeignUpdateTargets(Query *parsetree,
-                                    RangeTblEntry *tableEntry,
-                                    Relation targetRelation) {
-    printf("\n-----------------AddForeignUpdateTargets----------------------\n");
+/*
+ * Adds a batched join path when the inner relation of an inner or left join
+ * is a table of kv_fdw joined on its key.
+ */
+static void KVSetJoinPathlist(PlannerInfo *root,
+                              RelOptInfo *joinrel,
+                              RelOptInfo *outerrel,
+                              RelOptInfo *innerrel,
+                              JoinType jointype,
+                              JoinPathExtraData *extra) {
+    if (PreviousJoinPathlistHook) {
+        PreviousJoinPathlistHook(root, joinrel, outerrel, innerrel, jointype,
+                                 extra);
+    }
+
+    if (jointype != JOIN_INNER && jointype != JOIN_LEFT) {
+        return;
+    }
+
+    if (innerrel->reloptkind != RELOPT_BASEREL || !innerrel->fdwroutine ||
+        innerrel->fdwroutine->GetForeignRelSize != GetForeignRelSize ||
+        !innerrel->fdw_private) {
+        return;
+    }
+
     /*
-     * UPDATE and DELETE operations are performed against rows previously
-     * fetched by the table-scanning functions. The FDW may need extra
-     * information, such as a row ID or the values of primary-key columns, to
-     * ensure that it can identify the exact row to update or delete. To
-     * support that, this function can add extra hidden, or "junk", target
-     * columns to the list of columns that are to be retrieved from the
-     * foreign table during an UPDATE or DELETE.
-     *
-     * To do that, add TargetEntry items to parsetree->targetList, containing
-     * expressions for the extra values to be fetched. Each such entry must be
-     * marked resjunk = true, and must have a distinct resname that will
-     * identify it at execution time. Avoid using names matching ctidN or
-     * wholerowN, as the core system can generate junk columns of these names.
-     *
-     * This function is called in the rewriter, not the planner, so the
-     * information available is a bit different from that available to the
-     * planning routines. parsetree is the parse tree for the UPDATE or DELETE
-     * command, while target_rte and target_relation describe the target
-     * foreign table.
-     *
-     * If the AddForeignUpdateTargets pointer is set to NULL, no extra target
-     * expressions are added. (This will make it impossible to implement
-     * DELETE operations, though UPDATE may still be feasible if the FDW
-     * relies on an unchanging primary key to identify rows.)
+     * The join has no row marks to recheck rows with, computes no
+     * placeholders, and is neither parameterized nor parallel.
      */
+    if (root->rowMarks != NIL || root->placeholder_list != NIL ||
+        !bms_is_empty(joinrel->lateral_relids) ||
+        !bms_is_empty(innerrel->lateral_relids)) {
+        return;
+    }
 
-    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+    Path *outerPath = outerrel->cheapest_total_path;
+    if (!outerPath || PATH_REQ_OUTER(outerPath)) {
+        return;
+    }
 
-    Form_pg_attribute attr = &RelationGetDescr(targetRelation)->attrs[0];
+    TablePlanState *planState = (TablePlanState *) innerrel->fdw_private;
+    RestrictInfo *keyClause = NULL;
+    Node *valueNode = NULL;
+    List *otherClauses = NIL;
+
+    ListCell *lc;
+    foreach (lc, extra->restrictlist) {
+        RestrictInfo *restrictInfo = (RestrictInfo *) lfirst(lc);
+        if (restrictInfo->pseudoconstant) {
+            return;
+        }
+
+        /* the key of a left join is compared in its join clauses */
+        bool isJoinClause = jointype == JOIN_INNER ||
+                            !RINFO_IS_PUSHED_DOWN(restrictInfo, joinrel->relids);
+
+        Node *node = NULL;
+        bool inclusive = false;
+        if (!keyClause && isJoinClause &&
+            ClassifyKeyQual((Node *) restrictInfo->clause,
+                            innerrel->relid,
+                            planState->keyTypeId,
+                            &node,
+                            &inclusive) == KV_QUAL_EQUAL &&
+            bms_is_subset(pull_varnos(node), outerrel->relids)) {
+            keyClause = restrictInfo;
+            valueNode = node;
+        } else {
+            otherClauses = lappend(otherClauses, restrictInfo);
+        }
+    }
+
+    if (!keyClause) {
+        return;
+    }
+
+    foreach (lc, innerrel->baserestrictinfo) {
+        if (((RestrictInfo *) lfirst(lc))->pseudoconstant) {
+            return;
+        }
+    }
+
+    List *vars = NIL;
+    if (!CollectJoinVars((Node *) joinrel->reltarget->exprs,
+                         innerrel->relid, &vars) ||
+        !CollectJoinVars((Node *) extract_actual_clauses(otherClauses, false),
+                         innerrel->relid, &vars) ||
+        !CollectJoinVars((Node *) extract_actual_clauses(innerrel->baserestrictinfo,
+                                                         false),
+                         innerrel->relid, &vars)) {
+        return;
+    }
 
     /*
-     * Code adapted from redis_fdw
-     *
-     * In KV, we need the key name. It's the first column in the table
-     * regardless of the table type. Knowing the key, we can delete it.
+     * Each outer row is looked up as a key of a MultiGet, and the other
+     * clauses and the restrictions of the table are checked on its row.
      */
-    Var *var = makeVar(parsetree->resultRelation,
-                       1,
-                       attr->atttypid,
-                       attr->atttypmod,
-                       InvalidOid,
-                       0);
-    /* Wrap it in a resjunk TLE with the right name ... */
-    const char *attrname = KVKEYJUNK;
-    AttrNumber resno = list_length(parsetree->targetList) + 1;
-    /* is this true? */
-    Assert(resno == 1);
-    TargetEntry *entry = makeTargetEntry((Expr *) var,
-                                         resno,
-                                         pstrdup(attrname),
-                                         true);
-    /* ... and add it to the query's targetlist */
-    parsetree->targetList = lappend(parsetree->targetList, entry);
+    double outerRows = outerPath->rows;
+    Cost startupCost = 0;
+    Cost runCost = 0;
+    EstimateAccessCost(KV_SCAN_MULTIGET, outerRows, &startupCost, &runCost);
+
+    QualCost qualCost;
+    cost_qual_eval(&qualCost,
+                   list_concat(list_copy(otherClauses),
+                               list_copy(innerrel->baserestrictinfo)),
+                   root);
+
+    startupCost += outerPath->startup_cost + qualCost.startup +
+                   joinrel->reltarget->cost.startup;
+    runCost += outerPath->total_cost - outerPath->startup_cost +
+               qualCost.per_tuple * outerRows +
+               (cpu_tuple_cost + joinrel->reltarget->cost.per_tuple) *
+               joinrel->rows;
+
+    KVJoinPath *joinPath = palloc0(sizeof(KVJoinPath));
+    NodeSetTag(joinPath, T_CustomPath);
+
+    Path *path = &joinPath->path.path;
+    path->pathtype = T_CustomScan;
+    path->parent = joinrel;
+    path->pathtarget = joinrel->reltarget;
+    path->param_info = NULL;
+    path->parallel_aware = false;
+    path->parallel_safe = false;
+    path->parallel_workers = 0;
+    path->rows = joinrel->rows;
+    path->startup_cost = startupCost;
+    path->total_cost = startupCost + runCost;
+
+    /* the rows are returned in the order of the outer rows */
+    path->pathkeys = build_join_pathkeys(root, joinrel, jointype,
+                                         outerPath->pathkeys);
+
+    joinPath->path.flags = 0;
+    joinPath->path.custom_paths = list_make1(outerPath);
+    joinPath->path.custom_private = NIL;
+    joinPath->path.methods = &KVJoinPathMethods;
+
+    joinPath->joinType = jointype;
+    joinPath->innerRel = innerrel;
+    joinPath->keyClause = keyClause;
+    joinPath->valueNode = valueNode;
+    joinPath->restrictList = extra->restrictlist;
+
+    add_path(joinrel, path);
 }
 
-static List *PlanForeignModify(PlannerInfo *plannerInfo,
-                               ModifyTable *plan,
-                               Index resultRelation,
-                               int subplanIndex) {
-    printf("\n-----------------PlanForeignModify----------------------\n");
+static Plan *PlanJoinPath(PlannerInfo *root,
+                          RelOptInfo *rel,
+                          CustomPath *bestPath,
+                          List *targetList,
+                          List *clauses,
+                          List *customPlans) {
+    KVJoinPath *joinPath = (KVJoinPath *) bestPath;
+    RelOptInfo *innerRel = joinPath->innerRel;
+    TablePlanState *planState = (TablePlanState *) innerRel->fdw_private;
+    Plan *outerPlan = (Plan *) linitial(customPlans);
+
     /*
-     * Perform any additional planning actions needed for an insert, update,
-     * or delete on a foreign table. This function generates the FDW-private
-     * information that will be attached to the ModifyTable plan node that
-     * performs the update action. This private information must have the form
-     * of a List, and will be delivered to BeginForeignModify during the
-     * execution stage.
-     *
-     * root is the planner's global information about the query. plan is the
-     * ModifyTable plan node, which is complete except for the fdwPrivLists
-     * field. resultRelation identifies the target foreign table by its
-     * rangetable index. subplan_index identifies which target of the
-     * ModifyTable plan node this is, counting from zero; use this if you want
-     * to index into plan->plans or other substructure of the plan node.
-     *
-     * If the PlanForeignModify pointer is set to NULL, no additional
-     * plan-time actions are taken, and the fdw_private list delivered to
-     * BeginForeignModify will be NIL.
+     * The clauses other than the key clause either decide if the row of a
+     * left join matches, or filter the joined rows. The restrictions of the
+     * table are checked with the former, as a row failing them matches no
+     * outer row.
      */
+    List *joinClauses = NIL;
+    List *otherClauses = NIL;
+    ListCell *lc;
+    foreach (lc, joinPath->restrictList) {
+        RestrictInfo *restrictInfo = (RestrictInfo *) lfirst(lc);
+        if (restrictInfo == joinPath->keyClause) {
+            continue;
+        }
 
-    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+        if (joinPath->joinType == JOIN_LEFT &&
+            !RINFO_IS_PUSHED_DOWN(restrictInfo, rel->relids)) {
+            joinClauses = lappend(joinClauses, restrictInfo->clause);
+        } else {
+            otherClauses = lappend(otherClauses, restrictInfo->clause);
+        }
+    }
 
-    CmdType operation = plan->operation;
+    List *tableClauses = extract_actual_clauses(innerRel->baserestrictinfo,
+                                                false);
+    if (joinPath->joinType == JOIN_LEFT) {
+        joinClauses = list_concat(joinClauses, tableClauses);
+    } else {
+        otherClauses = list_concat(otherClauses, tableClauses);
+    }
 
-    if (operation == CMD_UPDATE || operation == CMD_DELETE) {
-        RelOptInfo *baserel = plannerInfo->simple_rel_array[resultRelation];
-        return list_make1(baserel->fdw_private);
+    /* the scan tuple holds the outer columns, then those of the table */
+    List *scanTargetList = NIL;
+    foreach (lc, outerPlan->targetlist) {
+        TargetEntry *targetEntry = (TargetEntry *) lfirst(lc);
+        scanTargetList = lappend(scanTargetList,
+                                 makeTargetEntry(copyObject(targetEntry->expr),
+                                                 list_length(scanTargetList) + 1,
+                                                 NULL,
+                                                 false));
+    }
+    int outerCount = list_length(scanTargetList);
+
+    List *vars = NIL;
+    CollectJoinVars((Node *) targetList, innerRel->relid, &vars);
+    CollectJoinVars((Node *) joinClauses, innerRel->relid, &vars);
+    CollectJoinVars((Node *) otherClauses, innerRel->relid, &vars);
+
+    List *attrs = NIL;
+    foreach (lc, vars) {
+        Var *var = (Var *) lfirst(lc);
+        scanTargetList = lappend(scanTargetList,
+                                 makeTargetEntry(copyObject(var),
+                                                 list_length(scanTargetList) + 1,
+                                                 NULL,
+                                                 false));
+        attrs = lappend(attrs, makeInteger(var->varattno));
     }
 
-    return NULL;
+    CustomScan *customScan = makeNode(CustomScan);
+    customScan->scan.plan.targetlist = targetList;
+    customScan->scan.plan.qual = otherClauses;
+    customScan->scan.scanrelid = 0;
+    customScan->flags = bestPath->flags;
+    customScan->custom_plans = customPlans;
+    customScan->custom_exprs = lcons(copyObject(joinPath->valueNode),
+                                     joinClauses);
+    customScan->custom_private = list_make4(makeInteger(planState->relationId),
+                                            makeInteger(joinPath->joinType),
+                                            makeInteger(outerCount),
+                                            attrs);
+    customScan->custom_scan_tlist = scanTargetList;
+    customScan->custom_relids = bms_copy(rel->relids);
+    customScan->methods = &KVJoinScanMethods;
+
+    return &customScan->scan.plan;
 }
 
-static void BeginForeignModify(ModifyTableState *modifyTableState,
-                               ResultRelInfo *relationInfo,
-                               List *fdwPrivate,
-                               int subplanIndex,
-                               int executorFlags) {
-    printf("\n-----------------BeginForeignModify----------------------\n");
-    /*
-     * Begin executing a foreign table modification operation. This routine is
-     * called during executor startup. It should perform any initialization
-     * needed prior to the actual table modifications. Subsequently,
-     * ExecForeignInsert, ExecForeignUpdate or ExecForeignDelete will be
-     * called for each tuple to be inserted, updated, or deleted.
-     *
-     * mtstate is the overall state of the ModifyTable plan node being
-     * executed; global data about the plan and execution state is available
-     * via this structure. rinfo is the ResultRelInfo struct describing the
-     * target foreign table. (The ri_FdwState field of ResultRelInfo is
-     * available for the FDW to store any private state it needs for this
-     * operation.) fdw_private contains the private data generated by
-     * PlanForeignModify, if any. subplan_index identifies which target of the
-     * ModifyTable plan node this is. eflags contains flag bits describing the
-     * executor's operating mode for this plan node.
-     *
-     * Note that when (eflags & EXEC_FLAG_EXPLAIN_ONLY) is true, this function
-     * should not perform any externally-visible actions; it should only do
-     * the minimum required to make the node state valid for
-     * ExplainForeignModify and EndForeignModify.
-     *
-     * If the BeginForeignModify pointer is set to NULL, no action is taken
-     * during executor startup.
-     */
+static Node *CreateJoinState(CustomScan *customScan) {
+    KVJoinState *joinState = palloc0(sizeof(KVJoinState));
+    NodeSetTag(joinState, T_CustomScanState);
+    joinState->css.methods = &KVJoinExecMethods;
 
-    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+    return (Node *) joinState;
+}
+
+static void BeginJoin(CustomScanState *node, EState *executorState,
+                      int executorFlags) {
+    KVJoinState *joinState = (KVJoinState *) node;
+    CustomScan *customScan = (CustomScan *) node->ss.ps.plan;
+    List *customPrivate = customScan->custom_private;
+
+    joinState->relationId =
+        intVal(list_nth(customPrivate, KVJoinPrivateRelationId));
+    joinState->joinType = intVal(list_nth(customPrivate, KVJoinPrivateJoinType));
+    joinState->outerCount =
+        intVal(list_nth(customPrivate, KVJoinPrivateOuterCount));
+
+    List *attrList = (List *) list_nth(customPrivate, KVJoinPrivateAttrs);
+    joinState->attrs = palloc0(list_length(attrList) * sizeof(AttrNumber));
+    joinState->attrCount = 0;
+
+    ListCell *lc;
+    foreach (lc, attrList) {
+        joinState->attrs[joinState->attrCount++] = intVal(lfirst(lc));
+    }
+
+    /* the outer rows are read once, in order */
+    Plan *outerPlan = (Plan *) linitial(customScan->custom_plans);
+    PlanState *outerState =
+        ExecInitNode(outerPlan, executorState,
+                     executorFlags & ~(EXEC_FLAG_BACKWARD | EXEC_FLAG_MARK));
+    node->custom_ps = list_make1(outerState);
+
+    joinState->keyExprState = ExecInitExpr(linitial(customScan->custom_exprs),
+                                           &node->ss.ps);
+    joinState->joinQual = ExecInitQual(list_copy_tail(customScan->custom_exprs, 1),
+                                       &node->ss.ps);
 
+    /* the database is only opened for execution */
     if (executorFlags & EXEC_FLAG_EXPLAIN_ONLY) {
         return;
     }
 
-    TableWriteState *writeState = palloc0(sizeof(TableWriteState));
+    joinState->relation = heap_open(joinState->relationId, AccessShareLock);
+    int columnCount = RelationGetDescr(joinState->relation)->natts;
+    joinState->rowValues = palloc0(columnCount * sizeof(Datum));
+    joinState->rowNulls = palloc0(columnCount * sizeof(bool));
 
-    CmdType operation = modifyTableState->operation;
-    writeState->operation = operation;
+    joinState->outerSlot = ExecInitExtraTupleSlot(executorState,
+                                                  ExecGetResultType(outerState));
+    joinState->batchContext = AllocSetContextCreate(executorState->es_query_cxt,
+                                                    "kv_fdw join batch",
+                                                    ALLOCSET_DEFAULT_SIZES);
 
-    Relation relation = relationInfo->ri_RelationDesc;
+    joinState->trace = KVTraceBegin();
 
-    if (operation == CMD_UPDATE || operation == CMD_DELETE) {
-        TablePlanState *planState = (TablePlanState *) list_nth(fdwPrivate, 0);
-        writeState->db = planState->db;
+    instr_time start;
+    KVTraceStart(joinState->trace, KV_PHASE_OPEN, &start);
+    joinState->db = KVAcquireDB(joinState->relationId);
+    KVTraceDone(joinState->trace, KV_PHASE_OPEN, &start);
 
-    } else if (operation == CMD_INSERT) {
-        Oid foreignTableId = RelationGetRelid(relation);
-        FdwOptions *fdwOptions = KVGetOptions(foreignTableId);
-        writeState->db = Open(fdwOptions->filename);
+    joinState->perfCounters = BeginPerfCounters(executorState);
+}
 
-    } else {
-        ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-                        errmsg("not insert, update & delete")));
+/*
+ * Stores an outer row in the scan tuple, with nulls in the columns of the
+ * table.
+ */
+static TupleTableSlot *StoreOuterRow(KVJoinState *joinState,
+                                     MinimalTuple tuple) {
+    TupleTableSlot *outerSlot = joinState->outerSlot;
+    ExecStoreMinimalTuple(tuple, outerSlot, false);
+    slot_getallattrs(outerSlot);
+
+    TupleTableSlot *scanSlot = joinState->css.ss.ss_ScanTupleSlot;
+    ExecClearTuple(scanSlot);
+
+    int outerCount = joinState->outerCount;
+    memcpy(scanSlot->tts_values, outerSlot->tts_values,
+           outerCount * sizeof(Datum));
+    memcpy(scanSlot->tts_isnull, outerSlot->tts_isnull,
+           outerCount * sizeof(bool));
+    for (int index = 0; index < joinState->attrCount; index++) {
+        scanSlot->tts_values[outerCount + index] = (Datum) 0;
+        scanSlot->tts_isnull[outerCount + index] = true;
     }
 
-    if (operation == CMD_DELETE) {
-        /* Find the ctid resjunk column in the subplan's result */
-        Plan *subplan = modifyTableState->mt_plans[subplanIndex]->plan;
-        writeState->keyJunkNo =
-                ExecFindJunkAttributeInTlist(subplan->targetlist, KVKEYJUNK);
-        if (!AttributeNumberIsValid(writeState->keyJunkNo)) {
-            ereport(ERROR, (errmsg("could not find key junk column")));
+    return ExecStoreVirtualTuple(scanSlot);
+}
+
+/*
+ * Reads the next batch of outer rows, and looks up their keys with a single
+ * Get for one key and a MultiGet for more keys.
+ */
+static void FetchJoinBatch(KVJoinState *joinState) {
+    PlanState *outerState = (PlanState *) linitial(joinState->css.custom_ps);
+    ExprContext *exprContext = joinState->css.ss.ps.ps_ExprContext;
+    TupleDesc tupleDescriptor = RelationGetDescr(joinState->relation);
+    Oid valueTypeId = ExprStateType(joinState->keyExprState);
+
+    MemoryContextReset(joinState->batchContext);
+    MemoryContext oldContext = MemoryContextSwitchTo(joinState->batchContext);
+
+    uint32 size = KV_MULTIGET_BATCH_SIZE;
+    joinState->batchTuples = palloc0(size * sizeof(MinimalTuple));
+    joinState->batchKeys = palloc0(size * sizeof(StringInfo));
+    joinState->batchValues = palloc0(size * sizeof(char *));
+    joinState->batchValLens = palloc0(size * sizeof(uint32));
+    joinState->batchFound = palloc0(size * sizeof(bool));
+
+    char **keyData = palloc0(size * sizeof(char *));
+    uint32 *keyLens = palloc0(size * sizeof(uint32));
+    uint32 *keyRows = palloc0(size * sizeof(uint32));
+    uint32 rowCount = 0;
+    uint32 keyCount = 0;
+
+    while (rowCount < size) {
+        TupleTableSlot *outerSlot = ExecProcNode(outerState);
+        if (TupIsNull(outerSlot)) {
+            joinState->outerDone = true;
+            break;
+        }
+
+        MinimalTuple tuple = ExecCopySlotMinimalTuple(outerSlot);
+        joinState->batchTuples[rowCount] = tuple;
+
+        /* the key is evaluated on the scan tuple holding the outer row */
+        ResetExprContext(exprContext);
+        exprContext->ecxt_scantuple = StoreOuterRow(joinState, tuple);
+
+        bool isNull = false;
+        Datum value = ExecEvalExprSwitchContext(joinState->keyExprState,
+                                                exprContext, &isNull);
+
+        /* null never equals a key */
+        if (!isNull) {
+            StringInfo key = SerializeLookupKey(tupleDescriptor, value,
+                                                valueTypeId);
+            joinState->batchKeys[rowCount] = key;
+            keyData[keyCount] = key->data;
+            keyLens[keyCount] = key->len;
+            keyRows[keyCount] = rowCount;
+            keyCount++;
+        }
+
+        rowCount++;
+    }
+
+    if (keyCount > 0) {
+        char **values = palloc0(keyCount * sizeof(char *));
+        uint32 *valLens = palloc0(keyCount * sizeof(uint32));
+        bool *found = palloc0(keyCount * sizeof(bool));
+
+        KVPerfCounters perfStart;
+        if (joinState->perfCounters) {
+            ReadPerfCounters(&perfStart);
+        }
+
+        instr_time start;
+        KVTraceStart(joinState->trace, KV_PHASE_GET, &start);
+
+        if (keyCount == 1) {
+            found[0] = Get(joinState->db, keyData[0], keyLens[0], &values[0],
+                           &valLens[0]);
+        } else {
+            MultiGet(joinState->db, keyCount, keyData, keyLens, values, valLens,
+                     found);
         }
-    }
 
-    relationInfo->ri_FdwState = (void *) writeState;
-}
+        KVTraceDone(joinState->trace, KV_PHASE_GET, &start);
 
-static void SerializeTuple(StringInfo key,
-                           StringInfo value,
-                           TupleTableSlot *tupleSlot) {
+        if (joinState->perfCounters) {
+            AccumulatePerfCounters(joinState->perfCounters, &perfStart);
+        }
 
-    TupleDesc tupleDescriptor = tupleSlot->tts_tupleDescriptor;
-    uint32 count = tupleDescriptor->natts;
+        for (uint32 index = 0; index < keyCount; index++) {
+            uint32 row = keyRows[index];
+            joinState->batchFound[row] = found[index];
+            joinState->batchValues[row] = values[index];
+            joinState->batchValLens[row] = valLens[index];
+        }
+        joinState->batchesFetched++;
+    }
 
-    uint32 nullsLen = (count - 1 + 7) / 8;
+    joinState->batchCount = rowCount;
+    joinState->batchIndex = 0;
 
-    /*
-     * contrary to isnull array, store exists array
-     * to accommodate bug from storage engine
-     */
-    StringInfo nulls = makeStringInfo();
-    enlargeStringInfo(nulls, nullsLen);
-    nulls->len = nullsLen;
-    memset(nulls->data, 0xFF, nullsLen);
+    MemoryContextSwitchTo(oldContext);
+}
 
-    value->len += nullsLen;
+/*
+ * Decodes the row found for an outer row of the batch into the scan tuple,
+ * and checks if it matches the outer row by the quals of a left join.
+ */
+static bool StoreTableRow(KVJoinState *joinState,
+                          TupleTableSlot *scanSlot,
+                          uint32 index) {
+    joinState->rowsFetched++;
 
-    for (uint32 index = 0; index < count; index++) {
+    StringInfo value = makeStringInfo();
+    appendBinaryStringInfo(value, joinState->batchValues[index],
+                           joinState->batchValLens[index]);
+
+    instr_time start;
+    KVTraceStart(joinState->trace, KV_PHASE_DESERIALIZE, &start);
+    DeserializeRow(joinState->batchKeys[index], value,
+                   RelationGetDescr(joinState->relation),
+                   joinState->rowValues, joinState->rowNulls);
+    KVTraceDone(joinState->trace, KV_PHASE_DESERIALIZE, &start);
+
+    int outerCount = joinState->outerCount;
+    for (int column = 0; column < joinState->attrCount; column++) {
+        AttrNumber attr = joinState->attrs[column];
+        scanSlot->tts_values[outerCount + column] = joinState->rowValues[attr - 1];
+        scanSlot->tts_isnull[outerCount + column] = joinState->rowNulls[attr - 1];
+    }
 
-        if (tupleSlot->tts_isnull[index]) {
-            if (index == 0) {
-                ereport(ERROR, (errmsg("first column cannot be null!")));
+    if (!joinState->joinQual) {
+        return true;
+    }
+
+    ExprContext *exprContext = joinState->css.ss.ps.ps_ExprContext;
+    exprContext->ecxt_scantuple = scanSlot;
+    return ExecQual(joinState->joinQual, exprContext);
+}
+
+/*
+ * Returns the next joined row in the scan tuple, or an empty scan tuple at
+ * the end of the outer rows. An outer row without a matching row is skipped
+ * by an inner join, and returned with nulls by a left join.
+ */
+static TupleTableSlot *NextJoinRow(CustomScanState *node) {
+    KVJoinState *joinState = (KVJoinState *) node;
+
+    /* the rows are decoded in the short-lived context of the scan tuple */
+    ExprContext *exprContext = node->ss.ps.ps_ExprContext;
+    MemoryContext oldContext =
+        MemoryContextSwitchTo(exprContext->ecxt_per_tuple_memory);
+
+    TupleTableSlot *scanSlot = node->ss.ss_ScanTupleSlot;
+    for (;;) {
+        if (joinState->batchIndex == joinState->batchCount) {
+            if (joinState->outerDone) {
+                ExecClearTuple(scanSlot);
+                break;
             }
-            uint32 byteIndex = (index - 1) / 8;
-            uint32 bitIndex = (index - 1) % 8;
-            uint8 bitmask = (1 << bitIndex);
-            nulls->data[byteIndex] &= ~bitmask;
+            FetchJoinBatch(joinState);
             continue;
         }
 
-        Datum datum = tupleSlot->tts_values[index];
-        SerializeAttribute(tupleDescriptor, index, datum, index==0? key: value);
+        uint32 index = joinState->batchIndex++;
+        MinimalTuple tuple = joinState->batchTuples[index];
+        StoreOuterRow(joinState, tuple);
+
+        if (joinState->batchFound[index] &&
+            StoreTableRow(joinState, scanSlot, index)) {
+            break;
+        }
+
+        if (joinState->joinType == JOIN_LEFT) {
+            StoreOuterRow(joinState, tuple);
+            break;
+        }
     }
 
-    memcpy(value->data, nulls->data, nullsLen);
+    MemoryContextSwitchTo(oldContext);
+    return scanSlot;
 }
 
-static TupleTableSlot *ExecForeignInsert(EState *executorState,
-                                         ResultRelInfo *relationInfo,
-                                         TupleTableSlot *tupleSlot,
-                                         TupleTableSlot *planSlot) {
-    printf("\n-----------------ExecForeignInsert----------------------\n");
-    /*
-     * Insert one tuple into the foreign table. estate is global execution
-     * state for the query. rinfo is the ResultRelInfo struct describing the
-     * target foreign table. slot contains the tuple to be inserted; it will
-     * match the rowtype definition of the foreign table. planSlot contains
-     * the tuple that was generated by the ModifyTable plan node's subplan; it
-     * differs from slot in possibly containing additional "junk" columns.
-     * (The planSlot is typically of little interest for INSERT cases, but is
-     * provided for completeness.)
-     *
-     * The return value is either a slot containing the data that was actually
-     * inserted (this might differ from the data supplied, for example as a
-     * result of trigger actions), or NULL if no row was actually inserted
-     * (again, typically as a result of triggers). The passed-in slot can be
-     * re-used for this purpose.
-     *
-     * The data in the returned slot is used only if the INSERT query has a
-     * RETURNING clause. Hence, the FDW could choose to optimize away
-     * returning some or all columns depending on the contents of the
-     * RETURNING clause. However, some slot must be returned to indicate
-     * success, or the query's reported rowcount will be wrong.
-     *
-     * If the ExecForeignInsert pointer is set to NULL, attempts to insert
-     * into the foreign table will fail with an error message.
-     */
+/* The join has no row marks, so EvalPlanQual never rechecks its rows. */
+static bool RecheckJoinRow(CustomScanState *node, TupleTableSlot *slot) {
+    return true;
+}
 
-    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+static TupleTableSlot *ExecJoin(CustomScanState *node) {
+    return ExecScan(&node->ss,
+                    (ExecScanAccessMtd) NextJoinRow,
+                    (ExecScanRecheckMtd) RecheckJoinRow);
+}
 
-    TupleDesc tupleDescriptor = tupleSlot->tts_tupleDescriptor;
-    if (HeapTupleHasExternal(tupleSlot->tts_tuple)) {
-        /* detoast any toasted attributes */
-        tupleSlot->tts_tuple = toast_flatten_tuple(tupleSlot->tts_tuple,
-                                                   tupleDescriptor);
+static void ReScanJoin(CustomScanState *node) {
+    KVJoinState *joinState = (KVJoinState *) node;
+    PlanState *outerState = (PlanState *) linitial(node->custom_ps);
+
+    /* ExecProcNode rescans the outer plan itself if its parameters changed */
+    if (!outerState->chgParam) {
+        ExecReScan(outerState);
     }
 
-    slot_getallattrs(tupleSlot);
+    joinState->outerDone = false;
+    joinState->batchCount = 0;
+    joinState->batchIndex = 0;
+}
 
-    StringInfo key = makeStringInfo();
-    StringInfo value = makeStringInfo();
+static void EndJoin(CustomScanState *node) {
+    KVJoinState *joinState = (KVJoinState *) node;
 
-    SerializeTuple(key, value, tupleSlot);
+    ExecEndNode((PlanState *) linitial(node->custom_ps));
 
-    TableWriteState *writeState = (TableWriteState *) relationInfo->ri_FdwState;
+    if (joinState->perfCounters) {
+        DisablePerfCounters();
+    }
 
-    /* copy command may directly call insert without open db */
-    bool CMD_COPY = false;
-    if (!writeState) {
-        CMD_COPY = true;
-        writeState = palloc0(sizeof(TableWriteState));
+    if (joinState->trace) {
+        KVTraceReport(joinState->trace, "join", joinState->relationId);
+    }
 
-        Oid foreignTableId = RelationGetRelid(relationInfo->ri_RelationDesc);
-        FdwOptions *fdwOptions = KVGetOptions(foreignTableId);
-        writeState->db = Open(fdwOptions->filename);
+    if (joinState->db) {
+        KVReleaseDB(joinState->relationId, false);
+        joinState->db = NULL;
     }
 
-    if (!Put(writeState->db, key->data, key->len, value->data, value->len)) {
-        ereport(ERROR, (errmsg("error from ExecForeignInsert")));
+    if (joinState->relation) {
+        heap_close(joinState->relation, NoLock);
+        joinState->relation = NULL;
     }
+}
 
-    /*
-     * immediately release resource to prevent conflicts,
-     * suffer performance penalty due to close and open.
-     */
-    if (CMD_COPY) {
-        Close(writeState->db);
-        pfree(writeState);
+static void ExplainJoin(CustomScanState *node, List *ancestors,
+                        ExplainState *explainState) {
+    KVJoinState *joinState = (KVJoinState *) node;
+    CustomScan *customScan = (CustomScan *) node->ss.ps.plan;
+
+    ExplainPropertyText("KV Lookup Table", get_rel_name(joinState->relationId),
+                        explainState);
+    ExplainPropertyText("KV Join Type",
+                        joinState->joinType == JOIN_LEFT? "Left": "Inner",
+                        explainState);
+
+    List *context = set_deparse_context_planstate(explainState->deparse_cxt,
+                                                  (Node *) node,
+                                                  ancestors);
+    char *lookupKey = deparse_expression(linitial(customScan->custom_exprs),
+                                         context, true, false);
+    ExplainPropertyText("KV Lookup Key", lookupKey, explainState);
+
+    List *joinClauses = list_copy_tail(customScan->custom_exprs, 1);
+    if (joinClauses != NIL) {
+        char *joinFilter = deparse_expression((Node *) make_ands_explicit(joinClauses),
+                                              context, true, false);
+        ExplainPropertyText("KV Join Filter", joinFilter, explainState);
     }
 
-    return tupleSlot;
-}
+    ExplainPropertyInteger("KV MultiGet Batch Size", NULL,
+                           KV_MULTIGET_BATCH_SIZE, explainState);
 
-static TupleTableSlot *ExecForeignUpdate(EState *executorState,
-                                         ResultRelInfo *relationInfo,
-                                         TupleTableSlot *tupleSlot,
-                                         TupleTableSlot *planSlot) {
-    printf("\n-----------------ExecForeignUpdate----------------------\n");
-    /*
-     * Update one tuple in the foreign table. estate is global execution state
-     * for the query. rinfo is the ResultRelInfo struct describing the target
-     * foreign table. slot contains the new data for the tuple; it will match
-     * the rowtype definition of the foreign table. planSlot contains the
-     * tuple that was generated by the ModifyTable plan node's subplan; it
-     * differs from slot in possibly containing additional "junk" columns. In
-     * particular, any junk columns that were requested by
-     * AddForeignUpdateTargets will be available from this slot.
-     *
-     * The return value is either a slot containing the row as it was actually
-     * updated (this might differ from the data supplied, for example as a
-     * result of trigger actions), or NULL if no row was actually updated
-     * (again, typically as a result of triggers). The passed-in slot can be
-     * re-used for this purpose.
-     *
-     * The data in the returned slot is used only if the UPDATE query has a
-     * RETURNING clause. Hence, the FDW could choose to optimize away
-     * returning some or all columns depending on the contents of the
-     * RETURNING clause. However, some slot must be returned to indicate
-     * success, or the query's reported rowcount will be wrong.
-     *
-     * If the ExecForeignUpdate pointer is set to NULL, attempts to update the
-     * foreign table will fail with an error message.
-     *
-     */
+    if (explainState->verbose) {
+        FdwOptions *fdwOptions = KVGetOptions(joinState->relationId);
+        ExplainPropertyText("KV Table Path", fdwOptions->filename, explainState);
+    }
 
-    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+    if (explainState->analyze) {
+        ExplainPropertyInteger("KV Rows Fetched", NULL,
+                               joinState->rowsFetched, explainState);
+        ExplainPropertyInteger("KV MultiGet Batches", NULL,
+                               joinState->batchesFetched, explainState);
+    }
 
-    TupleDesc tupleDescriptor = tupleSlot->tts_tupleDescriptor;
-    if (HeapTupleHasExternal(tupleSlot->tts_tuple)) {
-        /* detoast any toasted attributes */
-        tupleSlot->tts_tuple = toast_flatten_tuple(tupleSlot->tts_tuple,
-                                                   tupleDescriptor);
+    if (explainState->analyze && joinState->perfCounters) {
+        ExplainPerfCounters(joinState->perfCounters, explainState);
     }
-    slot_getallattrs(tupleSlot);
+}
 
-    StringInfo key = makeStringInfo();
-    StringInfo value = makeStringInfo();
+/*
+ * Collects a random sample of the rows of the table with reservoir sampling
+ * over a full scan. Only the rows that enter the sample are deserialized.
+ */
+static int AcquireSampleRows(Relation relation,
+                             int logLevel,
+                             HeapTuple *sampleRows,
+                             int targetRowCount,
+                             double *totalRowCount,
+                             double *totalDeadRowCount) {
+    TupleDesc tupleDescriptor = RelationGetDescr(relation);
+    TupleTableSlot *tupleSlot = MakeSingleTupleTableSlot(tupleDescriptor);
 
-    SerializeTuple(key, value, tupleSlot);
+    MemoryContext tupleContext = AllocSetContextCreate(CurrentMemoryContext,
+                                                       "kv_fdw analyze",
+                                                       ALLOCSET_DEFAULT_SIZES);
 
-    TableWriteState *writeState = (TableWriteState *) relationInfo->ri_FdwState;
-    if (!Put(writeState->db, key->data, key->len, value->data, value->len)) {
-        ereport(ERROR, (errmsg("error from ExecForeignUpdate")));
-    }
+    ReservoirStateData reservoirState;
+    reservoir_init_selection_state(&reservoirState, targetRowCount);
 
-    return tupleSlot;
-}
+    double rowCount = 0;
+    double rowsToSkip = -1;
+    int sampleRowCount = 0;
 
-static TupleTableSlot *ExecForeignDelete(EState *executorState,
-                                         ResultRelInfo *relationInfo,
-                                         TupleTableSlot *tupleSlot,
-                                         TupleTableSlot *planSlot) {
-    printf("\n-----------------ExecForeignDelete----------------------\n");
-    /*
-     * Delete one tuple from the foreign table. estate is global execution
-     * state for the query. rinfo is the ResultRelInfo struct describing the
-     * target foreign table. slot contains nothing useful upon call, but can
-     * be used to hold the returned tuple. planSlot contains the tuple that
-     * was generated by the ModifyTable plan node's subplan; in particular, it
-     * will carry any junk columns that were requested by
-     * AddForeignUpdateTargets. The junk column(s) must be used to identify
-     * the tuple to be deleted.
-     *
-     * The return value is either a slot containing the row that was deleted,
-     * or NULL if no row was deleted (typically as a result of triggers). The
-     * passed-in slot can be used to hold the tuple to be returned.
-     *
-     * The data in the returned slot is used only if the DELETE query has a
-     * RETURNING clause. Hence, the FDW could choose to optimize away
-     * returning some or all columns depending on the contents of the
-     * RETURNING clause. However, some slot must be returned to indicate
-     * success, or the query's reported rowcount will be wrong.
-     *
-     * If the ExecForeignDelete pointer is set to NULL, attempts to delete
-     * from the foreign table will fail with an error message.
-     */
+    Oid relationId = RelationGetRelid(relation);
+    void *db = KVAcquireDB(relationId);
+    void *iter = GetIter(db);
 
-    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+    for (;;) {
+        /* allow the user to cancel a long ANALYZE */
+        vacuum_delay_point();
 
-    TableWriteState *writeState = (TableWriteState *) relationInfo->ri_FdwState;
+        MemoryContextReset(tupleContext);
+        MemoryContext oldContext = MemoryContextSwitchTo(tupleContext);
 
-    bool isnull = true;
-    ExecGetJunkAttribute(planSlot, writeState->keyJunkNo, &isnull);
-    if (isnull) {
-        ereport(ERROR, (errmsg("can't get junk key value")));
-    }
+        char *k = NULL, *v = NULL;
+        uint32 kLen = 0, vLen = 0;
+        bool found = Next(db, iter, &k, &kLen, &v, &vLen);
 
-    slot_getallattrs(planSlot);
+        MemoryContextSwitchTo(oldContext);
 
-    StringInfo key = makeStringInfo();
-    StringInfo value = makeStringInfo();
+        if (!found) {
+            break;
+        }
 
-    SerializeTuple(key, value, planSlot);
+        /*
+         * The first targetRowCount rows fill the reservoir. After that, each
+         * row replaces a random sample row with decreasing probability,
+         * which reservoir_get_next_S turns into a number of rows to skip.
+         */
+        int rowIndex = -1;
+        if (sampleRowCount < targetRowCount) {
+            rowIndex = sampleRowCount++;
+        } else {
+            if (rowsToSkip < 0) {
+                rowsToSkip = reservoir_get_next_S(&reservoirState, rowCount,
+                                                  targetRowCount);
+            }
 
-    if (!Delete(writeState->db, key->data, key->len)) {
-        ereport(ERROR, (errmsg("error from ExecForeignDelete")));
-    }
+            if (rowsToSkip <= 0) {
+                rowIndex = (int) (targetRowCount *
+                                  sampler_random_fract(reservoirState.randstate));
+                Assert(rowIndex >= 0 && rowIndex < targetRowCount);
+                heap_freetuple(sampleRows[rowIndex]);
+            }
 
-    return tupleSlot;
-}
+            rowsToSkip -= 1;
+        }
 
-static void EndForeignModify(EState *executorState, ResultRelInfo *relationInfo) {
-    printf("\n-----------------EndForeignModify----------------------\n");
-    /*
-     * End the table update and release resources. It is normally not
-     * important to release palloc'd memory, but for example open files and
-     * connections to remote servers should be cleaned up.
-     *
-     * If the EndForeignModify pointer is set to NULL, no action is taken
-     * during executor shutdown.
-     */
+        if (rowIndex >= 0) {
+            oldContext = MemoryContextSwitchTo(tupleContext);
 
-    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+            StringInfo key = makeStringInfo();
+            appendBinaryStringInfo(key, k, kLen);
+            StringInfo value = makeStringInfo();
+            appendBinaryStringInfo(value, v, vLen);
+            DeserializeTuple(key, value, tupleSlot);
 
-    TableWriteState *writeState = (TableWriteState *) relationInfo->ri_FdwState;
+            MemoryContextSwitchTo(oldContext);
 
-    if (writeState) {
-        CmdType operation = writeState->operation;
-        if (operation == CMD_INSERT && writeState->db) {
-            Close(writeState->db);
+            sampleRows[rowIndex] = heap_form_tuple(tupleDescriptor,
+                                                   tupleSlot->tts_values,
+                                                   tupleSlot->tts_isnull);
         }
 
-        /* CMD_UPDATE and CMD_DELETE close will be taken care of by endScan */
-        writeState->db = NULL;
+        rowCount += 1;
     }
-}
 
-static void ExplainForeignScan(ForeignScanState *scanState,
-                               struct ExplainState * explainState) {
-    printf("\n-----------------ExplainForeignScan----------------------\n");
-    /*
-     * Print additional EXPLAIN output for a foreign table scan. This function
-     * can call ExplainPropertyText and related functions to add fields to the
-     * EXPLAIN output. The flag fields in es can be used to determine what to
-     * print, and the state of the ForeignScanState node can be inspected to
-     * provide run-time statistics in the EXPLAIN ANALYZE case.
-     *
-     * If the ExplainForeignScan pointer is set to NULL, no additional
-     * information is printed during EXPLAIN.
-     */
+    DelIter(iter);
 
-    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
-}
+    /* a full scan is a good time to refresh the shared statistics */
+    KVReleaseDB(relationId, true);
 
-static void ExplainForeignModify(ModifyTableState *modifyTableState,
-                                 ResultRelInfo *relationInfo,
-                                 List *fdwPrivate,
-                                 int subplanIndex,
-                                 struct ExplainState *explainState) {
-    printf("\n-----------------ExplainForeignModify----------------------\n");
-    /*
-     * Print additional EXPLAIN output for a foreign table update. This
-     * function can call ExplainPropertyText and related functions to add
-     * fields to the EXPLAIN output. The flag fields in es can be used to
-     * determine what to print, and the state of the ModifyTableState node can
-     * be inspected to provide run-time statistics in the EXPLAIN ANALYZE
-     * case. The first four arguments are the same as for BeginForeignModify.
-     *
-     * If the ExplainForeignModify pointer is set to NULL, no additional
-     * information is printed during EXPLAIN.
-     */
+    MemoryContextDelete(tupleContext);
+    ExecDropSingleTupleTableSlot(tupleSlot);
 
-    ereport(DEBUG1, (errmsg("entering function %s", __func__)));
+    /* rows are never kept around after deletion */
+    *totalRowCount = rowCount;
+    *totalDeadRowCount = 0;
+
+    ereport(logLevel,
+            (errmsg("\"%s\": table contains %.0f rows; %d rows in sample",
+                    RelationGetRelationName(relation), rowCount, sampleRowCount)));
+
+    return sampleRowCount;
 }
 
 static bool AnalyzeForeignTable(Relation relation,
                                 AcquireSampleRowsFunc *acquireSampleRowsFunc,
                                 BlockNumber *totalPageCount) {
-    printf("\n-----------------AnalyzeForeignTable----------------------\n");
     /* ----
      * This function is called when ANALYZE is executed on a foreign table. If
      * the FDW can collect statistics for this foreign table, it should return
@@ -983,11 +4173,18 @@ static bool AnalyzeForeignTable(Relation relation,
 
     ereport(DEBUG1, (errmsg("entering function %s", __func__)));
 
-    return false;
+    Oid relationId = RelationGetRelid(relation);
+    void *db = KVAcquireDB(relationId);
+    uint64 dataSize = LiveDataSize(db);
+    KVReleaseDB(relationId, false);
+
+    *totalPageCount = (BlockNumber) Max(dataSize / BLCKSZ, 1);
+    *acquireSampleRowsFunc = AcquireSampleRows;
+
+    return true;
 }
 
 Datum kv_fdw_handler(PG_FUNCTION_ARGS) {
-    printf("\n-----------------fdw_handler----------------------\n");
     FdwRoutine *fdwRoutine = makeNode(FdwRoutine);
 
     ereport(DEBUG1, (errmsg("entering function %s", __func__)));
@@ -1012,6 +4209,9 @@ Datum kv_fdw_handler(PG_FUNCTION_ARGS) {
     fdwRoutine->ReScanForeignScan = ReScanForeignScan; /* S */
     fdwRoutine->EndForeignScan = EndForeignScan; /* S U D */
 
+    /* support for pushing grouping and DISTINCT down as skip scans */
+    fdwRoutine->GetForeignUpperPaths = GetForeignUpperPaths; /* S */
+
     /* remainder are optional - use NULL if not required */
     /* support for insert / update / delete */
     fdwRoutine->AddForeignUpdateTargets = AddForeignUpdateTargets; /* U D */
@@ -1021,10 +4221,19 @@ Datum kv_fdw_handler(PG_FUNCTION_ARGS) {
     fdwRoutine->ExecForeignUpdate = ExecForeignUpdate; /* U */
     fdwRoutine->ExecForeignDelete = ExecForeignDelete; /* D */
     fdwRoutine->EndForeignModify = EndForeignModify; /* I U D */
+    fdwRoutine->BeginForeignInsert = BeginForeignInsert; /* COPY */
+    fdwRoutine->EndForeignInsert = EndForeignInsert; /* COPY */
+
+    /* support for executing key lookups and range deletes directly */
+    fdwRoutine->PlanDirectModify = PlanDirectModify; /* U D */
+    fdwRoutine->BeginDirectModify = BeginDirectModify; /* U D */
+    fdwRoutine->IterateDirectModify = IterateDirectModify; /* U D */
+    fdwRoutine->EndDirectModify = EndDirectModify; /* U D */
 
     /* support for EXPLAIN */
     fdwRoutine->ExplainForeignScan = ExplainForeignScan; /* EXPLAIN S U D */
     fdwRoutine->ExplainForeignModify = ExplainForeignModify; /* EXPLAIN I U D */
+    fdwRoutine->ExplainDirectModify = ExplainDirectModify; /* EXPLAIN U D */
 
     /* support for ANALYSE */
     fdwRoutine->AnalyzeForeignTable = AnalyzeForeignTable; /* ANALYZE only */
@@ -1033,20 +4242,13 @@ Datum kv_fdw_handler(PG_FUNCTION_ARGS) {
 }
 
 Datum kv_fdw_validator(PG_FUNCTION_ARGS) {
-    printf("\n-----------------fdw_validator----------------------\n");
     List *options_list = untransformRelOptions(PG_GETARG_DATUM(0));
+    Oid optionContextId = PG_GETARG_OID(1);
 
     ereport(DEBUG1, (errmsg("entering function %s", __func__)));
 
     /* make sure the options are valid */
-
-    /* no options are supported */
-
-    if (list_length(options_list) > 0) {
-        ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_OPTION_NAME),
-                        errmsg("invalid options"),
-                        errhint("FDW does not support any options")));
-    }
+    KVValidateOptions(options_list, optionContextId);
 
     PG_RETURN_VOID();
 }
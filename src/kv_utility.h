@@ -7,18 +7,54 @@
 #include "postgres.h"
 #include "foreign/foreign.h"
 #include "miscadmin.h"
+#include "optimizer/paths.h"
 #include "commands/event_trigger.h"
 #include "tcop/utility.h"
+#include "catalog/catalog.h"
 #include "catalog/namespace.h"
+#include "catalog/pg_authid.h"
 #include "utils/lsyscache.h"
 #include "commands/defrem.h"
+#include "commands/tablespace.h"
+#include "access/genam.h"
 #include "access/heapam.h"
+#include "access/htup_details.h"
 #include "utils/rel.h"
 #include "storage/ipc.h"
+#include "access/xact.h"
+#include "catalog/pg_foreign_server.h"
+#include "catalog/pg_foreign_table.h"
+#include "catalog/pg_type.h"
+#include "funcapi.h"
+#include "pgstat.h"
+#include "portability/instr_time.h"
+#include "postmaster/bgworker.h"
+#include "storage/latch.h"
+#include "storage/lmgr.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/acl.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/fmgroids.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/syscache.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+#include "utils/varlena.h"
 #include "kv.h"
 
+#ifdef ENABLE_DTRACE
+#include <sys/sdt.h>
+#endif
+
 #define KV_FDW_NAME "kv_fdw"
 
+/* maximum number of tables in the shared statistics cache */
+#define KV_STATS_MAX_TABLES 1024
+
 #define PREVIOUS_UTILITY (PreviousProcessUtilityHook != NULL \
                           ? PreviousProcessUtilityHook : standard_ProcessUtility)
 
@@ -33,17 +69,212 @@
  */
 typedef struct {
     char *filename;
+    char *family;            /* NULL if the table has its own database */
+    Oid serverId;            /* server sharing the database, if it is shared */
+    KVTableOptions tableOptions;
 } FdwOptions;
 
+/*
+ * Tuning options accepted on foreign tables and on servers, where they apply
+ * to all tables of the server that don't set them.
+ */
+typedef struct {
+    const char *optionName;
+    Oid optionContextId;
+} KVValidOption;
+
+static const KVValidOption KVValidOptions[] = {
+    {"layout", ForeignServerRelationId},
+    {"data_path", ForeignServerRelationId},
+    {"data_path", ForeignTableRelationId},
+    {"tablespace", ForeignServerRelationId},
+    {"tablespace", ForeignTableRelationId},
+    {"level_paths", ForeignServerRelationId},
+    {"level_paths", ForeignTableRelationId},
+    {"compression", ForeignServerRelationId},
+    {"compression", ForeignTableRelationId},
+    {"block_size", ForeignServerRelationId},
+    {"block_size", ForeignTableRelationId},
+    {"bloom_bits_per_key", ForeignServerRelationId},
+    {"bloom_bits_per_key", ForeignTableRelationId},
+    {"write_buffer_size", ForeignServerRelationId},
+    {"write_buffer_size", ForeignTableRelationId},
+    {"max_write_buffer_number", ForeignServerRelationId},
+    {"max_write_buffer_number", ForeignTableRelationId},
+    {"compaction_style", ForeignServerRelationId},
+    {"compaction_style", ForeignTableRelationId},
+    {"target_file_size", ForeignServerRelationId},
+    {"target_file_size", ForeignTableRelationId},
+    {"cache_index_and_filter_blocks", ForeignServerRelationId},
+    {"cache_index_and_filter_blocks", ForeignTableRelationId},
+    {"ttl", ForeignServerRelationId},
+    {"ttl", ForeignTableRelationId},
+    {"deletion_trigger", ForeignServerRelationId},
+    {"deletion_trigger", ForeignTableRelationId},
+    {"deletion_window", ForeignServerRelationId},
+    {"deletion_window", ForeignTableRelationId},
+};
+
+#define KV_VALID_OPTION_COUNT \
+    (sizeof(KVValidOptions) / sizeof(KVValidOption))
+
+typedef struct {
+    const char *name;
+    int value;
+} KVOptionValue;
+
+static const KVOptionValue KVCompressionValues[] = {
+    {"none", KV_COMPRESSION_NONE},
+    {"snappy", KV_COMPRESSION_SNAPPY},
+    {"zlib", KV_COMPRESSION_ZLIB},
+    {"lz4", KV_COMPRESSION_LZ4},
+    {"zstd", KV_COMPRESSION_ZSTD},
+    {NULL, 0}
+};
+
+/*
+ * Layouts of the tables of a server. Each table has its own database in the
+ * table layout, while in the database layout the tables of the server are
+ * column families of one database. Changing the layout of a server only
+ * affects the tables created afterwards.
+ */
+#define KV_LAYOUT_TABLE 0
+#define KV_LAYOUT_DATABASE 1
+
+static const KVOptionValue KVLayoutValues[] = {
+    {"table", KV_LAYOUT_TABLE},
+    {"database", KV_LAYOUT_DATABASE},
+    {NULL, 0}
+};
+
+/*
+ * FIFO compaction isn't offered, as it deletes the oldest files once the
+ * table outgrows a size, which loses rows behind the kept row count.
+ */
+static const KVOptionValue KVCompactionStyleValues[] = {
+    {"level", KV_COMPACTION_LEVEL},
+    {"universal", KV_COMPACTION_UNIVERSAL},
+    {NULL, 0}
+};
+
+/*
+ * Size estimates of a table, shared by all backends so that planning a query
+ * doesn't have to open the database. The entries are refreshed whenever a
+ * backend closes a table it has written to, and periodically by the
+ * statistics refresher.
+ */
+typedef struct {
+    Oid databaseId;
+    Oid relationId;
+} KVStatsKey;
+
+typedef struct {
+    KVStatsKey key;          /* hash key, must be first */
+    char path[MAXPGPATH];
+    char family[NAMEDATALEN];   /* empty if the table has its own database */
+    bool refreshable;        /* false if its files are spread over paths */
+    KVTableStats stats;
+    TimestampTz refreshTime;
+} KVStatsEntry;
+
+/*
+ * Operation counters of a table. Entries are added and removed under the
+ * lock, but the counters themselves are updated without it through the
+ * pointer held by the open database. An entry is only removed when its table
+ * is dropped, which no other backend can be accessing then.
+ */
+typedef struct {
+    KVStatsKey key;          /* hash key, must be first */
+    KVOpStats stats;
+} KVOpStatsEntry;
+
+typedef struct {
+    LWLock *lock;            /* protects the statistics hashes */
+} KVSharedState;
+
+/*
+ * A database opened by this backend. RocksDB lets a process open a database
+ * only once, so a scan and a modification of the same table share the
+ * handle, which is closed when the last of them releases it.
+ */
+typedef struct {
+    Oid relationId;          /* hash key, must be first */
+    void *db;
+    Oid serverId;            /* locked while open, if the database is shared */
+    int refCount;
+    bool refreshStats;       /* refresh the statistics when closing */
+    char path[MAXPGPATH];
+    char family[NAMEDATALEN];   /* empty if the table has its own database */
+    bool refreshable;        /* false if its files are spread over paths */
+} KVHandleEntry;
+
+/*
+ * A statement modifying a table. Its writes are collected in a batch until
+ * it ends, so those of a statement that fails in a subtransaction are undone
+ * when the subtransaction aborts.
+ */
+typedef struct {
+    Oid relationId;
+    void *db;
+    SubTransactionId subId;
+} KVWriter;
+
+/*
+ * A reference taken by KVAcquireDB, and the subtransaction it was taken in.
+ * The end callbacks of the statements that fail aren't called, so the
+ * references taken in a subtransaction are released when it aborts.
+ */
+typedef struct {
+    Oid relationId;
+    SubTransactionId subId;
+} KVHandleRef;
+
+/*
+ * Phases of a scan or modification. They are timed when kv_fdw.trace_timing
+ * is on, and marked by the kv_fdw:phase__start and kv_fdw:phase__done static
+ * probes when the server is built with --enable-dtrace.
+ */
+typedef enum {
+    KV_PHASE_OPEN,
+    KV_PHASE_SEEK,
+    KV_PHASE_NEXT,
+    KV_PHASE_GET,
+    KV_PHASE_DESERIALIZE,
+    KV_PHASE_WRITE,
+    KV_PHASE_COUNT
+} KVTracePhase;
+
+typedef struct {
+    instr_time elapsed[KV_PHASE_COUNT];
+    uint64 calls[KV_PHASE_COUNT];
+} KVTrace;
+
+#ifdef ENABLE_DTRACE
+#define KV_PROBE_PHASE_START(phase) DTRACE_PROBE1(kv_fdw, phase__start, phase)
+#define KV_PROBE_PHASE_DONE(phase) DTRACE_PROBE1(kv_fdw, phase__done, phase)
+#else
+#define KV_PROBE_PHASE_START(phase) ((void) 0)
+#define KV_PROBE_PHASE_DONE(phase) ((void) 0)
+#endif
+
 /*
  * SQL functions
  */
 PG_FUNCTION_INFO_V1(kv_ddl_event_end_trigger);
+PG_FUNCTION_INFO_V1(kv_stat_get_tables);
+PG_FUNCTION_INFO_V1(kv_stat_reset);
+PG_FUNCTION_INFO_V1(kv_rocksdb_properties);
+PG_FUNCTION_INFO_V1(kv_rocksdb_stats);
+PG_FUNCTION_INFO_V1(kv_memory_usage);
+PG_FUNCTION_INFO_V1(kv_truncate);
 
 /* Function declarations for extension loading and unloading */
 extern void _PG_init(void);
 extern void _PG_fini(void);
 
+/* Entry point of the statistics refresher background worker */
+extern PGDLLEXPORT void KVStatsRefresherMain(Datum arg);
+
 /* local functions forward declarations */
 static void KVProcessUtility(PlannedStmt *plannedStmt,
                              const char *queryString,
@@ -53,23 +284,293 @@ static void KVProcessUtility(PlannedStmt *plannedStmt,
                              DestReceiver *destReceiver,
                              char *completionTag);
 static void KVShmemStartup(void);
+static void KVSetJoinPathlist(PlannerInfo *root,
+                              RelOptInfo *joinrel,
+                              RelOptInfo *outerrel,
+                              RelOptInfo *innerrel,
+                              JoinType jointype,
+                              JoinPathExtraData *extra);
+static void KVRemoveOpStats(Oid relationId);
+static FdwOptions *KVGetOptions(Oid foreignTableId);
+static FdwOptions *KVGetStorageOptions(Oid foreignTableId);
+static void KVParseTableOption(DefElem *optionDef,
+                               KVTableOptions *tableOptions);
+static Size KVShmemSize(void);
+static void KVRegisterStatsRefresher(void);
 
 /* saved hook value in case of unload */
 static ProcessUtility_hook_type PreviousProcessUtilityHook = NULL;
 static shmem_startup_hook_type PreviousShmemStartupHook = NULL;
+static set_join_pathlist_hook_type PreviousJoinPathlistHook = NULL;
+
+/* shared statistics cache, only set up when loaded at server start */
+static KVSharedState *KVShared = NULL;
+static HTAB *KVStatsHash = NULL;
+static HTAB *KVOpStatsHash = NULL;
+
+/* databases opened by this backend */
+static HTAB *KVHandleHash = NULL;
+static List *KVHandleRefs = NIL;
+static List *KVWriters = NIL;
+
+/* GUC variables */
+static int KVStatsRefreshInterval = 60;
+static bool KVTraceTiming = false;
+static int KVLogMemoryUsageMin = -1;
+static int KVBlockCacheSize = 64 * 1024;
+static int KVMemtableBudget = 64 * 1024;
+static int KVBackgroundThreads = 2;
+static int KVMaxBackgroundJobs = 2;
+static int KVMaxSubcompactions = 1;
+static int KVMaxOpenFiles = -1;
+static int KVBytesPerSync = 0;
+static int KVRateLimit = 0;
+static int KVCompactDeletesMin = 10000;
+static int KVWriteBatchSize = 64 * 1024;
+
+/* flags set by the signal handlers of the statistics refresher */
+static volatile sig_atomic_t KVRefresherGotSigterm = false;
+static volatile sig_atomic_t KVRefresherGotSighup = false;
+
+
+static void KVAssignBlockCacheSize(int newValue, void *extra) {
+    SetBlockCacheSize((uint64) newValue * 1024);
+}
 
+static void KVAssignMemtableBudget(int newValue, void *extra) {
+    SetMemtableBudget((uint64) newValue * 1024);
+}
+
+static void KVAssignCompactDeletesMin(int newValue, void *extra) {
+    SetCompactDeletesMin((uint64) newValue);
+}
+
+static void KVAssignWriteBatchSize(int newValue, void *extra) {
+    SetWriteBatchSize((uint64) newValue * 1024);
+}
+
+/* Passes the engine settings down before a table is opened. */
+static void KVSetEngineOptions(void) {
+    KVEngineOptions engineOptions;
+    engineOptions.backgroundThreads = KVBackgroundThreads;
+    engineOptions.maxBackgroundJobs = KVMaxBackgroundJobs;
+    engineOptions.maxSubcompactions = KVMaxSubcompactions;
+    engineOptions.maxOpenFiles = KVMaxOpenFiles;
+    engineOptions.bytesPerSync = (uint64) KVBytesPerSync * 1024;
+    engineOptions.rateLimit = (uint64) KVRateLimit * 1024;
+    SetEngineOptions(&engineOptions);
+}
 
 /*
  * _PG_init is called when the module is loaded. In this function we save the
  * previous utility hook, and then install our hook to pre-intercept calls to
- * the copy command.
+ * the copy command. The join path hook adds batched joins on the key of a
+ * table.
  */
 void _PG_init(void) {
+    DefineCustomIntVariable("kv_fdw.stats_refresh_interval",
+                            "Sets the interval between refreshes of the shared "
+                            "table statistics.",
+                            "Zero disables the statistics refresher.",
+                            &KVStatsRefreshInterval,
+                            60,
+                            0,
+                            INT_MAX / 1000,
+                            PGC_SIGHUP,
+                            GUC_UNIT_S,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomBoolVariable("kv_fdw.trace_timing",
+                             "Logs the time spent in each phase of kv_fdw "
+                             "scans and modifications.",
+                             NULL,
+                             &KVTraceTiming,
+                             false,
+                             PGC_SUSET,
+                             0,
+                             NULL,
+                             NULL,
+                             NULL);
+
+    DefineCustomIntVariable("kv_fdw.log_memory_usage_min",
+                            "Sets the RocksDB memory usage of a backend above "
+                            "which it is logged.",
+                            "The usage is checked whenever a backend closes a "
+                            "table. -1 disables the logging.",
+                            &KVLogMemoryUsageMin,
+                            -1,
+                            -1,
+                            INT_MAX,
+                            PGC_SUSET,
+                            GUC_UNIT_KB,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomIntVariable("kv_fdw.block_cache_size",
+                            "Sets the size of the block cache shared by the "
+                            "tables a backend opens.",
+                            NULL,
+                            &KVBlockCacheSize,
+                            64 * 1024,
+                            0,
+                            INT_MAX,
+                            PGC_SIGHUP,
+                            GUC_UNIT_KB,
+                            NULL,
+                            KVAssignBlockCacheSize,
+                            NULL);
+
+    DefineCustomIntVariable("kv_fdw.memtable_budget",
+                            "Sets the memory the memtables of the tables a "
+                            "backend opens may use before they are flushed.",
+                            "Zero leaves the memtables unbounded.",
+                            &KVMemtableBudget,
+                            64 * 1024,
+                            0,
+                            INT_MAX,
+                            PGC_SIGHUP,
+                            GUC_UNIT_KB,
+                            NULL,
+                            KVAssignMemtableBudget,
+                            NULL);
+
+    DefineCustomIntVariable("kv_fdw.background_threads",
+                            "Sets the number of threads a backend runs the "
+                            "flushes and compactions of its tables with.",
+                            "The threads are shared by all the tables the "
+                            "backend opens.",
+                            &KVBackgroundThreads,
+                            2,
+                            1,
+                            256,
+                            PGC_SIGHUP,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomIntVariable("kv_fdw.max_background_jobs",
+                            "Sets the maximum number of concurrent flushes "
+                            "and compactions of a table.",
+                            NULL,
+                            &KVMaxBackgroundJobs,
+                            2,
+                            1,
+                            256,
+                            PGC_SIGHUP,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomIntVariable("kv_fdw.max_subcompactions",
+                            "Sets the maximum number of threads a compaction "
+                            "is split into.",
+                            NULL,
+                            &KVMaxSubcompactions,
+                            1,
+                            1,
+                            64,
+                            PGC_SIGHUP,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomIntVariable("kv_fdw.max_open_files",
+                            "Sets the maximum number of files a table keeps "
+                            "open.",
+                            "-1 keeps all the files of a table open.",
+                            &KVMaxOpenFiles,
+                            -1,
+                            -1,
+                            INT_MAX,
+                            PGC_SIGHUP,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomIntVariable("kv_fdw.bytes_per_sync",
+                            "Sets the amount of data written to a table file "
+                            "after which it is synced in the background.",
+                            "Zero only syncs the files when they are complete.",
+                            &KVBytesPerSync,
+                            0,
+                            0,
+                            INT_MAX,
+                            PGC_SIGHUP,
+                            GUC_UNIT_KB,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomIntVariable("kv_fdw.rate_limit",
+                            "Sets the amount of data per second the flushes "
+                            "and compactions of a backend may write.",
+                            "Zero disables the limit.",
+                            &KVRateLimit,
+                            0,
+                            0,
+                            INT_MAX,
+                            PGC_SIGHUP,
+                            GUC_UNIT_KB,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomIntVariable("kv_fdw.compact_deletes_min",
+                            "Sets the number of rows the statements writing "
+                            "a table must delete to compact the key range "
+                            "they deleted.",
+                            "Zero disables these compactions.",
+                            &KVCompactDeletesMin,
+                            10000,
+                            0,
+                            INT_MAX,
+                            PGC_USERSET,
+                            0,
+                            NULL,
+                            KVAssignCompactDeletesMin,
+                            NULL);
+
+    DefineCustomIntVariable("kv_fdw.write_batch_size",
+                            "Sets the size the batch of the rows statements "
+                            "write may reach before it is written.",
+                            "Zero leaves the batch unbounded.",
+                            &KVWriteBatchSize,
+                            64 * 1024,
+                            0,
+                            INT_MAX,
+                            PGC_USERSET,
+                            GUC_UNIT_KB,
+                            NULL,
+                            KVAssignWriteBatchSize,
+                            NULL);
+
     PreviousProcessUtilityHook = ProcessUtility_hook;
     ProcessUtility_hook = KVProcessUtility;
 
+    /*
+     * The shared statistics cache and its refresher are set up by the
+     * postmaster, so they are only available when kv_fdw is loaded through
+     * shared_preload_libraries. Without them, the planner collects the
+     * statistics from the database itself.
+     */
+    if (process_shared_preload_libraries_in_progress) {
+        RequestAddinShmemSpace(KVShmemSize());
+        RequestNamedLWLockTranche(KV_FDW_NAME, 1);
+        KVRegisterStatsRefresher();
+    }
+
     PreviousShmemStartupHook = shmem_startup_hook;
     shmem_startup_hook = KVShmemStartup;
+
+    PreviousJoinPathlistHook = set_join_pathlist_hook;
+    set_join_pathlist_hook = KVSetJoinPathlist;
 }
 
 /*
@@ -80,6 +581,8 @@ void _PG_fini(void) {
     ProcessUtility_hook = PreviousProcessUtilityHook;
 
     shmem_startup_hook = PreviousShmemStartupHook;
+
+    set_join_pathlist_hook = PreviousJoinPathlistHook;
 }
 
 /* Checks if a directory exists for the given directory name. */
@@ -139,6 +642,17 @@ static void KVCreateDatabaseDirectory(Oid databaseOid) {
     }
 }
 
+/* Creates the directories above the database at the path, if needed. */
+static void KVCreateParentDirectory(const char *path) {
+    char *parentPath = pstrdup(path);
+    get_parent_directory(parentPath);
+    if (pg_mkdir_p(parentPath, S_IRWXU) != 0) {
+        ereport(ERROR, (errcode_for_file_access(),
+                        errmsg("could not create directory \"%s\": %m",
+                               parentPath)));
+    }
+}
+
 /*
  * Checks if the given foreign server belongs to kv_fdw. If it
  * does, the function returns true. Otherwise, it returns false.
@@ -170,6 +684,59 @@ static bool KVTable(Oid relationId) {
     return false;
 }
 
+/*
+ * Waits until no other backend has the database shared by the tables of a
+ * server open, and keeps the others from opening it until it is unlocked.
+ * RocksDB lets one process at a time open a database for writing, so the
+ * backends take turns, waiting under lock_timeout and deadlock detection.
+ * The lock is held by the session, since a database can be closed by
+ * another resource owner than the one that opened it.
+ */
+static void KVLockSharedDatabase(Oid serverId) {
+    if (serverId == InvalidOid) {
+        return;
+    }
+
+    LOCKTAG tag;
+    SET_LOCKTAG_OBJECT(tag, MyDatabaseId, ForeignServerRelationId, serverId, 0);
+    (void) LockAcquire(&tag, ExclusiveLock, true, false);
+}
+
+static void KVUnlockSharedDatabase(Oid serverId) {
+    if (serverId == InvalidOid) {
+        return;
+    }
+
+    LOCKTAG tag;
+    SET_LOCKTAG_OBJECT(tag, MyDatabaseId, ForeignServerRelationId, serverId, 0);
+    LockRelease(&tag, ExclusiveLock, true);
+}
+
+/*
+ * Opens the database of a table, erroring out if RocksDB can't open it. A
+ * database shared by the tables of a server stays locked until the table is
+ * closed with KVCloseTable.
+ */
+static void *KVOpenTable(Oid relationId, FdwOptions *fdwOptions) {
+    KVLockSharedDatabase(fdwOptions->serverId);
+
+    char *error = NULL;
+    void *db = Open(fdwOptions->filename, fdwOptions->family,
+                    &fdwOptions->tableOptions, &error);
+    if (db == NULL) {
+        KVUnlockSharedDatabase(fdwOptions->serverId);
+        ereport(ERROR, (errmsg("could not open table \"%s\": %s",
+                               get_rel_name(relationId), error)));
+    }
+
+    return db;
+}
+
+static void KVCloseTable(void *db, Oid serverId) {
+    Close(db);
+    KVUnlockSharedDatabase(serverId);
+}
+
 /*
  * kv_ddl_event_end_trigger is the event trigger function which is called on
  * ddl_command_end event. This function creates required directories after the
@@ -205,19 +772,18 @@ Datum kv_ddl_event_end_trigger(PG_FUNCTION_ARGS) {
              * We have no chance to hook into server creation to create data
              * directory for it during database creation time.
              */
-            KVCreateDatabaseDirectory(MyDatabaseId);
+            FdwOptions *fdwOptions = KVGetOptions(relationId);
+            KVCreateParentDirectory(fdwOptions->filename);
 
-            StringInfo kvPath = makeStringInfo();
-            appendStringInfo(kvPath,
-                             "%s/%s/%u/%u",
-                             DataDir,
-                             KV_FDW_NAME,
-                             MyDatabaseId,
-                             relationId);
+            KVTableOptions *tableOptions = &fdwOptions->tableOptions;
+            for (int index = 0; index < tableOptions->levelPathCount; index++) {
+                KVCreateParentDirectory(tableOptions->levelPaths[index].path);
+            }
 
-            /* Initialize the database */
-            void *kvDB = Open(kvPath->data);
-            Close(kvDB);
+            /* Initialize the database, or the column family of the table */
+            KVSetEngineOptions();
+            void *kvDB = KVOpenTable(relationId, fdwOptions);
+            KVCloseTable(kvDB, fdwOptions->serverId);
 
             heap_close(relation, AccessExclusiveLock);
         }
@@ -244,19 +810,42 @@ static void KVRemoveDatabaseDirectory(Oid databaseOid) {
     }
 }
 
+/*
+ * Returns the directory the kv_fdw data of the databases is kept in: the
+ * data_path option, the kv_fdw directory of the tablespace option, or else
+ * $PGDATA/kv_fdw. The first of them in the options is used, so the options
+ * of a table go before those of its server.
+ */
+static char *KVBaseDirectory(List *optionList) {
+    ListCell *optionCell = NULL;
+    foreach(optionCell, optionList) {
+        DefElem *optionDef = (DefElem *) lfirst(optionCell);
+
+        if (strcmp(optionDef->defname, "data_path") == 0) {
+            return pstrdup(defGetString(optionDef));
+        } else if (strcmp(optionDef->defname, "tablespace") == 0) {
+            Oid tablespaceId = get_tablespace_oid(defGetString(optionDef),
+                                                  false);
+            return psprintf("%s/pg_tblspc/%u/%s/%s", DataDir, tablespaceId,
+                            TABLESPACE_VERSION_DIRECTORY, KV_FDW_NAME);
+        }
+    }
+
+    return psprintf("%s/%s", DataDir, KV_FDW_NAME);
+}
+
 /*
  * Constructs the default file path to use for a kv_fdw table.
- * The path is of the form $PGDATA/cstore_fdw/{databaseOid}/{relfilenode}.
+ * The path is of the form {baseDirectory}/{databaseOid}/{relfilenode}.
  */
-static char *KVDefaultFilePath(Oid foreignTableId) {
+static char *KVDefaultFilePath(Oid foreignTableId, const char *baseDirectory) {
     Relation relation = relation_open(foreignTableId, AccessShareLock);
     RelFileNode relationFileNode = relation->rd_node;
 
     StringInfo filePath = makeStringInfo();
     appendStringInfo(filePath,
-                     "%s/%s/%u/%u",
-                     DataDir,
-                     KV_FDW_NAME,
+                     "%s/%u/%u",
+                     baseDirectory,
                      relationFileNode.dbNode,
                      relationFileNode.relNode);
 
@@ -266,10 +855,62 @@ static char *KVDefaultFilePath(Oid foreignTableId) {
 }
 
 /*
- * Extracts and returns the list of kv file (directory) names
- * from DROP table statement
+ * Constructs the path of the database shared by the tables of a server using
+ * the database layout. The path is of the form
+ * {baseDirectory}/{databaseOid}/server_{serverOid}.
+ */
+static char *KVServerDatabasePath(Oid serverId, const char *baseDirectory) {
+    StringInfo filePath = makeStringInfo();
+    appendStringInfo(filePath,
+                     "%s/%u/server_%u",
+                     baseDirectory,
+                     MyDatabaseId,
+                     serverId);
+
+    return filePath->data;
+}
+
+/*
+ * Turns the base directories of the level paths into the directories of the
+ * database at the path, which are named like it.
+ */
+static void KVResolveLevelPaths(FdwOptions *options) {
+    const char *databaseName = last_dir_separator(options->filename) + 1;
+    KVTableOptions *tableOptions = &options->tableOptions;
+    for (int index = 0; index < tableOptions->levelPathCount; index++) {
+        KVLevelPath *levelPath = &tableOptions->levelPaths[index];
+        levelPath->path = psprintf("%s/%u/%s", levelPath->path, MyDatabaseId,
+                                   databaseName);
+    }
+}
+
+/*
+ * Returns where the shared database of a server is stored, with the options
+ * of the server.
+ */
+static FdwOptions *KVGetServerStorageOptions(ForeignServer *server) {
+    FdwOptions *options = palloc0(sizeof(FdwOptions));
+    options->filename = KVServerDatabasePath(server->serverid,
+                                             KVBaseDirectory(server->options));
+    options->serverId = server->serverid;
+
+    ListCell *optionCell = NULL;
+    foreach(optionCell, server->options) {
+        KVParseTableOption((DefElem *) lfirst(optionCell),
+                           &options->tableOptions);
+    }
+    KVResolveLevelPaths(options);
+
+    return options;
+}
+
+/*
+ * Extracts and returns where the tables of a DROP table statement are
+ * stored, or the shared databases of a DROP server statement, and the list
+ * of the dropped tables
  */
-static List *KVDroppedFilenameList(DropStmt *dropStmt) {
+static List *KVDroppedFilenameList(DropStmt *dropStmt,
+                                   List **droppedRelationIds) {
     List *droppedFileList = NIL;
     if (dropStmt->removeType == OBJECT_FOREIGN_TABLE) {
 
@@ -281,17 +922,135 @@ static List *KVDroppedFilenameList(DropStmt *dropStmt) {
             Oid relationId = RangeVarGetRelid(rangeVar, AccessShareLock, true);
 
             if (KVTable(relationId)) {
-                char *defaultFilename = KVDefaultFilePath(relationId);
-                droppedFileList = lappend(droppedFileList, defaultFilename);
+                FdwOptions *storage = KVGetStorageOptions(relationId);
+                droppedFileList = lappend(droppedFileList, storage);
+                *droppedRelationIds = lappend_oid(*droppedRelationIds,
+                                                  relationId);
+            }
+        }
+    } else if (dropStmt->removeType == OBJECT_FOREIGN_SERVER) {
+
+        ListCell *dropObjectCell = NULL;
+        foreach(dropObjectCell, dropStmt->objects) {
+
+            char *serverName = strVal(lfirst(dropObjectCell));
+            ForeignServer *server = GetForeignServerByName(serverName, true);
+
+            if (server != NULL && KVServer(server)) {
+                FdwOptions *storage = KVGetServerStorageOptions(server);
+                droppedFileList = lappend(droppedFileList, storage);
             }
         }
     }
     return droppedFileList;
 }
 
+/*
+ * Checks if an option decides where tables are stored. These options are
+ * read each time a table is opened, so changing them would leave the data of
+ * existing tables behind.
+ */
+static bool KVLocationOption(const char *optionName) {
+    return strcmp(optionName, "layout") == 0 ||
+           strcmp(optionName, "data_path") == 0 ||
+           strcmp(optionName, "tablespace") == 0 ||
+           strcmp(optionName, "level_paths") == 0;
+}
+
+/* Checks if any foreign table uses the server. */
+static bool KVServerHasTables(Oid serverId) {
+    Relation relation = heap_open(ForeignTableRelationId, AccessShareLock);
+
+    ScanKeyData key;
+    ScanKeyInit(&key, Anum_pg_foreign_table_ftserver, BTEqualStrategyNumber,
+                F_OIDEQ, ObjectIdGetDatum(serverId));
+    SysScanDesc scan = systable_beginscan(relation, InvalidOid, false, NULL,
+                                          1, &key);
+    bool hasTables = HeapTupleIsValid(systable_getnext(scan));
+    systable_endscan(scan);
+
+    heap_close(relation, AccessShareLock);
+    return hasTables;
+}
+
+/*
+ * Errors out if an ALTER FOREIGN TABLE changes the options of a table in a
+ * way its data can't follow: a table keeps the location it was created in,
+ * and the tables sharing the database of their server have no options.
+ */
+static void KVCheckAlterTableOptions(AlterTableStmt *alterStmt) {
+    Oid relationId = RangeVarGetRelid(alterStmt->relation, AccessShareLock,
+                                      true);
+    if (!KVTable(relationId)) {
+        return;
+    }
+
+    ListCell *commandCell = NULL;
+    foreach(commandCell, alterStmt->cmds) {
+        AlterTableCmd *command = (AlterTableCmd *) lfirst(commandCell);
+        if (command->subtype != AT_GenericOptions) {
+            continue;
+        }
+
+        FdwOptions *storage = KVGetStorageOptions(relationId);
+        if (storage->family != NULL) {
+            ForeignTable *foreignTable = GetForeignTable(relationId);
+            ForeignServer *server = GetForeignServer(foreignTable->serverid);
+            ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_OPTION_NAME),
+                            errmsg("table \"%s\" can't have its own options",
+                                   get_rel_name(relationId)),
+                            errdetail("The tables of server \"%s\" share one "
+                                      "database.", server->servername),
+                            errhint("Set the options on the server instead.")));
+        }
+
+        ListCell *optionCell = NULL;
+        foreach(optionCell, (List *) command->def) {
+            DefElem *optionDef = (DefElem *) lfirst(optionCell);
+            if (KVLocationOption(optionDef->defname)) {
+                ereport(ERROR,
+                        (errcode(ERRCODE_FDW_INVALID_OPTION_NAME),
+                         errmsg("option \"%s\" of table \"%s\" can't be "
+                                "changed", optionDef->defname,
+                                get_rel_name(relationId)),
+                         errdetail("The data of a table stays where it was "
+                                   "created.")));
+            }
+        }
+    }
+}
+
+/*
+ * Errors out if an ALTER SERVER changes where the tables of the server are
+ * stored while it has tables, which would leave their data behind.
+ */
+static void KVCheckAlterServerOptions(AlterForeignServerStmt *alterStmt) {
+    ForeignServer *server = GetForeignServerByName(alterStmt->servername, true);
+    if (server == NULL || !KVServer(server)) {
+        return;
+    }
+
+    ListCell *optionCell = NULL;
+    foreach(optionCell, alterStmt->options) {
+        DefElem *optionDef = (DefElem *) lfirst(optionCell);
+        if (KVLocationOption(optionDef->defname) &&
+            KVServerHasTables(server->serverid)) {
+            ereport(ERROR,
+                    (errcode(ERRCODE_FDW_INVALID_OPTION_NAME),
+                     errmsg("option \"%s\" of server \"%s\" can't be changed "
+                            "while it has tables", optionDef->defname,
+                            server->servername),
+                     errdetail("The data of a table stays where it was "
+                               "created."),
+                     errhint("Create another server instead.")));
+        }
+    }
+}
+
 /*
  * Hook for handling utility commands. This function
- * customizes the behavior of "DROP FOREIGN TABLE " commands.
+ * customizes the behavior of "DROP FOREIGN TABLE " commands, and refuses the
+ * ALTERs of options that would move existing tables.
  * For all other utility statements, the function calls
  * the previous utility hook or the standard utility command via macro
  * CALL_PREVIOUS_UTILITY.
@@ -304,6 +1063,12 @@ static void KVProcessUtility(PlannedStmt *plannedStmt,
                              DestReceiver *destReceiver,
                              char *completionTag) {
     Node *parseTree = plannedStmt->utilityStmt;
+    if (nodeTag(parseTree) == T_AlterTableStmt) {
+        KVCheckAlterTableOptions((AlterTableStmt *) parseTree);
+    } else if (nodeTag(parseTree) == T_AlterForeignServerStmt) {
+        KVCheckAlterServerOptions((AlterForeignServerStmt *) parseTree);
+    }
+
     if (nodeTag(parseTree) == T_DropStmt) {
 
         DropStmt *dropStmt = (DropStmt *) parseTree;
@@ -333,7 +1098,9 @@ static void KVProcessUtility(PlannedStmt *plannedStmt,
             }
         } else {
             /* drop table & drop server */
-            List *droppedTables = KVDroppedFilenameList((DropStmt *) parseTree);
+            List *droppedRelationIds = NIL;
+            List *droppedTables = KVDroppedFilenameList((DropStmt *) parseTree,
+                                                        &droppedRelationIds);
 
             /* delete metadata */
             CALL_PREVIOUS_UTILITY(parseTree,
@@ -346,13 +1113,50 @@ static void KVProcessUtility(PlannedStmt *plannedStmt,
             /* delete real data */
             ListCell *fileCell = NULL;
             foreach(fileCell, droppedTables) {
-                char *path = lfirst(fileCell);
+                FdwOptions *storage = lfirst(fileCell);
                 StringInfo tablePath = makeStringInfo();
-                appendStringInfo(tablePath, "%s", path);
-                if (KVDirectoryExists(tablePath)) {
-                    rmtree(path, true);
+                appendStringInfo(tablePath, "%s", storage->filename);
+                if (!KVDirectoryExists(tablePath)) {
+                    continue;
+                }
+
+                if (storage->family != NULL) {
+                    KVSetEngineOptions();
+                    KVLockSharedDatabase(storage->serverId);
+                    char *error = NULL;
+                    bool dropped = DropFamily(storage->filename,
+                                              storage->family,
+                                              &storage->tableOptions, &error);
+                    KVUnlockSharedDatabase(storage->serverId);
+                    if (!dropped) {
+                        ereport(ERROR,
+                                (errmsg("could not open \"%s\": %s",
+                                        storage->filename, error)));
+                    }
+                    continue;
+                }
+
+                /* the database of a dropped server may still be in use */
+                KVLockSharedDatabase(storage->serverId);
+                rmtree(storage->filename, true);
+                KVUnlockSharedDatabase(storage->serverId);
+
+                KVTableOptions *tableOptions = &storage->tableOptions;
+                for (int index = 0; index < tableOptions->levelPathCount;
+                     index++) {
+                    StringInfo levelPath = makeStringInfo();
+                    appendStringInfoString(levelPath,
+                                           tableOptions->levelPaths[index].path);
+                    if (KVDirectoryExists(levelPath)) {
+                        rmtree(levelPath->data, true);
+                    }
                 }
             }
+
+            ListCell *relationCell = NULL;
+            foreach(relationCell, droppedRelationIds) {
+                KVRemoveOpStats(lfirst_oid(relationCell));
+            }
         }
     } else {
         /* handle other utility statements */
@@ -391,52 +1195,1352 @@ static char *KVGetOptionValue(Oid foreignTableId, const char *optionName) {
     return NULL;
 }
 
+static void KVInvalidOptionValue(DefElem *optionDef, const char *hint) {
+    ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+                    errmsg("invalid value for option \"%s\": \"%s\"",
+                           optionDef->defname, defGetString(optionDef)),
+                    hint? errhint("%s", hint): 0));
+}
+
+/* Parses a positive integer option, with a unit if it is a size or time. */
+static int KVParseIntOption(DefElem *optionDef, int flags) {
+    const char *hint = NULL;
+    int value = 0;
+    if (!parse_int(defGetString(optionDef), &value, flags, &hint) ||
+        value <= 0) {
+        KVInvalidOptionValue(optionDef, hint);
+    }
+
+    return value;
+}
+
+static int KVParseEnumOption(DefElem *optionDef, const char *value,
+                             const KVOptionValue *values) {
+    for (const KVOptionValue *option = values; option->name; option++) {
+        if (pg_strcasecmp(value, option->name) == 0) {
+            return option->value;
+        }
+    }
+
+    StringInfo hint = makeStringInfo();
+    for (const KVOptionValue *option = values; option->name; option++) {
+        appendStringInfo(hint, "%s%s", hint->len > 0? ", ": "", option->name);
+    }
+    KVInvalidOptionValue(optionDef, psprintf("Valid values are: %s.",
+                                             hint->data));
+    return 0;
+}
+
 /*
- * Returns the option values to be used when reading and writing
- * the files. To resolve these values, the function checks options for the
- * foreign table, and if not present, falls back to default values. This function
- * errors out if given option values are considered invalid.
+ * Parses a compression option, either a single compression for all levels
+ * or a comma separated list with the compression of each level.
  */
-static FdwOptions *KVGetOptions(Oid foreignTableId) {
-    char *filename = KVGetOptionValue(foreignTableId, "filename");
+static void KVParseCompression(DefElem *optionDef,
+                               KVTableOptions *tableOptions) {
+    char *rawValue = pstrdup(defGetString(optionDef));
+    List *levels = NIL;
+    if (!SplitIdentifierString(rawValue, ',', &levels) || levels == NIL ||
+        list_length(levels) > KV_MAX_COMPRESSION_LEVELS) {
+        KVInvalidOptionValue(optionDef,
+                             psprintf("Give a compression or a list of at "
+                                      "most %d.", KV_MAX_COMPRESSION_LEVELS));
+    }
 
-    /* set default filename if it is not provided */
-    if (filename == NULL) {
-        filename = KVDefaultFilePath(foreignTableId);
+    tableOptions->compressionLevels = 0;
+    ListCell *levelCell = NULL;
+    foreach(levelCell, levels) {
+        int compression = KVParseEnumOption(optionDef, lfirst(levelCell),
+                                            KVCompressionValues);
+        tableOptions->compression[tableOptions->compressionLevels++] =
+            (KVCompression) compression;
     }
+}
 
-    FdwOptions *options = palloc0(sizeof(FdwOptions));
-    options->filename = filename;
+/*
+ * Parses the level_paths option, a comma separated list of directories with
+ * the target size of each, such as '/ssd/kv:100GB,/hdd/kv:10TB'. The paths
+ * are the base directories, under which each table has its own directory.
+ */
+static void KVParseLevelPaths(DefElem *optionDef,
+                              KVTableOptions *tableOptions) {
+    char *rawValue = pstrdup(defGetString(optionDef));
+    List *paths = NIL;
+    if (!SplitDirectoriesString(rawValue, ',', &paths) || paths == NIL ||
+        list_length(paths) > KV_MAX_LEVEL_PATHS) {
+        KVInvalidOptionValue(optionDef,
+                             psprintf("Give a list of at most %d directories "
+                                      "with their target sizes.",
+                                      KV_MAX_LEVEL_PATHS));
+    }
 
-    return options;
+    tableOptions->levelPathCount = 0;
+    ListCell *pathCell = NULL;
+    foreach(pathCell, paths) {
+        char *path = lfirst(pathCell);
+        char *separator = strrchr(path, ':');
+        if (separator == NULL) {
+            KVInvalidOptionValue(optionDef, "Give each directory as "
+                                 "path:size, such as /ssd/kv:100GB.");
+        }
+
+        *separator = '\0';
+        if (!is_absolute_path(path)) {
+            KVInvalidOptionValue(optionDef,
+                                 "The directories must be absolute paths.");
+        }
+
+        const char *hint = NULL;
+        int targetSize = 0;
+        if (!parse_int(separator + 1, &targetSize, GUC_UNIT_MB, &hint) ||
+            targetSize <= 0) {
+            KVInvalidOptionValue(optionDef, hint);
+        }
+
+        KVLevelPath *levelPath =
+            &tableOptions->levelPaths[tableOptions->levelPathCount++];
+        levelPath->path = path;
+        levelPath->targetSize = (uint64) targetSize * 1024 * 1024;
+    }
 }
 
 /*
- * Release memory.
- *
- * Note: we don't bother with acquiring lock, because there should be no
- * other processes running when this is called.
+ * Parses a tuning option into the table options, erroring out if the value
+ * is invalid. Used both to validate and to apply the options.
  */
-static void KVShmemShutdown(int code, Datum arg) {
-    printf("\n============KVShmemShutdown=============\n");
+static void KVParseTableOption(DefElem *optionDef,
+                               KVTableOptions *tableOptions) {
+    const char *name = optionDef->defname;
+
+    if (strcmp(name, "compression") == 0) {
+        KVParseCompression(optionDef, tableOptions);
+    } else if (strcmp(name, "block_size") == 0) {
+        tableOptions->blockSize = KVParseIntOption(optionDef, GUC_UNIT_BYTE);
+    } else if (strcmp(name, "bloom_bits_per_key") == 0) {
+        tableOptions->bloomBitsPerKey = KVParseIntOption(optionDef, 0);
+    } else if (strcmp(name, "write_buffer_size") == 0) {
+        tableOptions->writeBufferSize = KVParseIntOption(optionDef,
+                                                         GUC_UNIT_BYTE);
+    } else if (strcmp(name, "max_write_buffer_number") == 0) {
+        tableOptions->maxWriteBufferNumber = KVParseIntOption(optionDef, 0);
+    } else if (strcmp(name, "compaction_style") == 0) {
+        tableOptions->compactionStyle = (KVCompactionStyle)
+            KVParseEnumOption(optionDef, defGetString(optionDef),
+                              KVCompactionStyleValues);
+    } else if (strcmp(name, "target_file_size") == 0) {
+        tableOptions->targetFileSize = KVParseIntOption(optionDef,
+                                                        GUC_UNIT_BYTE);
+    } else if (strcmp(name, "level_paths") == 0) {
+        KVParseLevelPaths(optionDef, tableOptions);
+    } else if (strcmp(name, "ttl") == 0) {
+        tableOptions->ttl = KVParseIntOption(optionDef, GUC_UNIT_S);
+    } else if (strcmp(name, "deletion_trigger") == 0) {
+        tableOptions->deletionTrigger = KVParseIntOption(optionDef, 0);
+    } else if (strcmp(name, "deletion_window") == 0) {
+        tableOptions->deletionWindow = KVParseIntOption(optionDef, 0);
+    } else if (strcmp(name, "cache_index_and_filter_blocks") == 0) {
+        if (!parse_bool(defGetString(optionDef),
+                        &tableOptions->cacheIndexAndFilterBlocks)) {
+            KVInvalidOptionValue(optionDef, NULL);
+        }
+    }
 }
 
 /*
- * Allocate or attach to shared memory while the module is enabled.
+ * Checks that the user may choose where the files of tables are written. Like
+ * the filename option of file_fdw, a path option lets its user write and
+ * remove files anywhere the server can, so it is only open to superusers and
+ * to the members of pg_write_server_files.
  */
-static void KVShmemStartup(void) {
-    printf("\n============KVShmemStartup=============\n");
-    if (PreviousShmemStartupHook) {
-        PreviousShmemStartupHook();
+static void KVCheckPathOption(DefElem *optionDef) {
+    if (!is_member_of_role(GetUserId(), DEFAULT_ROLE_WRITE_SERVER_FILES)) {
+        ereport(ERROR,
+                (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+                 errmsg("only superuser or a member of the "
+                        "pg_write_server_files role may specify the %s "
+                        "option of kv_fdw", optionDef->defname)));
     }
+}
 
-    /*
-     * If we're in the postmaster (or a standalone backend...), set up a shmem
-     * exit hook to release memory.
-     */
-    if (!IsUnderPostmaster) {
-        on_shmem_exit(KVShmemShutdown, (Datum) 0);
+/*
+ * Checks that the options are valid for the object they are given on, for
+ * kv_fdw_validator.
+ */
+static void KVValidateOptions(List *optionList, Oid optionContextId) {
+    KVTableOptions tableOptions;
+    memset(&tableOptions, 0, sizeof(tableOptions));
+
+    ListCell *optionCell = NULL;
+    foreach(optionCell, optionList) {
+        DefElem *optionDef = (DefElem *) lfirst(optionCell);
+
+        bool valid = false;
+        for (int index = 0; index < KV_VALID_OPTION_COUNT; index++) {
+            const KVValidOption *validOption = &KVValidOptions[index];
+            if (validOption->optionContextId == optionContextId &&
+                strcmp(validOption->optionName, optionDef->defname) == 0) {
+                valid = true;
+                break;
+            }
+        }
+
+        if (!valid) {
+            StringInfo validNames = makeStringInfo();
+            for (int index = 0; index < KV_VALID_OPTION_COUNT; index++) {
+                const KVValidOption *validOption = &KVValidOptions[index];
+                if (validOption->optionContextId == optionContextId) {
+                    appendStringInfo(validNames, "%s%s",
+                                     validNames->len > 0? ", ": "",
+                                     validOption->optionName);
+                }
+            }
+
+            ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_OPTION_NAME),
+                            errmsg("invalid option \"%s\"",
+                                   optionDef->defname),
+                            validNames->len > 0?
+                            errhint("Valid options in this context are: %s",
+                                    validNames->data):
+                            errhint("There are no valid options in this "
+                                    "context.")));
+        }
+
+        if (strcmp(optionDef->defname, "layout") == 0) {
+            KVParseEnumOption(optionDef, defGetString(optionDef),
+                              KVLayoutValues);
+        } else if (strcmp(optionDef->defname, "data_path") == 0) {
+            KVCheckPathOption(optionDef);
+            if (!is_absolute_path(defGetString(optionDef))) {
+                KVInvalidOptionValue(optionDef,
+                                     "The path must be an absolute path.");
+            }
+        } else if (strcmp(optionDef->defname, "tablespace") == 0) {
+            /* tables may be placed where they could be created */
+            char *tablespaceName = defGetString(optionDef);
+            Oid tablespaceId = get_tablespace_oid(tablespaceName, false);
+            AclResult aclResult = pg_tablespace_aclcheck(tablespaceId,
+                                                         GetUserId(),
+                                                         ACL_CREATE);
+            if (aclResult != ACLCHECK_OK) {
+                aclcheck_error(aclResult, OBJECT_TABLESPACE, tablespaceName);
+            }
+        } else {
+            if (strcmp(optionDef->defname, "level_paths") == 0) {
+                KVCheckPathOption(optionDef);
+            }
+            KVParseTableOption(optionDef, &tableOptions);
+        }
     }
 }
 
+/*
+ * Returns where the table is stored, with the options it is opened with.
+ * Tables keep the database they were created in, as the options deciding it
+ * can't change while the table exists. Tables sharing the database of their
+ * server take the options of the server.
+ */
+static FdwOptions *KVGetStorageOptions(Oid foreignTableId) {
+    ForeignTable *foreignTable = GetForeignTable(foreignTableId);
+    ForeignServer *foreignServer = GetForeignServer(foreignTable->serverid);
+
+    char *filename = KVGetOptionValue(foreignTableId, "filename");
+
+    /* set default filename if it is not provided */
+    if (filename == NULL) {
+        List *optionList = list_concat(list_copy(foreignTable->options),
+                                       foreignServer->options);
+        filename = KVDefaultFilePath(foreignTableId,
+                                     KVBaseDirectory(optionList));
+    }
+
+    StringInfo tablePath = makeStringInfo();
+    appendStringInfoString(tablePath, filename);
+    char *layout = KVGetOptionValue(foreignTableId, "layout");
+    if (layout != NULL && pg_strcasecmp(layout, "database") == 0 &&
+        !KVDirectoryExists(tablePath)) {
+        FdwOptions *options = KVGetServerStorageOptions(foreignServer);
+        options->family = psprintf("%u", foreignTableId);
+        return options;
+    }
+
+    FdwOptions *options = palloc0(sizeof(FdwOptions));
+    options->filename = filename;
+
+    /* server options come first, so that the table's own override them */
+    List *optionList = list_concat(list_copy(foreignServer->options),
+                                   foreignTable->options);
+
+    ListCell *optionCell = NULL;
+    foreach(optionCell, optionList) {
+        KVParseTableOption((DefElem *) lfirst(optionCell),
+                           &options->tableOptions);
+    }
+    KVResolveLevelPaths(options);
+
+    return options;
+}
+
+/*
+ * Returns the option values to be used when reading and writing
+ * the files. To resolve these values, the function checks options for the
+ * foreign table, and if not present, falls back to the options of its
+ * server and then to default values. This function errors out if given
+ * option values are considered invalid.
+ */
+static FdwOptions *KVGetOptions(Oid foreignTableId) {
+    FdwOptions *options = KVGetStorageOptions(foreignTableId);
+    ForeignTable *foreignTable = GetForeignTable(foreignTableId);
+
+    /* the column families of a database are all opened with one set of options */
+    if (options->family != NULL && foreignTable->options != NIL) {
+        ForeignServer *foreignServer = GetForeignServer(foreignTable->serverid);
+        ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_OPTION_NAME),
+                        errmsg("table \"%s\" can't have its own options",
+                               get_rel_name(foreignTableId)),
+                        errdetail("The tables of server \"%s\" share one "
+                                  "database.", foreignServer->servername),
+                        errhint("Set the options on the server instead.")));
+    }
+
+    return options;
+}
+
+/* Returns the phase timings of a new scan or modification, if enabled. */
+static KVTrace *KVTraceBegin(void) {
+    return KVTraceTiming? palloc0(sizeof(KVTrace)): NULL;
+}
+
+static inline void KVTraceStart(KVTrace *trace,
+                                KVTracePhase phase,
+                                instr_time *start) {
+    KV_PROBE_PHASE_START(phase);
+    if (trace) {
+        INSTR_TIME_SET_CURRENT(*start);
+    }
+}
+
+static inline void KVTraceDone(KVTrace *trace,
+                               KVTracePhase phase,
+                               instr_time *start) {
+    if (trace) {
+        instr_time end;
+        INSTR_TIME_SET_CURRENT(end);
+        INSTR_TIME_ACCUM_DIFF(trace->elapsed[phase], end, *start);
+        trace->calls[phase]++;
+    }
+    KV_PROBE_PHASE_DONE(phase);
+}
+
+/* Logs the time spent in the phases a scan or modification went through. */
+static void KVTraceReport(KVTrace *trace, const char *operation,
+                          Oid relationId) {
+    static const char *phaseNames[KV_PHASE_COUNT] = {
+        "open", "seek", "next", "get", "deserialize", "write"
+    };
+
+    StringInfo phases = makeStringInfo();
+    for (int phase = 0; phase < KV_PHASE_COUNT; phase++) {
+        if (trace->calls[phase] == 0) {
+            continue;
+        }
+        appendStringInfo(phases, "%s%s %.3f ms (" UINT64_FORMAT ")",
+                         phases->len > 0? ", ": "",
+                         phaseNames[phase],
+                         INSTR_TIME_GET_MILLISEC(trace->elapsed[phase]),
+                         trace->calls[phase]);
+    }
+
+    ereport(LOG, (errmsg("kv_fdw %s of \"%s\": %s", operation,
+                         get_rel_name(relationId), phases->data),
+                  errhidestmt(true)));
+}
+
+/*
+ * Reports a wait on RocksDB. PostgreSQL 11 doesn't let extensions name their
+ * wait events, so reads, writes and opens are all shown as Extension.
+ */
+void ReportWaitStart(void) {
+    pgstat_report_wait_start(PG_WAIT_EXTENSION);
+}
+
+void ReportWaitEnd(void) {
+    pgstat_report_wait_end();
+}
+
+/*
+ * Looks up the size estimates of the table in the shared statistics cache.
+ * Returns false if there is no cache or the table isn't in it. A NULL stats
+ * pointer only checks for the table.
+ */
+static bool KVLookupTableStats(Oid relationId, KVTableStats *stats) {
+    if (!KVStatsHash) {
+        return false;
+    }
+
+    KVStatsKey key;
+    memset(&key, 0, sizeof(key));
+    key.databaseId = MyDatabaseId;
+    key.relationId = relationId;
+
+    LWLockAcquire(KVShared->lock, LW_SHARED);
+    KVStatsEntry *entry = hash_search(KVStatsHash, &key, HASH_FIND, NULL);
+    if (entry && stats) {
+        *stats = entry->stats;
+    }
+    LWLockRelease(KVShared->lock);
+
+    return entry != NULL;
+}
+
+/*
+ * Stores the size estimates of the table in the shared statistics cache, if
+ * there is one. Tables that don't fit into the cache are left out.
+ */
+static void KVStoreTableStats(Oid relationId,
+                              const char *path,
+                              const char *family,
+                              bool refreshable,
+                              KVTableStats *stats) {
+    if (!KVStatsHash) {
+        return;
+    }
+
+    KVStatsKey key;
+    memset(&key, 0, sizeof(key));
+    key.databaseId = MyDatabaseId;
+    key.relationId = relationId;
+
+    LWLockAcquire(KVShared->lock, LW_EXCLUSIVE);
+    KVStatsEntry *entry = hash_search(KVStatsHash, &key, HASH_ENTER_NULL, NULL);
+    if (entry) {
+        strlcpy(entry->path, path, MAXPGPATH);
+        strlcpy(entry->family, family, NAMEDATALEN);
+        entry->refreshable = refreshable;
+        entry->stats = *stats;
+        entry->refreshTime = GetCurrentTimestamp();
+    }
+    LWLockRelease(KVShared->lock);
+}
+
+/*
+ * Returns the shared operation counters of the table, adding them if the
+ * table has none yet. Returns NULL if there are no shared counters, or no
+ * room for the table.
+ */
+static KVOpStats *KVGetOpStats(Oid relationId) {
+    if (!KVOpStatsHash) {
+        return NULL;
+    }
+
+    KVStatsKey key;
+    memset(&key, 0, sizeof(key));
+    key.databaseId = MyDatabaseId;
+    key.relationId = relationId;
+
+    LWLockAcquire(KVShared->lock, LW_SHARED);
+    KVOpStatsEntry *entry = hash_search(KVOpStatsHash, &key, HASH_FIND, NULL);
+    LWLockRelease(KVShared->lock);
+    if (entry) {
+        return &entry->stats;
+    }
+
+    bool found = false;
+    LWLockAcquire(KVShared->lock, LW_EXCLUSIVE);
+    entry = hash_search(KVOpStatsHash, &key, HASH_ENTER_NULL, &found);
+    if (entry && !found) {
+        memset(&entry->stats, 0, sizeof(entry->stats));
+    }
+    LWLockRelease(KVShared->lock);
+
+    return entry? &entry->stats: NULL;
+}
+
+/* Removes the operation counters of a dropped table. */
+static void KVRemoveOpStats(Oid relationId) {
+    if (!KVOpStatsHash) {
+        return;
+    }
+
+    KVStatsKey key;
+    memset(&key, 0, sizeof(key));
+    key.databaseId = MyDatabaseId;
+    key.relationId = relationId;
+
+    LWLockAcquire(KVShared->lock, LW_EXCLUSIVE);
+    hash_search(KVOpStatsHash, &key, HASH_REMOVE, NULL);
+    LWLockRelease(KVShared->lock);
+}
+
+static uint64 KVReadCounter(uint64 *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/* Builds the int8 array of a latency histogram. */
+static Datum KVLatencyArray(uint64 *buckets) {
+    Datum values[KV_LATENCY_BUCKETS];
+    for (int index = 0; index < KV_LATENCY_BUCKETS; index++) {
+        values[index] = Int64GetDatum((int64) KVReadCounter(&buckets[index]));
+    }
+
+    ArrayType *array = construct_array(values, KV_LATENCY_BUCKETS, INT8OID,
+                                       sizeof(int64), FLOAT8PASSBYVAL, 'd');
+    return PointerGetDatum(array);
+}
+
+static void KVCheckSharedStats(void) {
+    if (!KVOpStatsHash) {
+        ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                        errmsg("kv_fdw must be loaded via "
+                               "shared_preload_libraries")));
+    }
+}
+
+/*
+ * Sets up the tuplestore a set-returning function materializes its rows in,
+ * and returns it along with the descriptor of the rows.
+ */
+static Tuplestorestate *KVBeginMaterializedResult(FunctionCallInfo fcinfo,
+                                                  TupleDesc *tupleDescriptor) {
+    ReturnSetInfo *resultInfo = (ReturnSetInfo *) fcinfo->resultinfo;
+
+    if (resultInfo == NULL || !IsA(resultInfo, ReturnSetInfo) ||
+        !(resultInfo->allowedModes & SFRM_Materialize)) {
+        ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                        errmsg("set-valued function called in context that "
+                               "cannot accept a set")));
+    }
+
+    MemoryContext queryContext = resultInfo->econtext->ecxt_per_query_memory;
+    MemoryContext oldContext = MemoryContextSwitchTo(queryContext);
+
+    if (get_call_result_type(fcinfo, NULL, tupleDescriptor) !=
+        TYPEFUNC_COMPOSITE) {
+        ereport(ERROR, (errmsg("return type must be a row type")));
+    }
+
+    Tuplestorestate *tupleStore = tuplestore_begin_heap(true, false, work_mem);
+    resultInfo->returnMode = SFRM_Materialize;
+    resultInfo->setResult = tupleStore;
+    resultInfo->setDesc = *tupleDescriptor;
+
+    MemoryContextSwitchTo(oldContext);
+
+    return tupleStore;
+}
+
+#define KV_STAT_TABLES_COLS 15
+
+/*
+ * kv_stat_get_tables returns the operation counters and latency histograms
+ * of the tables of the current database, for the kv_stat_tables view.
+ */
+Datum kv_stat_get_tables(PG_FUNCTION_ARGS) {
+    KVCheckSharedStats();
+
+    TupleDesc tupleDescriptor = NULL;
+    Tuplestorestate *tupleStore = KVBeginMaterializedResult(fcinfo,
+                                                            &tupleDescriptor);
+
+    LWLockAcquire(KVShared->lock, LW_SHARED);
+
+    HASH_SEQ_STATUS status;
+    hash_seq_init(&status, KVOpStatsHash);
+
+    KVOpStatsEntry *entry = NULL;
+    while ((entry = hash_seq_search(&status)) != NULL) {
+        if (entry->key.databaseId != MyDatabaseId) {
+            continue;
+        }
+
+        KVOpStats *stats = &entry->stats;
+        Datum values[KV_STAT_TABLES_COLS];
+        bool nulls[KV_STAT_TABLES_COLS];
+        memset(nulls, 0, sizeof(nulls));
+
+        int column = 0;
+        values[column++] = ObjectIdGetDatum(entry->key.relationId);
+        values[column++] = Int64GetDatum(KVReadCounter(&stats->gets));
+        values[column++] = Int64GetDatum(KVReadCounter(&stats->multiGets));
+        values[column++] = Int64GetDatum(KVReadCounter(&stats->multiGetKeys));
+        values[column++] = Int64GetDatum(KVReadCounter(&stats->seeks));
+        values[column++] = Int64GetDatum(KVReadCounter(&stats->rowsScanned));
+        values[column++] = Int64GetDatum(KVReadCounter(&stats->puts));
+        values[column++] = Int64GetDatum(KVReadCounter(&stats->deletes));
+        values[column++] = Int64GetDatum(KVReadCounter(&stats->bytesRead));
+        values[column++] = Int64GetDatum(KVReadCounter(&stats->bytesWritten));
+        for (int op = 0; op < KV_OP_COUNT; op++) {
+            values[column++] = KVLatencyArray(stats->latency[op]);
+        }
+
+        tuplestore_putvalues(tupleStore, tupleDescriptor, values, nulls);
+    }
+
+    LWLockRelease(KVShared->lock);
+
+    tuplestore_donestoring(tupleStore);
+
+    return (Datum) 0;
+}
+
+/*
+ * kv_stat_reset zeroes the operation counters of all tables of the current
+ * database. Calls running concurrently may still be counted.
+ */
+Datum kv_stat_reset(PG_FUNCTION_ARGS) {
+    KVCheckSharedStats();
+
+    LWLockAcquire(KVShared->lock, LW_SHARED);
+
+    HASH_SEQ_STATUS status;
+    hash_seq_init(&status, KVOpStatsHash);
+
+    KVOpStatsEntry *entry = NULL;
+    while ((entry = hash_seq_search(&status)) != NULL) {
+        if (entry->key.databaseId != MyDatabaseId) {
+            continue;
+        }
+
+        uint64 *counters = (uint64 *) &entry->stats;
+        int count = sizeof(KVOpStats) / sizeof(uint64);
+        for (int index = 0; index < count; index++) {
+            __atomic_store_n(&counters[index], 0, __ATOMIC_RELAXED);
+        }
+    }
+
+    LWLockRelease(KVShared->lock);
+
+    PG_RETURN_VOID();
+}
+
+/*
+ * Closes the databases left open by scans and modifications that failed,
+ * since their end callbacks are not called on error. For the same reason,
+ * stops collecting the engine counters they enabled.
+ */
+static void KVHandleXactCallback(XactEvent event, void *arg) {
+    if (event != XACT_EVENT_ABORT && event != XACT_EVENT_PARALLEL_ABORT) {
+        return;
+    }
+
+    ResetPerfCounters();
+
+    /* closing the databases drops the writes of the failed statements */
+    list_free_deep(KVWriters);
+    KVWriters = NIL;
+    list_free_deep(KVHandleRefs);
+    KVHandleRefs = NIL;
+
+    HASH_SEQ_STATUS status;
+    hash_seq_init(&status, KVHandleHash);
+
+    /* the locks of shared databases are held by the session */
+    KVHandleEntry *entry = NULL;
+    while ((entry = hash_seq_search(&status)) != NULL) {
+        KVCloseTable(entry->db, entry->serverId);
+        hash_search(KVHandleHash, &entry->relationId, HASH_REMOVE, NULL);
+    }
+}
+
+static void KVReleaseHandle(Oid relationId, bool refreshStats);
+
+/*
+ * Undoes the writes of the statements that failed in an aborted
+ * subtransaction, latest first, and releases the databases they and the
+ * failed scans held. Those of a committed subtransaction are handed over to
+ * its parent.
+ */
+static void KVHandleSubXactCallback(SubXactEvent event,
+                                    SubTransactionId mySubid,
+                                    SubTransactionId parentSubid,
+                                    void *arg) {
+    if (event != SUBXACT_EVENT_ABORT_SUB && event != SUBXACT_EVENT_COMMIT_SUB) {
+        return;
+    }
+
+    List *aborted = NIL;
+    List *remaining = NIL;
+    ListCell *writerCell = NULL;
+    foreach(writerCell, KVWriters) {
+        KVWriter *writer = lfirst(writerCell);
+        if (writer->subId != mySubid) {
+            remaining = lappend(remaining, writer);
+        } else if (event == SUBXACT_EVENT_COMMIT_SUB) {
+            writer->subId = parentSubid;
+            remaining = lappend(remaining, writer);
+        } else {
+            aborted = lcons(writer, aborted);
+        }
+    }
+
+    MemoryContext oldContext = MemoryContextSwitchTo(TopMemoryContext);
+    List *writers = list_copy(remaining);
+    MemoryContextSwitchTo(oldContext);
+
+    list_free(KVWriters);
+    list_free(remaining);
+    KVWriters = writers;
+
+    foreach(writerCell, aborted) {
+        KVWriter *writer = lfirst(writerCell);
+        AbortWrites(writer->db);
+        pfree(writer);
+    }
+    list_free(aborted);
+
+    /* the end callbacks of the failed statements won't release them */
+    aborted = NIL;
+    remaining = NIL;
+    ListCell *refCell = NULL;
+    foreach(refCell, KVHandleRefs) {
+        KVHandleRef *ref = lfirst(refCell);
+        if (ref->subId != mySubid) {
+            remaining = lappend(remaining, ref);
+        } else if (event == SUBXACT_EVENT_COMMIT_SUB) {
+            ref->subId = parentSubid;
+            remaining = lappend(remaining, ref);
+        } else {
+            aborted = lappend(aborted, ref);
+        }
+    }
+
+    oldContext = MemoryContextSwitchTo(TopMemoryContext);
+    List *refs = list_copy(remaining);
+    MemoryContextSwitchTo(oldContext);
+
+    list_free(KVHandleRefs);
+    list_free(remaining);
+    KVHandleRefs = refs;
+
+    foreach(refCell, aborted) {
+        KVHandleRef *ref = lfirst(refCell);
+        KVReleaseHandle(ref->relationId, false);
+        pfree(ref);
+    }
+    list_free(aborted);
+}
+
+/*
+ * Opens the database of the table, or returns the handle this backend has
+ * already opened. Each call must be paired with a call to KVReleaseDB.
+ */
+static void *KVAcquireDB(Oid relationId) {
+    if (!KVHandleHash) {
+        HASHCTL info;
+        memset(&info, 0, sizeof(info));
+        info.keysize = sizeof(Oid);
+        info.entrysize = sizeof(KVHandleEntry);
+        info.hcxt = TopMemoryContext;
+        KVHandleHash = hash_create("kv_fdw handles", 16, &info,
+                                   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+        RegisterXactCallback(KVHandleXactCallback, NULL);
+        RegisterSubXactCallback(KVHandleSubXactCallback, NULL);
+    }
+
+    KVHandleEntry *entry = hash_search(KVHandleHash, &relationId, HASH_FIND,
+                                       NULL);
+    if (!entry) {
+        FdwOptions *fdwOptions = KVGetOptions(relationId);
+        KVSetEngineOptions();
+        void *db = KVOpenTable(relationId, fdwOptions);
+
+        /* rows written without their write time can never expire */
+        if (fdwOptions->tableOptions.ttl > 0 && !ExpiresRows(db)) {
+            KVCloseTable(db, fdwOptions->serverId);
+            ereport(ERROR,
+                    (errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+                     errmsg("rows of table \"%s\" can't expire",
+                            get_rel_name(relationId)),
+                     errdetail("The table had rows before the ttl option "
+                               "was set."),
+                     errhint("Set the ttl option when the table is created, "
+                             "or remove it.")));
+        }
+        SetOpStats(db, KVGetOpStats(relationId));
+
+        entry = hash_search(KVHandleHash, &relationId, HASH_ENTER, NULL);
+        entry->db = db;
+        entry->serverId = fdwOptions->serverId;
+        entry->refCount = 0;
+        entry->refreshStats = false;
+        strlcpy(entry->path, fdwOptions->filename, MAXPGPATH);
+        strlcpy(entry->family,
+                fdwOptions->family != NULL? fdwOptions->family: "",
+                NAMEDATALEN);
+        entry->refreshable = fdwOptions->tableOptions.levelPathCount == 0;
+    }
+
+    entry->refCount++;
+
+    KVHandleRef *ref = MemoryContextAlloc(TopMemoryContext,
+                                          sizeof(KVHandleRef));
+    ref->relationId = relationId;
+    ref->subId = GetCurrentSubTransactionId();
+
+    MemoryContext oldContext = MemoryContextSwitchTo(TopMemoryContext);
+    KVHandleRefs = lappend(KVHandleRefs, ref);
+    MemoryContextSwitchTo(oldContext);
+
+    return entry->db;
+}
+
+/*
+ * Gets the memory RocksDB uses in this backend: the shared block cache and
+ * memtables, and the table readers of the tables it has open. Returns the
+ * number of open tables.
+ */
+static uint32 KVGetMemoryUsage(KVMemoryUsage *usage) {
+    long tableCount = KVHandleHash? hash_get_num_entries(KVHandleHash): 0;
+    void **dbs = palloc0(Max(tableCount, 1) * sizeof(void *));
+
+    uint32 count = 0;
+    if (KVHandleHash) {
+        HASH_SEQ_STATUS status;
+        hash_seq_init(&status, KVHandleHash);
+
+        KVHandleEntry *entry = NULL;
+        while ((entry = hash_seq_search(&status)) != NULL) {
+            dbs[count++] = entry->db;
+        }
+    }
+
+    GetMemoryUsage(count, dbs, usage);
+    pfree(dbs);
+
+    return count;
+}
+
+/*
+ * Logs the memory RocksDB uses for the tables this backend has open, if it
+ * exceeds kv_fdw.log_memory_usage_min. Each database has its own memtables
+ * and table readers, so the usage grows with the number of open tables.
+ */
+static void KVLogMemoryUsage(void) {
+    KVMemoryUsage usage;
+    uint32 count = KVGetMemoryUsage(&usage);
+
+    uint64 total = usage.memtables + usage.tableReaders + usage.blockCache;
+    if (total / 1024 < (uint64) KVLogMemoryUsageMin) {
+        return;
+    }
+
+    ereport(LOG, (errmsg("kv_fdw uses " UINT64_FORMAT " kB of memory for %u "
+                         "open tables", total / 1024, count),
+                  errdetail("memtables " UINT64_FORMAT " kB, table readers "
+                            UINT64_FORMAT " kB, block cache " UINT64_FORMAT
+                            " kB (" UINT64_FORMAT " kB pinned)",
+                            usage.memtables / 1024,
+                            usage.tableReaders / 1024,
+                            usage.blockCache / 1024,
+                            usage.blockCachePinned / 1024),
+                  errhidestmt(true)));
+}
+
+/*
+ * Releases a handle returned by KVAcquireDB. Callers that have written to
+ * the table ask for its statistics to be refreshed, which happens when the
+ * last reference is released, just before the database is closed.
+ */
+static void KVReleaseDB(Oid relationId, bool refreshStats) {
+    /* the latest reference to the table is the one of this subtransaction */
+    ListCell *refCell = NULL;
+    ListCell *previousCell = NULL;
+    ListCell *releasedCell = NULL;
+    ListCell *releasedPrevious = NULL;
+    foreach(refCell, KVHandleRefs) {
+        KVHandleRef *ref = lfirst(refCell);
+        if (ref->relationId == relationId) {
+            releasedCell = refCell;
+            releasedPrevious = previousCell;
+        }
+        previousCell = refCell;
+    }
+
+    if (releasedCell) {
+        KVHandleRef *ref = lfirst(releasedCell);
+        KVHandleRefs = list_delete_cell(KVHandleRefs, releasedCell,
+                                        releasedPrevious);
+        pfree(ref);
+    }
+
+    KVReleaseHandle(relationId, refreshStats);
+}
+
+/* Drops a reference to the handle, closing it if it was the last one. */
+static void KVReleaseHandle(Oid relationId, bool refreshStats) {
+    KVHandleEntry *entry = NULL;
+    if (KVHandleHash) {
+        entry = hash_search(KVHandleHash, &relationId, HASH_FIND, NULL);
+    }
+    if (!entry) {
+        return;
+    }
+
+    entry->refreshStats |= refreshStats;
+    if (--entry->refCount > 0) {
+        return;
+    }
+
+    if (entry->refreshStats) {
+        KVTableStats stats;
+        GetTableStats(entry->db, &stats);
+        KVStoreTableStats(relationId, entry->path, entry->family,
+                          entry->refreshable, &stats);
+    }
+
+    if (KVLogMemoryUsageMin >= 0) {
+        KVLogMemoryUsage();
+    }
+
+    KVCloseTable(entry->db, entry->serverId);
+    hash_search(KVHandleHash, &relationId, HASH_REMOVE, NULL);
+}
+
+/*
+ * Starts collecting the writes of a statement modifying the table. They are
+ * written, together with those of the other statements modifying tables of
+ * the same database, when the last of them calls KVEndWrites.
+ */
+static void KVBeginWrites(Oid relationId, void *db) {
+    KVWriter *writer = MemoryContextAlloc(TopMemoryContext, sizeof(KVWriter));
+    writer->relationId = relationId;
+    writer->db = db;
+    writer->subId = GetCurrentSubTransactionId();
+
+    MemoryContext oldContext = MemoryContextSwitchTo(TopMemoryContext);
+    KVWriters = lappend(KVWriters, writer);
+    MemoryContextSwitchTo(oldContext);
+
+    BeginWrites(db);
+}
+
+static void KVEndWrites(Oid relationId, void *db) {
+    ListCell *writerCell = NULL;
+    ListCell *previousCell = NULL;
+    foreach(writerCell, KVWriters) {
+        KVWriter *writer = lfirst(writerCell);
+        if (writer->relationId == relationId && writer->db == db) {
+            KVWriters = list_delete_cell(KVWriters, writerCell, previousCell);
+            pfree(writer);
+            break;
+        }
+        previousCell = writerCell;
+    }
+
+    if (!EndWrites(db)) {
+        ereport(ERROR, (errmsg("could not write the rows of table \"%s\"",
+                               get_rel_name(relationId))));
+    }
+}
+
+/*
+ * Opens the table for reading without taking the lock of its database, so
+ * that it can be inspected while other backends write it.
+ */
+static void *KVOpenTableForReadOnly(Oid relationId) {
+    FdwOptions *fdwOptions = KVGetOptions(relationId);
+    KVSetEngineOptions();
+    void *db = OpenForReadOnly(fdwOptions->filename, fdwOptions->family,
+                               &fdwOptions->tableOptions);
+    if (db == NULL) {
+        ereport(ERROR, (errmsg("could not open table \"%s\" for reading",
+                               get_rel_name(relationId))));
+    }
+
+    return db;
+}
+
+/*
+ * Returns the size estimates of the table for the planner. They are read
+ * from the shared statistics cache. When the table isn't cached yet, or
+ * there is no cache, they come from the database this backend has open, or
+ * else from the database opened read-only, so that planning never takes the
+ * lock of a database another backend writes.
+ */
+static void KVGetTableStats(Oid relationId, KVTableStats *stats) {
+    if (KVLookupTableStats(relationId, stats)) {
+        return;
+    }
+
+    KVHandleEntry *entry = NULL;
+    if (KVHandleHash) {
+        entry = hash_search(KVHandleHash, &relationId, HASH_FIND, NULL);
+    }
+    if (entry) {
+        GetTableStats(entry->db, stats);
+        KVStoreTableStats(relationId, entry->path, entry->family,
+                          entry->refreshable, stats);
+        return;
+    }
+
+    FdwOptions *fdwOptions = KVGetOptions(relationId);
+    void *db = KVOpenTableForReadOnly(relationId);
+    GetTableStats(db, stats);
+    Close(db);
+
+    KVStoreTableStats(relationId, fdwOptions->filename,
+                      fdwOptions->family != NULL? fdwOptions->family: "",
+                      fdwOptions->tableOptions.levelPathCount == 0, stats);
+}
+
+/* Errors out if the relation is not a kv_fdw table. */
+static void KVCheckTable(Oid relationId) {
+    if (!KVTable(relationId)) {
+        ereport(ERROR, (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                        errmsg("\"%s\" is not a kv_fdw table",
+                               get_rel_name(relationId))));
+    }
+}
+
+#define KV_ROCKSDB_PROPERTIES_COLS 2
+
+/*
+ * kv_rocksdb_properties returns the RocksDB properties of the table, such as
+ * rocksdb.stats, the files per level, the pending compaction bytes, the
+ * memtable and block cache usage, and the write stall counters.
+ */
+Datum kv_rocksdb_properties(PG_FUNCTION_ARGS) {
+    Oid relationId = PG_GETARG_OID(0);
+    KVCheckTable(relationId);
+
+    TupleDesc tupleDescriptor = NULL;
+    Tuplestorestate *tupleStore = KVBeginMaterializedResult(fcinfo,
+                                                            &tupleDescriptor);
+
+    char **names = NULL;
+    char **values = NULL;
+    void *db = KVOpenTableForReadOnly(relationId);
+    uint32 count = GetProperties(db, &names, &values);
+    Close(db);
+
+    for (uint32 index = 0; index < count; index++) {
+        Datum columns[KV_ROCKSDB_PROPERTIES_COLS];
+        bool nulls[KV_ROCKSDB_PROPERTIES_COLS];
+        memset(nulls, 0, sizeof(nulls));
+
+        columns[0] = CStringGetTextDatum(names[index]);
+        columns[1] = CStringGetTextDatum(values[index]);
+
+        tuplestore_putvalues(tupleStore, tupleDescriptor, columns, nulls);
+    }
+
+    tuplestore_donestoring(tupleStore);
+
+    return (Datum) 0;
+}
+
+#define KV_ROCKSDB_STATS_COLS 7
+
+/*
+ * kv_rocksdb_stats returns the tickers and histograms of the RocksDB
+ * statistics of the table. The statistics are kept by each backend for the
+ * tables it opens, so they only cover the work of the calling backend.
+ */
+Datum kv_rocksdb_stats(PG_FUNCTION_ARGS) {
+    Oid relationId = PG_GETARG_OID(0);
+    KVCheckTable(relationId);
+
+    TupleDesc tupleDescriptor = NULL;
+    Tuplestorestate *tupleStore = KVBeginMaterializedResult(fcinfo,
+                                                            &tupleDescriptor);
+
+    KVStatistic *statistics = NULL;
+    void *db = KVOpenTableForReadOnly(relationId);
+    uint32 count = GetStatistics(db, &statistics);
+    Close(db);
+
+    for (uint32 index = 0; index < count; index++) {
+        KVStatistic *statistic = &statistics[index];
+        Datum columns[KV_ROCKSDB_STATS_COLS];
+        bool nulls[KV_ROCKSDB_STATS_COLS];
+        memset(nulls, 0, sizeof(nulls));
+
+        columns[0] = CStringGetTextDatum(statistic->name);
+        columns[1] = Int64GetDatum((int64) statistic->count);
+        if (statistic->isHistogram) {
+            columns[2] = Int64GetDatum((int64) statistic->sum);
+            columns[3] = Float8GetDatum(statistic->median);
+            columns[4] = Float8GetDatum(statistic->p95);
+            columns[5] = Float8GetDatum(statistic->p99);
+            columns[6] = Float8GetDatum(statistic->max);
+        } else {
+            for (int column = 2; column < KV_ROCKSDB_STATS_COLS; column++) {
+                nulls[column] = true;
+            }
+        }
+
+        tuplestore_putvalues(tupleStore, tupleDescriptor, columns, nulls);
+    }
+
+    tuplestore_donestoring(tupleStore);
+
+    return (Datum) 0;
+}
+
+#define KV_MEMORY_USAGE_COLS 6
+
+/*
+ * kv_memory_usage returns the memory RocksDB uses in the calling backend:
+ * the memtables and block cache its tables share, and the table readers of
+ * the tables it has open, which are not accounted for in the memory contexts
+ * of PostgreSQL.
+ */
+Datum kv_memory_usage(PG_FUNCTION_ARGS) {
+    TupleDesc tupleDescriptor = NULL;
+    if (get_call_result_type(fcinfo, NULL, &tupleDescriptor) !=
+        TYPEFUNC_COMPOSITE) {
+        ereport(ERROR, (errmsg("return type must be a row type")));
+    }
+
+    KVMemoryUsage usage;
+    KVGetMemoryUsage(&usage);
+
+    Datum columns[KV_MEMORY_USAGE_COLS];
+    bool nulls[KV_MEMORY_USAGE_COLS];
+    memset(nulls, 0, sizeof(nulls));
+
+    columns[0] = Int64GetDatum((int64) usage.memtables);
+    columns[1] = Int64GetDatum((int64) usage.unflushedMemtables);
+    columns[2] = Int64GetDatum((int64) usage.tableReaders);
+    columns[3] = Int64GetDatum((int64) usage.blockCache);
+    columns[4] = Int64GetDatum((int64) usage.blockCachePinned);
+    columns[5] = Int64GetDatum((int64) (usage.memtables + usage.tableReaders +
+                                        usage.blockCache));
+
+    HeapTuple tuple = heap_form_tuple(tupleDescriptor, columns, nulls);
+    PG_RETURN_DATUM(HeapTupleGetDatum(tuple));
+}
+
+/*
+ * kv_truncate deletes all the rows of the table and returns their number.
+ * They are removed with a single range deletion rather than row by row, and
+ * their files are compacted away in the background. The deletion is written
+ * at once, and isn't undone if the transaction aborts.
+ */
+Datum kv_truncate(PG_FUNCTION_ARGS) {
+    Oid relationId = PG_GETARG_OID(0);
+
+    /*
+     * Like TRUNCATE, waits for the statements using the table. The lock is
+     * taken before the checks, so that the table can't be dropped or altered
+     * between them and the deletion.
+     */
+    LockRelationOid(relationId, AccessExclusiveLock);
+    if (!SearchSysCacheExists1(RELOID, ObjectIdGetDatum(relationId))) {
+        ereport(ERROR, (errcode(ERRCODE_UNDEFINED_TABLE),
+                        errmsg("relation with OID %u does not exist",
+                               relationId)));
+    }
+    KVCheckTable(relationId);
+
+    AclResult aclResult = pg_class_aclcheck(relationId, GetUserId(),
+                                            ACL_TRUNCATE);
+    if (aclResult != ACLCHECK_OK) {
+        aclcheck_error(aclResult, OBJECT_FOREIGN_TABLE,
+                       get_rel_name(relationId));
+    }
+
+    uint64 count = 0;
+    void *db = KVAcquireDB(relationId);
+    bool truncated = Truncate(db, &count);
+    KVReleaseDB(relationId, true);
+
+    if (!truncated) {
+        ereport(ERROR, (errmsg("could not truncate table \"%s\"",
+                               get_rel_name(relationId))));
+    }
+
+    PG_RETURN_INT64((int64) count);
+}
+
+/*
+ * Refreshes the size estimates of every table in the shared statistics
+ * cache. The databases are opened read-only, which doesn't conflict with a
+ * backend that has them open for writing. Tables whose data directory is
+ * gone have been dropped, and are removed from the cache.
+ */
+static void KVRefreshAllTableStats(void) {
+    LWLockAcquire(KVShared->lock, LW_SHARED);
+
+    long entryCount = hash_get_num_entries(KVStatsHash);
+    KVStatsEntry *entries = palloc0(Max(entryCount, 1) * sizeof(KVStatsEntry));
+
+    HASH_SEQ_STATUS status;
+    hash_seq_init(&status, KVStatsHash);
+
+    long count = 0;
+    KVStatsEntry *entry = NULL;
+    while ((entry = hash_seq_search(&status)) != NULL) {
+        if (count < entryCount) {
+            entries[count++] = *entry;
+        }
+    }
+
+    LWLockRelease(KVShared->lock);
+
+    for (long index = 0; index < count && !KVRefresherGotSigterm; index++) {
+        KVStatsEntry *cached = &entries[index];
+
+        struct stat pathStat;
+        bool exists = stat(cached->path, &pathStat) == 0;
+        char *family = cached->family[0] != '\0'? cached->family: NULL;
+
+        /*
+         * Opening a table whose files are spread over level paths requires
+         * its options, which are in the catalogs of its database. These
+         * tables are only refreshed by the backends using them.
+         */
+        if (exists && !cached->refreshable) {
+            continue;
+        }
+
+        KVTableStats stats;
+        KVSetEngineOptions();
+        void *db = exists? OpenForReadOnly(cached->path, family, NULL): NULL;
+        if (db) {
+            GetTableStats(db, &stats);
+            Close(db);
+        } else if (family != NULL) {
+            /* the column family of a dropped table is gone */
+            exists = false;
+        }
+
+        LWLockAcquire(KVShared->lock, LW_EXCLUSIVE);
+        entry = hash_search(KVStatsHash, &cached->key, HASH_FIND, NULL);
+        if (entry && !exists) {
+            hash_search(KVStatsHash, &cached->key, HASH_REMOVE, NULL);
+        } else if (entry && db) {
+            entry->stats = stats;
+            entry->refreshTime = GetCurrentTimestamp();
+        }
+        LWLockRelease(KVShared->lock);
+    }
+}
+
+static void KVRefresherSigterm(SIGNAL_ARGS) {
+    int savedErrno = errno;
+
+    KVRefresherGotSigterm = true;
+    SetLatch(MyLatch);
+
+    errno = savedErrno;
+}
+
+static void KVRefresherSighup(SIGNAL_ARGS) {
+    int savedErrno = errno;
+
+    KVRefresherGotSighup = true;
+    SetLatch(MyLatch);
+
+    errno = savedErrno;
+}
+
+/*
+ * Main loop of the statistics refresher, which refreshes the shared table
+ * statistics every kv_fdw.stats_refresh_interval seconds, so that the
+ * estimates of tables that are only written by other means stay current.
+ */
+void KVStatsRefresherMain(Datum arg) {
+    pqsignal(SIGTERM, KVRefresherSigterm);
+    pqsignal(SIGHUP, KVRefresherSighup);
+    BackgroundWorkerUnblockSignals();
+
+    MemoryContext refreshContext = AllocSetContextCreate(TopMemoryContext,
+                                                         "kv_fdw refresher",
+                                                         ALLOCSET_DEFAULT_SIZES);
+
+    while (!KVRefresherGotSigterm) {
+        int events = WL_LATCH_SET | WL_POSTMASTER_DEATH;
+        if (KVStatsRefreshInterval > 0) {
+            events |= WL_TIMEOUT;
+        }
+
+        int rc = WaitLatch(MyLatch, events, KVStatsRefreshInterval * 1000L,
+                           PG_WAIT_EXTENSION);
+        ResetLatch(MyLatch);
+
+        if (rc & WL_POSTMASTER_DEATH) {
+            proc_exit(1);
+        }
+
+        if (KVRefresherGotSighup) {
+            KVRefresherGotSighup = false;
+            ProcessConfigFile(PGC_SIGHUP);
+        }
+
+        if ((rc & WL_TIMEOUT) && !KVRefresherGotSigterm) {
+            MemoryContext oldContext = MemoryContextSwitchTo(refreshContext);
+            KVRefreshAllTableStats();
+            MemoryContextSwitchTo(oldContext);
+            MemoryContextReset(refreshContext);
+        }
+    }
+
+    proc_exit(0);
+}
+
+/* Registers the statistics refresher with the postmaster. */
+static void KVRegisterStatsRefresher(void) {
+    BackgroundWorker worker;
+    memset(&worker, 0, sizeof(worker));
+
+    worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+    worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+    worker.bgw_restart_time = 60;
+    snprintf(worker.bgw_library_name, BGW_MAXLEN, KV_FDW_NAME);
+    snprintf(worker.bgw_function_name, BGW_MAXLEN, "KVStatsRefresherMain");
+    snprintf(worker.bgw_name, BGW_MAXLEN, "kv_fdw statistics refresher");
+    snprintf(worker.bgw_type, BGW_MAXLEN, "kv_fdw statistics refresher");
+
+    RegisterBackgroundWorker(&worker);
+}
+
+/* Estimates the shared memory needed by the statistics hashes. */
+static Size KVShmemSize(void) {
+    Size size = MAXALIGN(sizeof(KVSharedState));
+    size = add_size(size, hash_estimate_size(KV_STATS_MAX_TABLES,
+                                             sizeof(KVStatsEntry)));
+    size = add_size(size, hash_estimate_size(KV_STATS_MAX_TABLES,
+                                             sizeof(KVOpStatsEntry)));
+
+    return size;
+}
+
+/*
+ * Allocate or attach to shared memory while the module is enabled.
+ */
+static void KVShmemStartup(void) {
+    if (PreviousShmemStartupHook) {
+        PreviousShmemStartupHook();
+    }
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+    bool found = false;
+    KVShared = ShmemInitStruct(KV_FDW_NAME, sizeof(KVSharedState), &found);
+    if (!found) {
+        KVShared->lock = &(GetNamedLWLockTranche(KV_FDW_NAME))->lock;
+    }
+
+    HASHCTL info;
+    memset(&info, 0, sizeof(info));
+    info.keysize = sizeof(KVStatsKey);
+    info.entrysize = sizeof(KVStatsEntry);
+    KVStatsHash = ShmemInitHash("kv_fdw table statistics",
+                                KV_STATS_MAX_TABLES,
+                                KV_STATS_MAX_TABLES,
+                                &info,
+                                HASH_ELEM | HASH_BLOBS);
+
+    memset(&info, 0, sizeof(info));
+    info.keysize = sizeof(KVStatsKey);
+    info.entrysize = sizeof(KVOpStatsEntry);
+    KVOpStatsHash = ShmemInitHash("kv_fdw operation statistics",
+                                  KV_STATS_MAX_TABLES,
+                                  KV_STATS_MAX_TABLES,
+                                  &info,
+                                  HASH_ELEM | HASH_BLOBS);
+
+    LWLockRelease(AddinShmemInitLock);
+}
+
 #endif /* _UTILITY_H_ */
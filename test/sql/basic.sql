@@ -3,6 +3,7 @@
 --
 
 CREATE FOREIGN TABLE test(key TEXT, value TEXT) SERVER kv_server;  
+ALTER FOREIGN TABLE test OPTIONS (ADD data_path '/tmp/kv');  
 
 INSERT INTO test VALUES('YC', 'VidarDB');  
 SELECT * FROM test;  
@@ -10,10 +11,168 @@ SELECT * FROM test;
 INSERT INTO test VALUES('California', 'Waterloo');  
 SELECT * FROM test;  
 
+SELECT * FROM test WHERE key IN ('YC', 'California', 'Toronto', 'YC');  
+SELECT DISTINCT left(key, 1) FROM test ORDER BY 1;  
+CREATE FOREIGN TABLE prefixes(key TEXT, value TEXT) SERVER kv_server;  
+INSERT INTO prefixes VALUES('ab', '1'), ('abc', '2'), ('abcd', '3'), ('b', '4');  
+SELECT DISTINCT left(key, 3) FROM prefixes ORDER BY 1;  
+DROP FOREIGN TABLE prefixes;  
+CREATE FOREIGN TABLE copied(key TEXT, value TEXT) SERVER kv_server;  
+COPY copied FROM STDIN;  
+YC	VidarDB
+California	Waterloo
+\.
+SELECT * FROM copied;  
+SELECT count(*) FROM copied;  
+DROP FOREIGN TABLE copied;  
+SELECT * FROM test WHERE key > 'D' COLLATE "C";  
+PREPARE lookup(text) AS SELECT * FROM test WHERE key = $1;  
+EXECUTE lookup('YC');  
+EXECUTE lookup('Toronto');  
+DEALLOCATE lookup;  
+EXPLAIN (COSTS OFF) SELECT * FROM test WHERE key IN ('YC', 'California');  
+ANALYZE test;  
+SELECT count(*) FROM test;  
+SELECT (SELECT count(*) FROM kv_rocksdb_properties('test')) > 0 AS properties, (SELECT count(*) FROM kv_rocksdb_stats('test')) > 0 AS stats;  
+SELECT block_cache > 0 AS block_cache, memtables + table_readers + block_cache = total AS total FROM kv_memory_usage();  
+SELECT (SELECT memtables FROM kv_memory_usage()) > 0 AS memtables FROM test LIMIT 1;  
+
 DELETE FROM test WHERE key='California';  
 SELECT * FROM test;  
 
 UPDATE test SET value='VidarSQL';  
 SELECT * FROM test;  
+SELECT count(*) FROM test;  
+
+INSERT INTO test VALUES('A1', 'Toronto'), ('A2', 'Waterloo'), ('B1', 'Vancouver');  
+DELETE FROM test WHERE key >= 'A' COLLATE "C" AND key < 'B' COLLATE "C";  
+SELECT * FROM test;  
+EXPLAIN (COSTS OFF) UPDATE test SET value = 'Victoria' WHERE key = 'B1';  
+UPDATE test SET value = 'Victoria' WHERE key = 'B1';  
+UPDATE test SET value = 'Victoria' WHERE key = 'B2';  
+SELECT * FROM test;  
+CREATE FOREIGN TABLE wide(key TEXT, a INT, b TEXT, c INT) SERVER kv_server;  
+INSERT INTO wide VALUES('k1', 1, 'one', 10), ('k2', 2, NULL, 20), ('k3', 3, 'three', 30);  
+UPDATE wide SET b = NULL WHERE key = 'k1';  
+UPDATE wide SET b = 'two' WHERE key = 'k2';  
+EXPLAIN (COSTS OFF) UPDATE wide SET a = NULL, c = 33 WHERE key IN ('k3', 'k4');  
+UPDATE wide SET a = NULL, c = 33 WHERE key IN ('k3', 'k4');  
+SELECT * FROM wide;  
+EXPLAIN (COSTS OFF) DELETE FROM wide WHERE key = 'k2';  
+DELETE FROM wide WHERE key = 'k2';  
+DELETE FROM wide WHERE key IN ('k2', 'k5');  
+SELECT * FROM wide;  
+DROP FOREIGN TABLE wide;  
+CREATE FOREIGN TABLE savepoints(key TEXT, value TEXT) SERVER kv_server;  
+BEGIN;  
+INSERT INTO savepoints VALUES('a', 'kept');  
+SAVEPOINT failing;  
+INSERT INTO savepoints VALUES('b', 'lost'), ('c', (SELECT 1 / count(*) FROM savepoints WHERE key = 'z')::text);  
+ROLLBACK TO SAVEPOINT failing;  
+INSERT INTO savepoints VALUES('d', 'kept');  
+COMMIT;  
+SELECT * FROM savepoints;  
+DROP FOREIGN TABLE savepoints;  
+CREATE FOREIGN TABLE counters(key BIGINT, value TEXT) SERVER kv_server;  
+INSERT INTO counters VALUES(1, 'one'), (2, 'two'), (3, 'three'), (5000000000, 'big');  
+EXPLAIN (COSTS OFF) SELECT * FROM counters WHERE key = 2;  
+SELECT * FROM counters WHERE key = 2;  
+EXPLAIN (COSTS OFF) SELECT * FROM counters WHERE key = ANY(ARRAY[1, 3]);  
+SELECT * FROM counters WHERE key = ANY(ARRAY[1, 3]);  
+SELECT * FROM counters WHERE key >= 2 AND key < 4;  
+CREATE TABLE orders(id INT, counter BIGINT);  
+INSERT INTO orders VALUES(1, 2), (2, 4), (3, NULL), (4, 5000000000), (5, 2);  
+ANALYZE orders;  
+EXPLAIN (COSTS OFF) SELECT o.id, c.value FROM orders o JOIN counters c ON c.key = o.counter;  
+SELECT o.id, c.value FROM orders o JOIN counters c ON c.key = o.counter ORDER BY o.id;  
+EXPLAIN (COSTS OFF) SELECT o.id, c.value FROM orders o LEFT JOIN counters c ON c.key = o.counter AND c.value <> 'two';  
+SELECT o.id, c.value FROM orders o LEFT JOIN counters c ON c.key = o.counter AND c.value <> 'two' ORDER BY o.id;  
+DROP TABLE orders;  
+DROP FOREIGN TABLE counters;  
+CREATE FOREIGN TABLE small(key INT, value TEXT) SERVER kv_server;  
+INSERT INTO small VALUES(1, 'one'), (2, 'two'), (2147483647, 'max');  
+PREPARE lookup_small(bigint) AS SELECT * FROM small WHERE key = $1;  
+EXECUTE lookup_small(2);  
+EXECUTE lookup_small(5000000000);  
+DEALLOCATE lookup_small;  
+SELECT * FROM small WHERE key > 5000000000;  
+SELECT * FROM small WHERE key <= 5000000000;  
+SELECT * FROM small WHERE key > -5000000000 AND key < 2;  
+DELETE FROM small WHERE key = ANY(ARRAY[2, 5000000000]);  
+SELECT * FROM small;  
+DROP FOREIGN TABLE small;  
+EXPLAIN (COSTS OFF) DELETE FROM test;  
+DELETE FROM test;  
+SELECT count(*) FROM test;  
 
 DROP FOREIGN TABLE test;  
+
+CREATE FOREIGN TABLE tuned(key TEXT, value TEXT) SERVER kv_server OPTIONS (compression 'none', bloom_bits_per_key '10', block_size '16kB');  
+INSERT INTO tuned VALUES('YC', 'VidarDB');  
+SELECT * FROM tuned;  
+SELECT kv_truncate('tuned');  
+SELECT count(*) FROM tuned;  
+DROP FOREIGN TABLE tuned;  
+
+CREATE FOREIGN TABLE queue(key TEXT, value TEXT) SERVER kv_server OPTIONS (deletion_trigger '10', deletion_window '100');  
+SET kv_fdw.compact_deletes_min = 10;  
+INSERT INTO queue SELECT lpad(i::text, 3, '0'), 'job' FROM generate_series(1, 100) i;  
+DELETE FROM queue WHERE key <= '050';  
+DELETE FROM queue WHERE key = '060';  
+SELECT count(*), min(key) FROM queue;  
+RESET kv_fdw.compact_deletes_min;  
+DROP FOREIGN TABLE queue;  
+CREATE FOREIGN TABLE queue(key TEXT, value TEXT) SERVER kv_server OPTIONS (deletion_trigger '0');  
+
+CREATE FOREIGN TABLE expiring(key TEXT, value TEXT) SERVER kv_server OPTIONS (ttl '1d');  
+INSERT INTO expiring VALUES('YC', 'VidarDB');  
+SELECT * FROM expiring;  
+SELECT count(*) FROM expiring;  
+DROP FOREIGN TABLE expiring;  
+CREATE FOREIGN TABLE expiring(key TEXT, value TEXT) SERVER kv_server OPTIONS (ttl '1s');  
+INSERT INTO expiring VALUES('YC', 'VidarDB'), ('California', 'Waterloo');  
+SELECT pg_sleep(2);  
+SELECT * FROM expiring;  
+DELETE FROM expiring WHERE key = 'YC';  
+DELETE FROM expiring;  
+INSERT INTO expiring VALUES('YC', 'VidarSQL');  
+SELECT * FROM expiring;  
+DROP FOREIGN TABLE expiring;  
+CREATE FOREIGN TABLE expiring(key TEXT, value TEXT) SERVER kv_server;  
+INSERT INTO expiring VALUES('YC', 'VidarDB');  
+ALTER FOREIGN TABLE expiring OPTIONS (ADD ttl '1d');  
+SELECT * FROM expiring;  
+DROP FOREIGN TABLE expiring;  
+
+CREATE FOREIGN TABLE tuned(key TEXT, value TEXT) SERVER kv_server OPTIONS (compaction_style 'tiered');  
+CREATE FOREIGN TABLE tuned(key TEXT, value TEXT) SERVER kv_server OPTIONS (compaction_style 'fifo');  
+CREATE FOREIGN TABLE tuned(key TEXT, value TEXT) SERVER kv_server OPTIONS (ttl '-1');  
+CREATE FOREIGN TABLE tuned(key TEXT, value TEXT) SERVER kv_server OPTIONS (block_cache '1GB');  
+CREATE ROLE kv_user;  
+GRANT USAGE ON FOREIGN SERVER kv_server TO kv_user;  
+SET ROLE kv_user;  
+CREATE FOREIGN TABLE tuned(key TEXT, value TEXT) SERVER kv_server OPTIONS (data_path '/tmp/kv');  
+CREATE FOREIGN TABLE tuned(key TEXT, value TEXT) SERVER kv_server OPTIONS (level_paths '/tmp/kv:1GB');  
+RESET ROLE;  
+REVOKE USAGE ON FOREIGN SERVER kv_server FROM kv_user;  
+DROP ROLE kv_user;  
+
+CREATE SERVER kv_shared FOREIGN DATA WRAPPER kv_fdw OPTIONS (layout 'database');  
+CREATE FOREIGN TABLE shared1(key TEXT, value TEXT) SERVER kv_shared;  
+CREATE FOREIGN TABLE shared2(key TEXT, value TEXT) SERVER kv_shared;  
+CREATE FOREIGN TABLE shared3(key TEXT, value TEXT) SERVER kv_shared OPTIONS (compression 'none');  
+INSERT INTO shared1 VALUES('YC', 'VidarDB');  
+INSERT INTO shared2 VALUES('California', 'Waterloo');  
+ALTER SERVER kv_shared OPTIONS (SET layout 'table');  
+ALTER SERVER kv_shared OPTIONS (ADD data_path '/tmp/kv');  
+ALTER FOREIGN TABLE shared1 OPTIONS (ADD compression 'none');  
+ALTER SERVER kv_shared OPTIONS (ADD compression 'none');  
+CREATE FUNCTION shared_note(note TEXT) RETURNS TEXT AS $$ BEGIN INSERT INTO shared2 VALUES(note || ' kept', 'function'); BEGIN INSERT INTO shared2 SELECT note || ' lost ' || i, (10 / (2 - i))::text FROM generate_series(1, 2) i; EXCEPTION WHEN division_by_zero THEN NULL; END; RETURN note; END $$ LANGUAGE plpgsql;  
+INSERT INTO shared1 SELECT shared_note(key), 'outer' FROM (VALUES ('a'), ('b')) v(key);  
+DROP FUNCTION shared_note(TEXT);  
+SELECT * FROM shared1;  
+DROP FOREIGN TABLE shared1;  
+SELECT * FROM shared2;  
+SELECT count(*) FROM shared2;  
+DROP FOREIGN TABLE shared2;  
+DROP SERVER kv_shared;  